@@ -0,0 +1,37 @@
+#!/bin/bash
+# Benchmark of the per-image latency of the latency mode (-p 3, each image marked by all the markers in -c row
+# bands) against the farms of chunks (-p 0 farm of pipes, -p 1 pipe of farms), over a sweep of -n. Each run
+# marks a fresh copy of the dataset, its elapsed time and load to save latencies (msecs) are printed as a
+# markdown table, ready to be pasted in the results section of the README.
+# Usage: bench/latency.sh [dataset] [n...]   e.g. bench/latency.sh big/ 1 2 4 8 16
+# REPS runs per point (3 by default), FLAGS extra ffwatermarker flags (e.g. "-c 64" or "-a spread").
+BIN=${BIN:-out}
+WMARK=${WMARK:-imgs/dataset5/1.jpg}
+REPS=${REPS:-3}
+MODES=${MODES:-"0 1 3"}
+SRC=${1:-imgs/dataset5/}
+shift
+SWEEP=${@:-1 2 4 8}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+fail(){ echo "FAIL: $1" >&2; exit 1; }
+
+[ -x $BIN/ffwatermarker ] || fail "$BIN/ffwatermarker not built (make ff)"
+echo "Host $(hostname), $(nproc) CPUs, $(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2 | sed 's/^ //')"
+echo "Dataset $SRC ($(ls $SRC | grep -c '\.jpg$') images), watermark $WMARK, flags: ${FLAGS:-none}, $REPS runs per point"
+echo
+echo "| -p | -n | run | msecs | min | avg | p50 | p99 | p99.9 | max |"
+echo "|---|---|---|---|---|---|---|---|---|---|"
+for n in $SWEEP; do
+	for p in $MODES; do
+		for rep in $(seq 1 $REPS); do
+			rm -rf $DIR/src && mkdir $DIR/src && cp $SRC/*.jpg $DIR/src/
+			$BIN/ffwatermarker -s $DIR/src/ -w $WMARK -i 30 -n $n -p $p $FLAGS > $DIR/log 2>&1 || fail "-p $p -n $n: $(tail -1 $DIR/log)"
+			msecs=$(grep "Elapsed time is" $DIR/log | awk '{print $4}')
+			latency=$(sed -n 's/^Per-image latency, load to save (.*= \(.*\))$/\1/p' $DIR/log)
+			[ -n "$latency" ] || fail "-p $p -n $n: no latency samples"
+			echo "| $p | $n | $rep | $msecs | ${latency// / | } |"
+		done
+	done
+done
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Benchmark of the FastFlow topologies: the all-to-all (-p 2) against the farm of pipes (-p 0) and the pipe of
+# farms (-p 1), over a sweep of -n. Each run marks a fresh copy of the dataset, its elapsed time and the Loaders,
+# Markers and Savers lines (tasks served, mean service time, busiest/mean busy ratio) are printed as a markdown
+# table, ready to be pasted in the results section of the README.
+# Usage: bench/topologies.sh [dataset] [n...]   e.g. bench/topologies.sh imgs/dataset5/ 1 2 4 8 16
+# REPS runs per point (3 by default), FLAGS extra ffwatermarker flags (e.g. "-q 4 -k 64" or "-a spread").
+BIN=${BIN:-out}
+WMARK=${WMARK:-imgs/dataset5/1.jpg}
+REPS=${REPS:-3}
+MODES=${MODES:-"0 1 2"}
+SRC=${1:-imgs/dataset5/}
+shift
+SWEEP=${@:-1 2 4 8}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+fail(){ echo "FAIL: $1" >&2; exit 1; }
+
+[ -x $BIN/ffwatermarker ] || fail "$BIN/ffwatermarker not built (make ff)"
+echo "Host $(hostname), $(nproc) CPUs, $(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2 | sed 's/^ //')"
+echo "Dataset $SRC ($(ls $SRC | grep -c '\.jpg$') images), watermark $WMARK, flags: ${FLAGS:-none}, $REPS runs per point"
+echo
+echo "| -p | -n | run | msecs | Loaders | Markers | Savers |"
+echo "|---|---|---|---|---|---|---|"
+for n in $SWEEP; do
+	for p in $MODES; do
+		for rep in $(seq 1 $REPS); do
+			rm -rf $DIR/src && mkdir $DIR/src && cp $SRC/*.jpg $DIR/src/
+			$BIN/ffwatermarker -s $DIR/src/ -w $WMARK -i 30 -n $n -p $p $FLAGS > $DIR/log 2>&1 || fail "-p $p -n $n: $(tail -1 $DIR/log)"
+			msecs=$(grep "Elapsed time is" $DIR/log | awk '{print $4}')
+			loaders=$(sed -n 's/^Loaders: //p' $DIR/log)
+			markers=$(sed -n 's/^Markers: //p' $DIR/log)
+			savers=$(sed -n 's/^Savers: //p' $DIR/log)
+			echo "| $p | $n | $rep | $msecs | $loaders | $markers | $savers |"
+		done
+	done
+done
@@ -0,0 +1,182 @@
+#include <dirent.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cinttypes>
+#include "autotune.h"
+#include "topology.h"
+
+#define AUTOTUNE_HEADER "# watermarker autotune v2\n"	// v1 records, without the watermark fingerprint, are ignored
+
+// Function to get the power of 2 closest to a value, so that small changes of the dataset keep its signature
+static long long round_pow2(double value){
+	return value < 1 ? 0 : 1LL << (int) std::lround(std::log2(value));
+}
+
+// Function to get the signature of the host: hostname, CPUs the process can run on and CPU model
+std::string host_signature(){
+	char host[256] = "";
+	gethostname(host, sizeof(host) - 1);
+	std::string model, line;
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	while (model.empty() && std::getline(cpuinfo, line))
+		if (line.compare(0, 10, "model name") == 0)
+			model = line.substr(line.find(':') + 1);
+	std::stringstream s;
+	s << host << "/" << read_topology().cpus.size() << "/" << model;
+	uint64_t hash = hash_bytes(&s.str()[0u], s.str().size());
+	char sig[17];
+	std::snprintf(sig, sizeof(sig), "%016" PRIx64, hash);
+	return sig;
+}
+
+// Function to get the signature of a dataset: number of images and mean file size, both rounded to powers of 2
+std::string dataset_signature(const std::vector<std::string>& paths){
+	double bytes = 0;
+	for (const std::string& path : paths){
+		struct stat st;
+		if (stat(&path[0u], &st) == 0)
+			bytes += st.st_size;
+	}
+	std::stringstream s;
+	s << round_pow2(paths.size()) << "x" << round_pow2(paths.empty() ? 0 : bytes / paths.size());
+	return s.str();
+}
+
+// Function to calibrate on a sample of the images, outputs go to scratch_path and are removed
+stage_times calibrate(const std::vector<std::string>& paths, const std::string& scratch_path, const prepared_wmark * wmark, float intensity){
+	stage_times times = {0, 0, 0, 0};
+	int step = std::max(1, (int) paths.size() / TUNE_SAMPLE);
+	for (unsigned int i = 0; i < paths.size() && times.images < TUNE_SAMPLE; i += step){
+		cimg_library::CImg<float> img;
+		try{
+			auto start = std::chrono::high_resolution_clock::now();
+			img.load(&(paths[i])[0u]);
+			auto loaded = std::chrono::high_resolution_clock::now();
+			img_chunk whole = {0, 0, img.height() - 1, img.width() - 1};
+			mark_chunk(&img, &whole, wmark, intensity);
+			auto marked = std::chrono::high_resolution_clock::now();
+			img.save(&scratch_path[0u]);
+			auto saved = std::chrono::high_resolution_clock::now();
+			times.load += std::chrono::duration_cast<std::chrono::microseconds>(loaded - start).count();
+			times.mark += std::chrono::duration_cast<std::chrono::microseconds>(marked - loaded).count();
+			times.save += std::chrono::duration_cast<std::chrono::microseconds>(saved - marked).count();
+			times.images += 1;
+		}catch (const cimg_library::CImgException& e) {
+			std::cerr << "Autotune: skipping " << paths[i] << ": " << e.what() << std::endl;
+		}
+	}
+	std::remove(&scratch_path[0u]);
+	if (times.images > 0){
+		times.load /= times.images;
+		times.mark /= times.images;
+		times.save /= times.images;
+	}
+	return times;
+}
+
+// Function to pick the configuration for n_images images over n_cores cores
+tune_config pick_config(const stage_times& times, int n_images, int n_cores){
+	n_cores = std::max(1, n_cores);
+	n_images = std::max(1, n_images);
+	double load = std::max(1.0, times.load), mark = std::max(1.0, times.mark), save = std::max(1.0, times.save);
+	double total = load + mark + save, slowest = std::max(load, std::max(mark, save));
+
+	// Pipe of farms: the workers of each stage in proportion to its service time, at least one each, the
+	// makespan is set by the bottleneck stage plus the time for the first image to go through
+	tune_config farms;
+	farms.par_type = 1;
+	farms.loaders = std::max(1, (int) std::lround(n_cores * load / total));
+	farms.markers = std::max(1, (int) std::lround(n_cores * mark / total));
+	farms.savers = std::max(1, (int) std::lround(n_cores * save / total));
+	farms.chunks = std::max(1, std::min(farms.markers, (int) (mark / TUNE_CHUNK_USECS)));
+	double bottleneck = std::max(load / farms.loaders, std::max(mark / farms.markers, save / farms.savers));
+	double farms_time = n_images * bottleneck + load + mark / farms.chunks + save;
+
+	// Farm of pipes: each pipe keeps total / slowest cores busy, and takes whole images through the stages
+	// without handing chunks over, but there can't be more pipes than images
+	tune_config pipes;
+	pipes.par_type = 0;
+	pipes.loaders = pipes.markers = pipes.savers = std::max(1, std::min(n_images, (int) std::lround(n_cores * slowest / total)));
+	pipes.chunks = 1;
+	double pipes_time = std::ceil((double) n_images / pipes.markers) * slowest + total - slowest;
+
+	std::cout << "Autotune: predicted " << (long) pipes_time / 1000 << " msecs with -p 0, " << (long) farms_time / 1000 << " msecs with -p 1" << std::endl;
+	return pipes_time <= farms_time ? pipes : farms;
+}
+
+// Function to describe a configuration (e.g. "-p 1, 2 loaders, 5 markers, 1 savers, 4 chunks")
+std::string describe_config(const tune_config& config){
+	std::stringstream s;
+	s << "-p " << config.par_type << ", " << config.loaders << " loaders, " << config.markers << " markers, "
+		<< config.savers << " savers, " << config.chunks << " chunks";
+	return s.str();
+}
+
+// Function to tune the run on the images of src_path, from watermarked/.autotune if it holds the configuration
+// of this host, dataset and watermark, calibrating and storing it otherwise. Returns false if no image could be calibrated on
+bool autotune(const std::string& src_path, const std::string& wmark_file, const prepared_wmark * wmark, float intensity, tune_config * config){
+	std::vector<std::string> paths;
+	DIR * dirp = opendir(&src_path[0u]);
+	if (dirp){
+		struct dirent * directory;
+		while ((directory = readdir(dirp)) != NULL)
+			if (strendswith(directory -> d_name, ".jpg"))
+				paths.push_back(src_path + directory -> d_name);
+		closedir(dirp);
+	}
+	std::sort(paths.begin(), paths.end());
+	std::string host = host_signature(), dataset = dataset_signature(paths);
+	std::string cache_path = src_path + "watermarked/.autotune";
+
+	// The watermark size sets the marking time, a record made with another watermark doesn't apply
+	uint64_t wmark_fp = 0;
+	if (!hash_file(wmark_file, &wmark_fp))
+		std::cerr << "Autotune: error fingerprinting watermark " << wmark_file << std::endl;
+	char fingerprint[17];
+	std::snprintf(fingerprint, sizeof(fingerprint), "%016" PRIx64, wmark_fp);
+
+	// The last record of this host, dataset and watermark wins
+	bool cached = false;
+	std::ifstream cache(cache_path);
+	std::string line;
+	while (std::getline(cache, line)){
+		if (line.empty() || line[0] == '#')
+			continue;
+		std::stringstream fields(line);
+		std::string h, d, w;
+		tune_config c;
+		if (fields >> h >> d >> w >> c.loaders >> c.markers >> c.savers >> c.chunks >> c.par_type && h == host && d == dataset && w == fingerprint){
+			*config = c;
+			cached = true;
+		}
+	}
+	if (cached){
+		std::cout << "Autotune: cached configuration for host " << host << ", dataset " << dataset << " and watermark " << fingerprint << ": " << describe_config(*config) << std::endl;
+		return true;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	stage_times times = calibrate(paths, src_path + "watermarked/.autotune.jpg", wmark, intensity);
+	if (times.images == 0)
+		return false;
+	*config = pick_config(times, paths.size(), read_topology().cpus.size());
+	auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << "Autotune: calibrated on " << times.images << " images in " << msec << " msecs, load " << (long) times.load
+		<< " mark " << (long) times.mark << " save " << (long) times.save << " usecs per image: " << describe_config(*config) << std::endl;
+
+	std::FILE * file = std::fopen(&cache_path[0u], "a");
+	if (!file){
+		std::cerr << "Autotune: failed to store the configuration in " << cache_path << std::endl;
+		return true;
+	}
+	if (std::ftell(file) == 0)
+		std::fputs(AUTOTUNE_HEADER, file);
+	std::fprintf(file, "%s\t%s\t%s\t%d\t%d\t%d\t%d\t%d\n", host.c_str(), dataset.c_str(), fingerprint, config -> loaders, config -> markers,
+		config -> savers, config -> chunks, config -> par_type);
+	std::fclose(file);
+	return true;
+}
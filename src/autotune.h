@@ -0,0 +1,58 @@
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+
+#include <string>
+#include <vector>
+#include "wmark.h"
+
+/***
+	Autotuning of the parallelism degree, chunks and topology from a short calibration.
+	A sample of the input images is loaded, marked and saved by one thread, the mean service time of each stage
+	gives the workers of each stage (in proportion to its time, over the cores the process can run on), the
+	chunks per image (no chunk shorter than TUNE_CHUNK_USECS) and the topology whose predicted makespan is the
+	shortest. The configuration is stored in watermarked/.autotune keyed by host, dataset signature and watermark
+	fingerprint, so that later runs on the same host, a similar dataset and the same watermark start tuned without
+	calibrating again.
+***/
+
+#define TUNE_SAMPLE 8			// Images calibrated on
+#define TUNE_CHUNK_USECS 2000	// Shortest marking time worth a chunk of its own
+
+// Data structure defining a configuration, par_type is 0 for the farm of pipes and 1 for the pipe of farms
+struct tune_config{
+	int loaders;
+	int markers;
+	int savers;
+	int chunks;
+	int par_type;
+};
+
+// Data structure defining the mean service time of each stage on one thread (usecs per image)
+struct stage_times{
+	double load;
+	double mark;
+	double save;
+	int images;	// Images calibrated on, 0 if none could be
+};
+
+// Function to get the signature of the host: hostname, CPUs the process can run on and CPU model
+std::string host_signature();
+
+// Function to get the signature of a dataset: number of images and mean file size, both rounded to powers of 2
+std::string dataset_signature(const std::vector<std::string>& paths);
+
+// Function to calibrate on a sample of the images, outputs go to scratch_path and are removed
+stage_times calibrate(const std::vector<std::string>& paths, const std::string& scratch_path, const prepared_wmark * wmark, float intensity);
+
+// Function to pick the configuration for n_images images over n_cores cores
+tune_config pick_config(const stage_times& times, int n_images, int n_cores);
+
+// Function to describe a configuration (e.g. "-p 1, 2 loaders, 5 markers, 1 savers, 4 chunks")
+std::string describe_config(const tune_config& config);
+
+// Function to tune the run on the images of src_path, from watermarked/.autotune if it holds the configuration
+// of this host, dataset and watermark (wmark_file is the watermark wmark was prepared from), calibrating and storing
+// it otherwise. Returns false if no image could be calibrated on
+bool autotune(const std::string& src_path, const std::string& wmark_file, const prepared_wmark * wmark, float intensity, tune_config * config);
+
+#endif
@@ -0,0 +1,178 @@
+#include "cache.h"
+#include "my_utils.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <cerrno>
+#include <cinttypes>
+
+// Function to make dst a copy of src, sharing its blocks copy-on-write where the file system can clone.
+// Never a hard link: the savers rewrite existing outputs in place, which would change the cache object and
+// every other output linked to it
+static bool clone_or_copy(const std::string& src, const std::string& dst){
+	unlink(&dst[0u]);
+	std::FILE * in = std::fopen(&src[0u], "rb");
+	if (!in)
+		return false;
+	std::FILE * out = std::fopen(&dst[0u], "wb");
+	if (!out){
+		std::fclose(in);
+		return false;
+	}
+	if (ioctl(fileno(out), FICLONE, fileno(in)) == 0){
+		std::fclose(in);
+		return std::fclose(out) == 0;
+	}
+	char buffer[1 << 16];
+	size_t n;
+	bool ok = true;
+	while (ok && (n = std::fread(buffer, 1, sizeof(buffer), in)) > 0)
+		ok = std::fwrite(buffer, 1, n, out) == n;
+	ok = ok && !std::ferror(in);
+	std::fclose(in);
+	ok = (std::fclose(out) == 0) && ok;
+	return ok;
+}
+
+output_cache::output_cache(std::string dir, uint64_t wmark_fp, int intensity, manifest * done_manifest)
+	: m_dir(dir), m_wmark_fp(wmark_fp), m_intensity(intensity), m_manifest(done_manifest), m_lookups(0), m_hits(0)
+{
+}
+
+// Look up an input before decoding it, the key is returned to be passed to store() or abort()
+cache_result output_cache::fetch(const std::string& in_path, const std::string& out_path, uint64_t * key, void * context){
+	m_lookups += 1;
+	uint64_t content_hash;
+	if (!hash_file(in_path, &content_hash)){
+		// Let the caller report the error when loading, 0 marks the image as not cached
+		*key = 0;
+		return CACHE_MISS;
+	}
+	*key = hash_bytes(&m_wmark_fp, sizeof(m_wmark_fp), content_hash);
+	*key = hash_bytes(&m_intensity, sizeof(m_intensity), *key);
+	if (*key == 0)
+		*key = 1;
+
+	std::string object = object_path(*key);
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto waiting = m_in_flight.find(*key);
+		if (waiting != m_in_flight.end()){
+			waiting -> second.push_back(cache_waiter{in_path, out_path, context, false});
+			m_hits += 1;
+			return CACHE_PENDING;
+		}
+		// Objects hard-linked to outputs (by earlier versions) may have been rewritten through them, drop them
+		struct stat st;
+		if (stat(&object[0u], &st) == 0 && st.st_nlink > 1)
+			unlink(&object[0u]);
+		if (access(&object[0u], F_OK) != 0){
+			m_in_flight[*key];
+			return CACHE_MISS;
+		}
+	}
+	if (clone_or_copy(object, out_path)){
+		m_hits += 1;
+		if (m_manifest)
+			m_manifest -> record(in_path, out_path);
+		return CACHE_HIT;
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto waiting = m_in_flight.find(*key);
+	if (waiting != m_in_flight.end()){
+		waiting -> second.push_back(cache_waiter{in_path, out_path, context, false});
+		m_hits += 1;
+		return CACHE_PENDING;
+	}
+	m_in_flight[*key];
+	return CACHE_MISS;
+}
+
+// Publish the output of a key and copy it to the identical images that were waiting for it
+void output_cache::store(uint64_t key, const std::string& out_path, std::vector<cache_waiter> * released){
+	if (key == 0)
+		return;
+	// Publish through a temporary name so other workers and processes never see a partial object
+	std::string object = object_path(key);
+	std::string tmp = object + ".tmp." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	bool published = clone_or_copy(out_path, tmp) && rename(&tmp[0u], &object[0u]) == 0;
+	if (!published){
+		unlink(&tmp[0u]);
+		std::cerr << "Error adding " << out_path << " to the cache" << std::endl;
+	}
+
+	std::vector<cache_waiter> waiting;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_in_flight.find(key);
+		if (it != m_in_flight.end()){
+			waiting.swap(it -> second);
+			m_in_flight.erase(it);
+		}
+	}
+	for (auto& w : waiting){
+		w.copied = clone_or_copy(published ? object : out_path, w.out_path);
+		if (w.copied){
+			if (m_manifest)
+				m_manifest -> record(w.in_path, w.out_path);
+		}
+		else
+			std::cerr << "Error copying cached image " << w.out_path << ": " << strerror(errno) << std::endl;
+	}
+	if (released)
+		released -> insert(released -> end(), waiting.begin(), waiting.end());
+}
+
+// Give up on a key (e.g. the image couldn't be processed)
+void output_cache::abort(uint64_t key, std::vector<cache_waiter> * released){
+	if (key == 0)
+		return;
+	std::vector<cache_waiter> waiting;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_in_flight.find(key);
+		if (it != m_in_flight.end()){
+			waiting.swap(it -> second);
+			m_in_flight.erase(it);
+		}
+	}
+	// The waiting images have the very same bytes, so they would fail as well
+	for (auto& w : waiting){
+		m_hits -= 1;
+		std::cerr << "Error processing image " << w.in_path << ": identical to an image that failed" << std::endl;
+	}
+	if (released)
+		released -> insert(released -> end(), waiting.begin(), waiting.end());
+}
+
+// Report lookups, hits and hit rate
+void output_cache::report(){
+	long lookups = m_lookups, hits = m_hits;
+	std::cout << "Dedupe cache: " << hits << " hits out of " << lookups << " lookups ("
+		<< (lookups > 0 ? 100.0 * hits / lookups : 0.0) << "% hit rate)" << std::endl;
+}
+
+std::string output_cache::object_path(uint64_t key){
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016" PRIx64 ".jpg", key);
+	return m_dir + name;
+}
+
+// Function to create the output cache in src_path/watermarked/.cache for the given watermark and intensity, nullptr on failure.
+// The outputs copied from the cache are recorded in the manifest, if given.
+output_cache * open_cache(const std::string& src_path, const std::string& wmark_file, float intensity, manifest * done_manifest, uint64_t variant){
+	uint64_t wmark_fp;
+	if (!hash_file(wmark_file, &wmark_fp)){
+		std::cerr << "Error fingerprinting watermark " << wmark_file << std::endl;
+		return nullptr;
+	}
+	if (variant != 0)
+		wmark_fp = hash_bytes(&variant, sizeof(variant), wmark_fp);
+	std::string dir = src_path + "/watermarked/.cache/";
+	if (mkdir(&dir[0u], 0700) != 0 && errno != EEXIST){
+		std::cerr << "Error creating cache directory " << dir << ": " << strerror(errno) << std::endl;
+		return nullptr;
+	}
+	return new output_cache(dir, wmark_fp, (int)(intensity * 100 + 0.5), done_manifest);
+}
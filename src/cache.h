@@ -0,0 +1,72 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include "manifest.h"
+
+/***
+	Content-addressed cache of the watermarked outputs.
+	Inputs are keyed by the hash of their compressed bytes, the watermark fingerprint and the intensity,
+	so byte-identical images are decoded, marked and encoded only once: the other copies get their output
+	cloned (or copied) from the cache directory. Objects and outputs never share an inode, as the savers
+	rewrite outputs in place. Cache objects are published with an atomic rename, so several workers or
+	processes can share the same cache directory.
+***/
+
+enum cache_result{
+	CACHE_MISS,		// the caller owns the key and has to process the image, then call store() or abort()
+	CACHE_HIT,		// the output has been copied from the cache
+	CACHE_PENDING	// an identical image is being processed, the output will be copied when it is stored
+};
+
+// An image waiting for an identical one being processed, handed back by store() or abort() with the context
+// given to fetch(), so the caller can account for it once its output exists (or can't)
+struct cache_waiter{
+	std::string in_path;
+	std::string out_path;
+	void * context;
+	bool copied;
+};
+
+class output_cache{
+public:
+	output_cache(std::string dir, uint64_t wmark_fp, int intensity, manifest * done_manifest);
+
+	// Look up an input before decoding it, the key is returned to be passed to store() or abort().
+	// On CACHE_PENDING, context is handed back by the store() or abort() of the identical image.
+	cache_result fetch(const std::string& in_path, const std::string& out_path, uint64_t * key, void * context = nullptr);
+
+	// Publish the output of a key and copy it to the identical images that were waiting for it,
+	// which are appended to released if given
+	void store(uint64_t key, const std::string& out_path, std::vector<cache_waiter> * released = nullptr);
+
+	// Give up on a key (e.g. the image couldn't be processed), the waiting images are appended to released if given
+	void abort(uint64_t key, std::vector<cache_waiter> * released = nullptr);
+
+	// Report lookups, hits and hit rate
+	void report();
+
+private:
+	std::string m_dir;
+	uint64_t m_wmark_fp;
+	int m_intensity;
+	std::mutex m_mutex;
+	manifest * m_manifest;
+	// Images waiting for a key that is being processed
+	std::unordered_map<uint64_t, std::vector<cache_waiter>> m_in_flight;
+	std::atomic<long> m_lookups;
+	std::atomic<long> m_hits;
+
+	std::string object_path(uint64_t key);
+};
+
+// Function to create the output cache in src_path/watermarked/.cache for the given watermark and intensity, nullptr on failure.
+// The outputs copied from the cache are recorded in the manifest, if given, variant is folded in the fingerprint as in open_manifest.
+output_cache * open_cache(const std::string& src_path, const std::string& wmark_file, float intensity, manifest * done_manifest, uint64_t variant = 0);
+
+#endif
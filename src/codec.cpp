@@ -0,0 +1,162 @@
+#include "codec.h"
+
+// Function to be set as error_exit of a codec_error_mgr, longjmps to setjmp_buffer
+void codec_error_exit(j_common_ptr cinfo){
+	codec_error_mgr * err = (codec_error_mgr *) cinfo -> err;
+	(*cinfo -> err -> format_message)(cinfo, err -> message);
+	longjmp(err -> setjmp_buffer, 1);
+}
+
+// Function to decode a JPEG image from a file or from memory, scaled down by scale_denom in the DCT domain
+static void decode(std::FILE * in, const unsigned char * data, size_t size, cimg_library::CImg<float> * img, int scale_denom){
+	struct jpeg_decompress_struct cinfo;
+	codec_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr.original);
+	jerr.original.error_exit = codec_error_exit;
+	unsigned char * volatile row = nullptr;
+	if (setjmp(jerr.setjmp_buffer)){
+		jpeg_destroy_decompress(&cinfo);
+		delete[] row;
+		throw cimg_library::CImgIOException("decode_jpeg(): %s", jerr.message);
+	}
+	jpeg_create_decompress(&cinfo);
+	if (in)
+		jpeg_stdio_src(&cinfo, in);
+	else
+		jpeg_mem_src(&cinfo, (unsigned char *) data, size);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = scale_denom;
+	jpeg_start_decompress(&cinfo);
+	int width = cinfo.output_width, height = cinfo.output_height, channels = cinfo.output_components;
+	img -> assign(width, height, 1, channels);
+	row = new unsigned char[width * channels];
+	while (cinfo.output_scanline < cinfo.output_height){
+		int y = cinfo.output_scanline;
+		JSAMPROW rows[1] = {row};
+		if (jpeg_read_scanlines(&cinfo, rows, 1) != 1)
+			break;
+		for (int c = 0; c < channels; c++){
+			float * dst = img -> data(0, y, 0, c);
+			const unsigned char * src = row + c;
+			for (int x = 0; x < width; x++, src += channels)
+				dst[x] = *src;
+		}
+	}
+	delete[] row;
+	row = nullptr;
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+}
+
+// Function to decode a JPEG image held in memory
+void decode_jpeg(const unsigned char * data, size_t size, cimg_library::CImg<float> * img, int scale_denom){
+	decode(nullptr, data, size, img, scale_denom);
+}
+
+// Function to decode a JPEG file
+void decode_jpeg_file(const std::string& path, cimg_library::CImg<float> * img, int scale_denom){
+	std::FILE * in = std::fopen(&path[0u], "rb");
+	if (!in)
+		throw cimg_library::CImgIOException("decode_jpeg_file(): Failed to open file '%s' for reading.", path.c_str());
+	try{
+		decode(in, nullptr, 0, img, scale_denom);
+	}catch (const cimg_library::CImgIOException&) {
+		std::fclose(in);
+		throw;
+	}
+	std::fclose(in);
+}
+
+// Function to read the size of a JPEG image from its header, from a file or from memory
+static void read_size(std::FILE * in, const unsigned char * data, size_t size, int * width, int * height){
+	struct jpeg_decompress_struct cinfo;
+	codec_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr.original);
+	jerr.original.error_exit = codec_error_exit;
+	if (setjmp(jerr.setjmp_buffer)){
+		jpeg_destroy_decompress(&cinfo);
+		throw cimg_library::CImgIOException("jpeg_size(): %s", jerr.message);
+	}
+	jpeg_create_decompress(&cinfo);
+	if (in)
+		jpeg_stdio_src(&cinfo, in);
+	else
+		jpeg_mem_src(&cinfo, (unsigned char *) data, size);
+	jpeg_read_header(&cinfo, TRUE);
+	*width = cinfo.image_width;
+	*height = cinfo.image_height;
+	jpeg_destroy_decompress(&cinfo);
+}
+
+// Function to read the size of a JPEG file from its header, without decoding it
+void jpeg_file_size(const std::string& path, int * width, int * height){
+	std::FILE * in = std::fopen(&path[0u], "rb");
+	if (!in)
+		throw cimg_library::CImgIOException("jpeg_file_size(): Failed to open file '%s' for reading.", path.c_str());
+	try{
+		read_size(in, nullptr, 0, width, height);
+	}catch (const cimg_library::CImgIOException&) {
+		std::fclose(in);
+		throw;
+	}
+	std::fclose(in);
+}
+
+// Function to read the size of a JPEG image held in memory from its header, without decoding it
+void jpeg_size(const unsigned char * data, size_t size, int * width, int * height){
+	read_size(nullptr, data, size, width, height);
+}
+
+// Function to pick the largest DCT scale denominator (1, 2, 4 or 8) whose output still covers the given size
+int pick_scale(int width, int height, int min_width, int min_height){
+	int denom = 8;
+	// libjpeg rounds the scaled size up
+	while (denom > 1 && ((width + denom - 1) / denom < min_width || (height + denom - 1) / denom < min_height))
+		denom /= 2;
+	return denom;
+}
+
+// Function to encode an image as JPEG into memory, same default quality as CImg::save
+void encode_jpeg(const cimg_library::CImg<float>& img, std::vector<unsigned char> * out, int quality){
+	int width = img.width(), height = img.height(), channels = img.spectrum() >= 3 ? 3 : 1;
+	struct jpeg_compress_struct cinfo;
+	codec_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr.original);
+	jerr.original.error_exit = codec_error_exit;
+	unsigned char * buffer = nullptr;
+	unsigned long size = 0;
+	unsigned char * volatile row = nullptr;
+	if (setjmp(jerr.setjmp_buffer)){
+		jpeg_destroy_compress(&cinfo);
+		free(buffer);
+		delete[] row;
+		throw cimg_library::CImgIOException("encode_jpeg(): %s", jerr.message);
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &buffer, &size);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = channels;
+	cinfo.in_color_space = channels == 3 ? JCS_RGB : JCS_GRAYSCALE;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	row = new unsigned char[width * channels];
+	while (cinfo.next_scanline < cinfo.image_height){
+		int y = cinfo.next_scanline;
+		for (int c = 0; c < channels; c++){
+			const float * src = img.data(0, y, 0, c);
+			unsigned char * dst = row + c;
+			for (int x = 0; x < width; x++, dst += channels)
+				*dst = (unsigned char) src[x];
+		}
+		JSAMPROW rows[1] = {row};
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	out -> assign(buffer, buffer + size);
+	free(buffer);
+	delete[] row;
+}
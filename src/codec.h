@@ -0,0 +1,47 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <cstdio>
+#include <csetjmp>
+#include <vector>
+#include <string>
+#include <jpeglib.h>
+#include "CImg.h"
+
+/***
+	JPEG codec layer on top of libjpeg, for the paths that must not go through files
+	(CImg can only load and save JPEG images from files). Errors are reported by throwing
+	CImgIOException, as the CImg loaders and savers do.
+***/
+
+// Error manager returning control to the caller instead of exiting, shared by the libjpeg users
+struct codec_error_mgr{
+	struct jpeg_error_mgr original;
+	jmp_buf setjmp_buffer;
+	char message[JMSG_LENGTH_MAX];
+};
+
+// Function to be set as error_exit of a codec_error_mgr, longjmps to setjmp_buffer
+void codec_error_exit(j_common_ptr cinfo);
+
+// Function to decode a JPEG image held in memory. With scale_denom 2, 4 or 8 the image is scaled down in the
+// DCT domain while decoding (only the low frequencies are brought back to pixels), so decoding costs and takes
+// up to 64 times less than decoding the whole image and resampling it
+void decode_jpeg(const unsigned char * data, size_t size, cimg_library::CImg<float> * img, int scale_denom = 1);
+
+// Function to decode a JPEG file, scaled down by scale_denom as decode_jpeg
+void decode_jpeg_file(const std::string& path, cimg_library::CImg<float> * img, int scale_denom = 1);
+
+// Function to read the size of a JPEG file from its header, without decoding it
+void jpeg_file_size(const std::string& path, int * width, int * height);
+
+// Function to read the size of a JPEG image held in memory from its header, without decoding it
+void jpeg_size(const unsigned char * data, size_t size, int * width, int * height);
+
+// Function to pick the largest DCT scale denominator (1, 2, 4 or 8) whose output still covers the given size
+int pick_scale(int width, int height, int min_width, int min_height);
+
+// Function to encode an image as JPEG into memory, same default quality as CImg::save
+void encode_jpeg(const cimg_library::CImg<float>& img, std::vector<unsigned char> * out, int quality = 100);
+
+#endif
@@ -1,21 +1,283 @@
 /***
 	Parallel version of the program using FastFlow (see @ https://github.com/fastflow/fastflow).
 	Loading and saving are parallelized as well, thus defining a proper loading-marking-saving pipeline.
+	Three topologies: a farm of pipes (-p 0), a pipe of farms (-p 1), and an all-to-all (-p 2) in which the
+	loaders send the chunks straight to the markers and each marker its completed images straight to its
+	saver, without the emitters and collectors of the farms in between.
 ***/
 #include <ff/farm.hpp>
 #include <ff/pipeline.hpp>
+#include <ff/all2all.hpp>
+#include <ff/allocator.hpp>
+#include <ff/parallel_for.hpp>
 #include <dirent.h> 
+#include <getopt.h>
 #include <sstream>
 #include <climits>
 #include <mutex>
+#include <functional>
 #include "queue.h"
 #include "my_utils.h"
+#include "manifest.h"
+#include "cache.h"
+#include "wmark.h"
+#include "topology.h"
+#include "autotune.h"
 
 std::mutex my_lock;
+
+// Load to save latency of each image (usecs)
+std::mutex latency_lock;
+std::vector<long> latencies;
 std::atomic<int> processed;
+std::atomic<int> skipped;
 
 // Watermark - global as it's only loaded once then workers just read off it
 cimg_library::CImg<float> * wmark;
+prepared_wmark * prepared;
+
+// Manifest of the already processed images (only in incremental mode)
+manifest * done_manifest = nullptr;
+
+// Cache of the outputs of byte-identical images (only in dedupe mode)
+output_cache * dedupe_cache = nullptr;
+
+// Placement of the nodes, compute for the markers and io for the loaders then the savers
+affinity_plan plan;
+
+// Function to pin the thread of a node, FastFlow's default mapping is kept when not pinning
+void pin_node(const char * name, int cpu){
+	if (cpu >= 0 && ff::ff_mapThreadToCpu(cpu) != 0)
+		std::cerr << "Failed to pin " << name << " to CPU " << cpu << std::endl;
+}
+
+// Function to set the scheduling of a farm: round robin (FastFlow's default) when depth is 0, on demand with
+// worker queues of depth entries otherwise, and ordered (outputs in the order of the inputs) if asked
+void schedule_farm(ff::ff_Farm<task> * farm, int depth, bool ordered){
+	if (depth > 0)
+		farm -> set_scheduling_ondemand(depth);
+	if (ordered)
+		farm -> set_ordered();
+}
+
+// Function to list the images of a directory, without the ones already up to date (only in incremental mode)
+std::vector<std::string> list_images(const std::string& src_path){
+	std::vector<std::string> names;
+	DIR *dirp;
+	struct dirent *directory;
+	dirp = opendir(&src_path[0u]);
+	if (dirp){
+		while ((directory = readdir(dirp)) != NULL){
+			if (strendswith(directory->d_name, ".jpg")){
+				if (done_manifest && done_manifest -> up_to_date(src_path+"/"+directory->d_name, src_path+"/watermarked/"+directory->d_name)){
+					skipped += 1;
+					continue;
+				}
+				names.push_back(directory -> d_name);
+			}
+		}
+		closedir(dirp);
+	}
+	return names;
+}
+
+// Free lists of the pixel buffers and descriptors that came back from the savers (only in recycling mode)
+struct spares{
+	std::vector<cimg_library::CImg<float> *> imgs;
+	std::vector<img_chunk *> chunks;
+	std::vector<std::atomic<int> *> counters;
+	std::vector<task *> tasks;
+	std::vector<task_batch *> batches;
+	std::vector<img_chunk *> split;	// Chunks of the image being loaded
+	std::string load_path, save_path;	// Paths of the image being loaded, keeping their capacity
+};
+
+// Function to take an object from a free list, a new one if the list is empty (or there is none)
+template <typename T>
+T * take(std::vector<T *> * free){
+	if (!free || free -> empty())
+		return new T;
+	T * t = free -> back();
+	free -> pop_back();
+	return t;
+}
+
+// Function to allocate the path of an image sent to the loaders, from FastFlow's allocator (the strings, when
+// longer than their inline buffer, still come from the heap)
+split_path * new_split_path(const std::string& prefix, const std::string& suffix){
+	split_path * sp = new (ff::ff_malloc(sizeof(split_path))) split_path;
+	sp -> prefix = prefix;
+	sp -> suffix = suffix;
+	return sp;
+}
+
+// Function to free the path of an image
+void free_split_path(split_path * sp){
+	sp -> ~split_path();
+	ff::ff_free(sp);
+}
+
+// Function to load an image and split it into chunks, added to the open batch which is handed to send once large enough
+// (every chunk without batching). Buffers and descriptors are taken from free if given
+void load_image(split_path * img_path, int n_chunks, long batch_pixels, task_batch ** open, const std::function<void(task_batch *)>& send, spares * free = nullptr){
+	// The paths are built once per image, in buffers that keep their capacity when recycling
+	std::string fresh_load, fresh_save;
+	std::string& load_path = free ? free -> load_path : fresh_load;
+	std::string& save_path = free ? free -> save_path : fresh_save;
+	load_path.assign(img_path -> prefix).append(img_path -> suffix);
+	save_path.assign(img_path -> prefix).append("watermarked/").append(img_path -> suffix);
+
+	// Identical images are marked only once
+	uint64_t key = 0;
+	if (dedupe_cache && dedupe_cache -> fetch(load_path, save_path, &key) != CACHE_MISS){
+		free_split_path(img_path);
+		return;
+	}
+
+	// Load the image, a recycled buffer of the same size is decoded into without reallocating
+	auto started = std::chrono::steady_clock::now();
+	cimg_library::CImg<float> * img = take(free ? &free -> imgs : nullptr);
+	try{
+		img -> load(load_path.c_str());
+	
+		// Split the image into chunks, small images go whole when batching
+		std::vector<img_chunk*> fresh, * chunks = free ? &free -> split : &fresh;
+		chunks -> clear();
+		chunker(img, batch_chunks(img, n_chunks, batch_pixels), chunks, free ? &free -> chunks : nullptr);
+		std::atomic<int> * num_chunks = take(free ? &free -> counters : nullptr);
+		*num_chunks = chunks -> size();
+
+		for (unsigned int i = 0; i < chunks -> size(); i++){
+			task *t = take(free ? &free -> tasks : nullptr);
+			t -> img = img;
+			t -> save_path.assign(save_path);
+			t -> load_path.assign(load_path);
+			t -> cache_key = key;
+			t -> started = started;
+			t -> chunk = chunks -> at(i);
+			t -> n_chunks = num_chunks; 
+			if (!*open){
+				*open = take(free ? &free -> batches : nullptr);
+				(*open) -> pixels = 0;
+			}
+			(*open) -> tasks.push_back(t);
+			(*open) -> pixels += (long) img -> width() * img -> height() / chunks -> size();
+			if ((*open) -> pixels >= batch_pixels){
+				send(*open);
+				*open = nullptr;
+			}
+		}
+	}catch (const cimg_library::CImgIOException& e) {
+	    std::cerr << "Error reading image " << load_path << ": " << e.what() << std::endl;
+		if (free)
+			free -> imgs.push_back(img);
+		else
+			delete(img);
+		if (dedupe_cache)
+			dedupe_cache -> abort(key);
+	}
+	free_split_path(img_path);
+}
+
+// Function to put the buffers and descriptors of a batch back to the free lists: the completed tasks own
+// their image and counter, the spent ones only their chunk
+void recycle_batch(task_batch * batch, spares * free){
+	for (task * t : batch -> tasks){
+		free -> imgs.push_back(t -> img);
+		free -> counters.push_back(t -> n_chunks);
+	}
+	for (std::vector<task *> * tasks : {&batch -> tasks, &batch -> spent})
+		for (task * t : *tasks){
+			free -> chunks.push_back(t -> chunk);
+			free -> tasks.push_back(t);
+		}
+	batch -> tasks.clear();
+	batch -> spent.clear();
+	free -> batches.push_back(batch);
+}
+
+// Function to free the buffers and descriptors of the free lists
+void free_spares(spares * free){
+	for (cimg_library::CImg<float> * img : free -> imgs)
+		delete(img);
+	for (img_chunk * chunk : free -> chunks)
+		delete(chunk);
+	for (std::atomic<int> * counter : free -> counters)
+		delete(counter);
+	for (task * t : free -> tasks)
+		delete(t);
+	for (task_batch * batch : free -> batches)
+		delete(batch);
+}
+
+// Function to mark a batch of chunks, returns the images completed by the batch (nullptr if none). When
+// recycling the batch itself goes on, with the tasks of the images still in progress moved to spent
+task_batch * mark_batch(task_batch * batch, float intensity, bool recycle = false){
+	for (task * t : batch -> tasks)
+		mark_chunk(t -> img, t -> chunk, prepared, intensity);
+	task_batch * completed = recycle ? batch : new task_batch;
+	std::vector<task *> tasks;
+	tasks.swap(batch -> tasks);
+	completed -> pixels = 0;
+	{
+		std::unique_lock<std::mutex> guard(my_lock);
+		for (task * t : tasks){
+			*t -> n_chunks = *(t -> n_chunks) - 1;
+
+			// Check if its done (all of the chunks have been marked) and hand it over to next stage if that's the case
+			if (*(t -> n_chunks) == 0){
+				completed -> tasks.push_back(t);
+			}
+			else if (recycle){
+				completed -> spent.push_back(t);
+			}
+			else{
+				delete(t -> chunk);
+				delete(t);
+			}
+		}
+	}
+	if (recycle)
+		return completed;
+	delete(batch);
+	if (completed -> tasks.empty()){
+		delete(completed);
+		return nullptr;
+	}
+	return completed;
+}
+
+// Function to save the completed images of a batch, when recycling the batch is kept to go back to the loader
+void save_batch(task_batch * batch, bool recycle = false){
+	for (task * t : batch -> tasks){
+		// Save the image   
+		try{
+			t -> img -> save(&(t -> save_path)[0u]);
+			processed += 1;
+			{
+				std::unique_lock<std::mutex> guard(latency_lock);
+				latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t -> started).count());
+			}
+			if (done_manifest)
+				done_manifest -> record(t -> load_path, t -> save_path);
+			if (dedupe_cache)
+				dedupe_cache -> store(t -> cache_key, t -> save_path);
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Error saving image " << t -> save_path << ": " << e.what() << std::endl;
+			if (dedupe_cache)
+				dedupe_cache -> abort(t -> cache_key);
+		}
+		if (recycle)
+			continue;
+		delete(t -> img);
+		delete(t -> chunk);
+		delete(t -> n_chunks);
+		delete(t);
+	}
+	if (!recycle)
+		delete(batch);
+}
 
 // Node that emits the image paths
 struct Emitter : public ff::ff_node_t<task, std::string>{
@@ -24,22 +286,9 @@ struct Emitter : public ff::ff_node_t<task, std::string>{
     {
     }
 	std::string* svc(task*) {
-		// Open the directory containing the images to be watermarked
-		DIR *dirp;
-    	struct dirent *directory;
-		dirp = opendir(&src_path[0u]);
-		if (dirp){
-		    while ((directory = readdir(dirp)) != NULL){
-				if (strendswith(directory->d_name, ".jpg")){
-					split_path *sp = new split_path;
-					sp -> prefix = src_path+"/";
-					sp -> suffix = directory -> d_name;
-					ff_send_out(sp);
-				}
-		    }
+		for (const std::string& name : list_images(src_path)){
+			ff_send_out(new_split_path(src_path+"/", name));
 		}
-		delete(directory);
-		closedir(dirp);
 		return EOS;
 	}
 
@@ -48,108 +297,287 @@ private:
 };
 
 
-// Node that loads the images and splits them into chunks
-struct Loader : public ff::ff_node_t<split_path, task>{
-	Loader(int chunks) : n_chunks(chunks){}
+// Node that loads the images, splits them into chunks and sends the chunks out in batches. When ordered the
+// chunks of an image go out as one batch, an empty one if the image is not to be marked, as the ordered farm
+// needs exactly one output per input
+struct Loader : public ff::ff_node_t<split_path, task_batch>{
+	Loader(int chunks, long batch_pixels, bool ordered, worker_stats * stats, int cpu)
+		: n_chunks(chunks), batch_pixels(batch_pixels), ordered(ordered), stats(stats), cpu(cpu), open(nullptr){}
+
+	// The images are decoded, hence allocated, on the node of the loader
+	int svc_init(){
+		pin_node("loader", cpu);
+		return 0;
+	}
 	
-	task *svc(split_path* img_path){
-		// Load the image
-		cimg_library::CImg<float> * img = new cimg_library::CImg<float>;
-		try{
-			img -> load(&(img_path->prefix + img_path->suffix)[0u]);
-		
-			// Split the image into chunks
-			std::vector<img_chunk*> chunks = chunker(img, n_chunks);
-			std::atomic<int> * num_chunks = new std::atomic<int>;
-			*num_chunks = n_chunks;
-
-			// Push the chunks into the next stage
-			for (unsigned int i = 0; i < chunks.size(); i++){
-				task *t = new task;
-				t -> img = img;
-				t -> save_path = img_path -> prefix + "watermarked/" + img_path -> suffix;
-				t -> chunk = chunks.at(i);
-				t -> n_chunks = num_chunks; 
-				ff_send_out(t);
-			}
-		}catch (const cimg_library::CImgIOException& e) {
-		    std::cerr << "Error reading image " << img_path->prefix + img_path->suffix << ": " << e.what() << std::endl;
-			delete(img);
+	// The last batch goes out before the end of the stream
+	void eosnotify(ssize_t){
+		if (open)
+			ff_send_out(open);
+		open = nullptr;
+	}
+
+	task_batch *svc(split_path* img_path){
+		auto start = std::chrono::steady_clock::now();
+		if (ordered){
+			load_image(img_path, n_chunks, LONG_MAX, &open, [](task_batch *){});
+			task_batch * batch = open ? open : new task_batch{{}, 0};
+			open = nullptr;
+			account_task(stats, start);
+			return batch;
 		}
-		delete(img_path);
+		load_image(img_path, n_chunks, batch_pixels, &open, [this](task_batch * batch){ ff_send_out(batch); });
+		account_task(stats, start);
 		return GO_ON;
 	}	
 
 private:
 	int n_chunks;
+	long batch_pixels;
+	bool ordered;
+	worker_stats * stats;
+	int cpu;
+	task_batch * open;
 };
 
 
-// Node that marks the chunks of the images
-struct Marker : public ff::ff_node_t<task, std::string>{
-	Marker(float intensity) : _intensity(intensity){};
-		std::string *svc(task * t){
-		mark_chunk(t -> img, t -> chunk, wmark, _intensity);
-		{
-			std::unique_lock<std::mutex> guard(my_lock);
-			*t -> n_chunks = *(t -> n_chunks) - 1;
+// Loader of a pipe with a feedback channel from its saver (recycling mode): the batches coming back are put
+// in the free lists and the next images are loaded into their buffers and descriptors. The end of the stream
+// is sent on once every batch sent out has come back
+struct RecyclingLoader : public ff::ff_minode_t<split_path, task_batch>{
+	RecyclingLoader(int chunks, long batch_pixels, worker_stats * stats, int cpu)
+		: n_chunks(chunks), batch_pixels(batch_pixels), stats(stats), cpu(cpu), open(nullptr), in_flight(0), ended(false){}
 
-			// Check if its done (all of the chunks have been marked) and hand it over to next stage if that's the case
-			if (*(t -> n_chunks) == 0){
-				ff_send_out(t);
-			}
-			else{
-				delete(t -> chunk);
-				delete(t);
-			}
+	int svc_init(){
+		pin_node("loader", cpu);
+		return 0;
+	}
+
+	void eosnotify(ssize_t){
+		if (ended)
+			return;
+		ended = true;
+		if (open)
+			send(open);
+		open = nullptr;
+		if (in_flight == 0)
+			ff_send_out(EOS);
+	}
+
+	task_batch *svc(split_path* img_path){
+		// A batch back from the saver
+		if (!fromInput()){
+			recycle_batch((task_batch *) img_path, &free);
+			in_flight -= 1;
+			return (ended && in_flight == 0) ? EOS : GO_ON;
 		}
-		
+		auto start = std::chrono::steady_clock::now();
+		load_image(img_path, n_chunks, batch_pixels, &open, [this](task_batch * batch){ send(batch); }, &free);
+		account_task(stats, start);
 		return GO_ON;
 	}
+
+	void svc_end(){
+		free_spares(&free);
+	}
+
+private:
+	int n_chunks;
+	long batch_pixels;
+	worker_stats * stats;
+	int cpu;
+	task_batch * open;
+	long in_flight;
+	bool ended;
+	spares free;
+
+	void send(task_batch * batch){
+		in_flight += 1;
+		ff_send_out(batch);
+	}
+};
+
+
+// Node that marks the batches of chunks, the images completed by a batch go on together (an empty batch if
+// none when ordered)
+struct Marker : public ff::ff_node_t<task_batch>{
+	Marker(float intensity, bool ordered, bool recycle, worker_stats * stats, int cpu)
+		: _intensity(intensity), ordered(ordered), recycle(recycle), stats(stats), cpu(cpu){};
+
+	int svc_init(){
+		pin_node("marker", cpu);
+		return 0;
+	}
+
+	task_batch *svc(task_batch * batch){
+		auto start = std::chrono::steady_clock::now();
+		task_batch * completed = mark_batch(batch, _intensity, recycle);
+		account_task(stats, start);
+		if (!completed && ordered)
+			return new task_batch{{}, 0};
+		return completed ? completed : GO_ON;
+	}
 private:
 	float _intensity;
+	bool ordered;
+	bool recycle;
+	worker_stats * stats;
+	int cpu;
 };
 
 
-// Node to save the images once all the chunks have been marked
-struct Saver : public ff::ff_node_t<task> {
-    task* svc(task* t) {
-        // Save the image   
-        try{
-			t -> img -> save(&(t -> save_path)[0u]);
-			processed += 1;
+// Node that marks whole images one at a time with all the markers (latency mode): the rows of the image are
+// cut into bands spread over the persistent threads of a ParallelFor, so no chunk goes over a channel. The
+// threads are created by the ParallelFor, each pins itself to the CPU of its marker slot on its first band
+struct BandMarker : public ff::ff_node_t<task_batch>{
+	BandMarker(float intensity, int n_markers, int n_bands, worker_stats * stats, const std::vector<cpu_slot>& cpus)
+		: _intensity(intensity), n_markers(n_markers), n_bands(n_bands), stats(stats), cpus(cpus), pinned(n_markers, 0), pf(n_markers){};
+
+	task_batch *svc(task_batch * batch){
+		auto start = std::chrono::steady_clock::now();
+		for (task * t : batch -> tasks){
+			cimg_library::CImg<float> * img = t -> img;
+			long band = std::max(1, (img -> height() + n_bands - 1) / n_bands);
+			pf.parallel_for_idx(0, img -> height(), 1, band, [&](const long first, const long last, const int thid){
+				if (!pinned[thid]){
+					pin_node("marker", cpus[thid].cpu);
+					pinned[thid] = 1;
+				}
+				img_chunk rows = {(int) first, 0, (int) last - 1, img -> width() - 1};
+				mark_chunk(img, &rows, prepared, _intensity);
+			}, n_markers);
 		}
-		catch (const std::exception& e) {
-            std::cerr << "Error saving image " << t -> save_path << ": " << e.what() << std::endl;
-        }
-        delete(t -> img);
-		delete(t -> chunk);
-		delete(t -> n_chunks);
-		delete(t);
-        return GO_ON;
+		account_task(stats, start);
+		return batch;
+	}
+private:
+	float _intensity;
+	int n_markers;
+	int n_bands;
+	worker_stats * stats;
+	std::vector<cpu_slot> cpus;
+	// One flag per thread, each only touched by its own thread
+	std::vector<char> pinned;
+	ff::ParallelFor pf;
+};
 
-    }
+
+// Node to save the images once all the chunks have been marked, when recycling the batches go back to the loader
+struct Saver : public ff::ff_node_t<task_batch> {
+	Saver(worker_stats * stats, int cpu, bool recycle = false) : stats(stats), cpu(cpu), recycle(recycle){}
+
+	int svc_init(){
+		pin_node("saver", cpu);
+		return 0;
+	}
+
+	task_batch* svc(task_batch* batch) {
+		auto start = std::chrono::steady_clock::now();
+		save_batch(batch, recycle);
+		account_task(stats, start);
+		return recycle ? batch : GO_ON;
+	}
+
+private:
+	worker_stats * stats;
+	int cpu;
+	bool recycle;
+};
+
+
+// Loader of the all-to-all, a source node: it loads its share of the images (every n_loaders-th, from the
+// id-th) and sends the batches straight to the markers, round robin, so there is no emitter in between
+struct A2aLoader : public ff::ff_monode_t<task_batch>{
+	A2aLoader(const std::vector<std::string>& names, std::string dir, int id, int n_loaders, int chunks, long batch_pixels, worker_stats * stats, int cpu)
+		: names(names), src_path(dir), id(id), n_loaders(n_loaders), n_chunks(chunks), batch_pixels(batch_pixels), stats(stats), cpu(cpu){}
+
+	int svc_init(){
+		pin_node("loader", cpu);
+		return 0;
+	}
+
+	task_batch *svc(task_batch *){
+		task_batch * open = nullptr;
+		for (unsigned int i = id; i < names.size(); i += n_loaders){
+			auto start = std::chrono::steady_clock::now();
+			load_image(new_split_path(src_path+"/", names[i]), n_chunks, batch_pixels, &open, [this](task_batch * batch){ ff_send_out(batch); });
+			account_task(stats, start);
+		}
+		if (open)
+			ff_send_out(open);
+		return EOS;
+	}
+
+private:
+	const std::vector<std::string>& names;
+	std::string src_path;
+	int id;
+	int n_loaders;
+	int n_chunks;
+	long batch_pixels;
+	worker_stats * stats;
+	int cpu;
+};
+
+
+// Marker of the all-to-all, takes batches from any loader and hands the completed images to the saver of its pipe
+struct A2aMarker : public ff::ff_minode_t<task_batch>{
+	A2aMarker(float intensity, worker_stats * stats, int cpu) : _intensity(intensity), stats(stats), cpu(cpu){};
+
+	int svc_init(){
+		pin_node("marker", cpu);
+		return 0;
+	}
+
+	task_batch *svc(task_batch * batch){
+		auto start = std::chrono::steady_clock::now();
+		task_batch * completed = mark_batch(batch, _intensity);
+		account_task(stats, start);
+		return completed ? completed : GO_ON;
+	}
+private:
+	float _intensity;
+	worker_stats * stats;
+	int cpu;
 };
 
 int main(int argc, char* argv[]){
 
 	std::string src_path, wmark_file;
-	int sflag = -1, wflag = -1;
-	int c, n_workers = 1, n_chunks = 0;
-	int par_type = 0; // 0 = farm of pipes, 1 = pipe of farms
+	int sflag = -1, wflag = -1, mflag = -1, dflag = -1, nflag = -1, pflag = -1, tflag = -1;
+	int c, n_workers = 1, n_chunks = 0, depth = 0;
+	bool ordered = false, recycle = false;
+	int n_loaders, n_markers, n_savers;
+	long batch_pixels = 0;
+	int par_type = 0; // 0 = farm of pipes, 1 = pipe of farms, 2 = all-to-all, 3 = latency mode
+	pin_policy pinning = PIN_NONE;
 	float intensity = 0.3;
 	char * end;
-	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -c <chunks> -n <parallelism degree> -p <parallelism type> -i <intensity>\n"
+	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -c <chunks> -n <parallelism degree> -p <parallelism type> -i <intensity> -a <affinity> -k <batch> -q <depth> [-o] [-r] [--autotune] [-m] [-d]\n"
 	"-s src_path --- Directory containing the images to be watermarked\n"
 	"-w watermark_file --- Path of the watermark to be used\n"
 	"-c chunks --- Number of chunks to divide each image in, defaults to parallelism degree\n"
 	"-n parallelism degree --- Parallelism degree to be used\n"
-	"-p parallelism type --- 0 = farm of pipes, 1 = pipe of farms\n"
-	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n";
+	"-p parallelism type --- 0 = farm of pipes, 1 = pipe of farms, 2 = all-to-all from the loaders to marker-saver pipes, 3 = latency mode (each image marked by all the markers, in -c row bands)\n"
+	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-a affinity --- Pin the nodes: none (FastFlow mapping, default), spread (one per core round robin over the NUMA nodes, loaders and savers on the node of their marker) or smt (loaders and savers on the SMT siblings of the markers)\n"
+	"-k batch --- Batch the chunks into work items of at least batch thousands of pixels, images smaller than a batch are not split\n"
+	"-q depth --- On-demand scheduling, each worker queue holds at most depth work items (round robin if not given)\n"
+	"-o --- Ordered farms, the work items leave each farm in the order they entered it, each image is one work item (pipe of farms only)\n"
+	"-r --- Recycling mode, the savers send the buffers and descriptors back to the loaders to be reused (farm of pipes only)\n"
+	"--autotune --- Pick the unset -n (for each stage), -c and -p from a calibration on a sample of the images, cached per host, dataset and watermark in watermarked/.autotune\n"
+	"-m --- Incremental mode, skip the images already marked with the same watermark and intensity\n"
+	"-d --- Dedupe mode, byte-identical images are marked once and their output is linked from a cache\n";
 	std::vector<std::thread> workers;
 
+	const int AUTOTUNE = 256;
+	struct option long_options[] = {
+		{"autotune", no_argument, nullptr, AUTOTUNE},
+		{nullptr, 0, nullptr, 0}
+	};
+
 	// Parse command line arguments
-	while ((c = getopt (argc, argv, "s:w:n:p:i:c:")) != -1)
+	while ((c = getopt_long (argc, argv, "s:w:n:p:i:c:a:k:q:ormd", long_options, nullptr)) != -1)
 		switch (c){
 			case 's':
 				sflag = 1;
@@ -161,14 +589,16 @@ int main(int argc, char* argv[]){
 				wmark_file = optarg;
 				break;
 			case 'p':
+				pflag = 1;
 				par_type = strtol(optarg, &end, 10);
-				if (*end != '\0' || (par_type!=0 && par_type!=1)) {
+				if (*end != '\0' || (par_type < 0 || par_type > 3)) {
 					std::cerr << "Invalid parallelism type.\n";
 					std::cerr << USAGE << std::endl;
 					exit(1);
 				}
 				break;
 			case 'n':
+				nflag = 1;
 				n_workers = strtol(optarg, &end, 10);
 				if (*end != '\0') {
 					std::cerr << "Invalid number of workers.\n";
@@ -202,6 +632,45 @@ int main(int argc, char* argv[]){
 					std::cout << "Intensity set to default " << intensity << " cause given value was out of range (0,100)" << std::endl;
 				}
 				break;
+			case 'a':
+				if (!parse_pin_policy(optarg, &pinning)) {
+					std::cerr << "Invalid affinity.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'k':
+				batch_pixels = strtol(optarg, &end, 10);
+				if (*end != '\0' || batch_pixels <= 0) {
+					std::cerr << "Invalid batch size.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				batch_pixels *= 1000;
+				break;
+			case 'q':
+				depth = strtol(optarg, &end, 10);
+				if (*end != '\0' || depth <= 0) {
+					std::cerr << "Invalid queue depth.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'o':
+				ordered = true;
+				break;
+			case 'r':
+				recycle = true;
+				break;
+			case AUTOTUNE:
+				tflag = 1;
+				break;
+			case 'm':
+				mflag = 1;
+				break;
+			case 'd':
+				dflag = 1;
+				break;
 			case '?':
 				if (optopt == 's' || optopt =='w')
 					std::cerr << USAGE << std::endl;
@@ -230,36 +699,103 @@ int main(int argc, char* argv[]){
 	}
 	
 	std::cout << "Watermark size: (" << wmark -> width() <<", " << wmark -> height() << ")" << std::endl;
+	prepared = prepare_wmark(wmark);
+	std::cout << "Watermark tiles: " << prepared -> n_empty << " empty, " << prepared -> n_full << " full, " << prepared -> n_mixed << " mixed" << std::endl;
+
+	// In incremental mode load the manifest of the images already processed
+	if (mflag == 1)
+		done_manifest = open_manifest(src_path, wmark_file, intensity);
+
+	// In dedupe mode outputs are linked from the content-addressed cache
+	if (dflag == 1)
+		dedupe_cache = open_cache(src_path, wmark_file, intensity, done_manifest);
+
+	// Every stage gets the parallelism degree, unless autotuned: the flags given explicitly still win
+	n_loaders = n_markers = n_savers = n_workers;
+	if (tflag == 1){
+		tune_config tuned;
+		if (!autotune(src_path, wmark_file, prepared, intensity, &tuned))
+			std::cerr << "Autotune: no image to calibrate on, keeping the defaults" << std::endl;
+		else{
+			if (nflag == -1){
+				n_loaders = tuned.loaders;
+				n_markers = n_workers = tuned.markers;
+				n_savers = tuned.savers;
+			}
+			if (n_chunks == 0)
+				n_chunks = tuned.chunks;
+			if (pflag == -1)
+				par_type = tuned.par_type;
+		}
+	}
 
 	// If number of chunks has not been specified then set it to the parallelism degree
 	if(n_chunks == 0)
 		n_chunks = n_workers;
 	
 	std::cout << "Each image will be split in " << n_chunks << " chunks" << std::endl;
+	if (batch_pixels > 0)
+		std::cout << "Chunks will be batched into work items of at least " << batch_pixels << " pixels" << std::endl;
+
+	// Loader and saver i are on the node of marker i, in the farm of pipes the whole pipe is
+	if (par_type == 0)
+		n_loaders = n_savers = n_workers = n_markers;
+	// In the all-to-all each marker has a saver of its own
+	if (par_type == 2)
+		n_savers = n_markers;
+	plan = plan_affinity(read_topology(), pinning, n_markers, n_loaders + n_savers);
+	if (pinning != PIN_NONE)
+		std::cout << "Pinned nodes: " << describe_plan(plan) << std::endl;
+
+	// Only the pipe of farms has farms whose outputs can be ordered
+	if (ordered && par_type != 1){
+		std::cerr << "Ordered farms need the pipe of farms (-p 1)" << std::endl;
+		return 1;
+	}
+	// Only the pipes of the farm of pipes have a saver to feed back to a loader of their own
+	if (recycle && par_type != 0){
+		std::cerr << "Recycling needs the farm of pipes (-p 0)" << std::endl;
+		return 1;
+	}
+	if (recycle)
+		std::cout << "Recycling the buffers and descriptors from the savers to the loaders" << std::endl;
+	if (depth > 0)
+		std::cout << "On-demand scheduling, worker queues of " << depth << " work items" << std::endl;
+	if (ordered)
+		std::cout << "Ordered farms, each image is one work item" << std::endl;
+	std::vector<worker_stats> loader_stats(n_loaders, {0, 0}), marker_stats(n_markers, {0, 0}), saver_stats(n_savers, {0, 0});
 
  	// Pipeline of farms
 	if (par_type == 1){
 		std::cout << "PIPE OF FARMS " << std::endl;
 		std::vector<std::unique_ptr<ff::ff_node>> loaders;
 
-		for (int i = 0; i < n_workers; i++)
-			loaders.push_back(ff::make_unique<Loader>(n_chunks));
+		for (int i = 0; i < n_loaders; i++)
+			loaders.push_back(ff::make_unique<Loader>(n_chunks, batch_pixels, ordered, &loader_stats[i], plan.io[i].cpu));
 
 		std::vector<std::unique_ptr<ff::ff_node>> markers;
-		for (int i = 0; i < n_workers; i++) {
-			markers.push_back(ff::make_unique<Marker>(intensity));
+		for (int i = 0; i < n_markers; i++) {
+			markers.push_back(ff::make_unique<Marker>(intensity, ordered, false, &marker_stats[i], plan.compute[i].cpu));
 		}
 
 		std::vector<std::unique_ptr<ff::ff_node>> savers;
-		for (int i = 0; i < n_workers; i++) {
-			savers.push_back(ff::make_unique<Saver>());
+		for (int i = 0; i < n_savers; i++) {
+			savers.push_back(ff::make_unique<Saver>(&saver_stats[i], plan.io[n_loaders + i].cpu));
 		}
 
+		// The savers produce no output, their farm is not ordered: the images reach it in order
+		auto load_farm = ff::make_unique<ff::ff_Farm<task>>(std::move(loaders));
+		auto mark_farm = ff::make_unique<ff::ff_Farm<task>>(std::move(markers));
+		auto save_farm = ff::make_unique<ff::ff_Farm<task>>(std::move(savers));
+		schedule_farm(load_farm.get(), depth, ordered);
+		schedule_farm(mark_farm.get(), depth, ordered);
+		schedule_farm(save_farm.get(), depth, false);
+
 		ff::ff_Pipe<task> pipe(
 			ff::make_unique<Emitter>(src_path),
-			ff::make_unique<ff::ff_Farm<task>>(std::move(loaders)),
-			ff::make_unique<ff::ff_Farm<task>>(std::move(markers)),
-			ff::make_unique<ff::ff_Farm<task>>(std::move(savers))
+			std::move(load_farm),
+			std::move(mark_farm),
+			std::move(save_farm)
 		);
 
 		auto start = std::chrono::high_resolution_clock::now();
@@ -272,15 +808,80 @@ int main(int argc, char* argv[]){
 		std::cout << "FARM OF PIPES " << std::endl;
 		std::vector<std::unique_ptr<ff::ff_node>> pipes;
 		for (int i = 0; i < n_workers; i++) {
+			// When recycling the saver sends the batches back to the loader of its pipe
+			if (recycle){
+				auto pipe = ff::make_unique<ff::ff_Pipe<task>>(
+				    ff::make_unique<RecyclingLoader>(n_chunks, batch_pixels, &loader_stats[i], plan.io[i].cpu),
+				    ff::make_unique<Marker>(intensity, false, true, &marker_stats[i], plan.compute[i].cpu),
+				    ff::make_unique<Saver>(&saver_stats[i], plan.io[n_workers + i].cpu, true)
+				);
+				pipe -> wrap_around();
+				pipes.push_back(std::move(pipe));
+				continue;
+			}
 			pipes.push_back(ff::make_unique<ff::ff_Pipe<task>>(
-			    ff::make_unique<Loader>(n_workers),
-			    ff::make_unique<Marker>(intensity),
-			    ff::make_unique<Saver>()
+			    ff::make_unique<Loader>(n_chunks, batch_pixels, false, &loader_stats[i], plan.io[i].cpu),
+			    ff::make_unique<Marker>(intensity, false, false, &marker_stats[i], plan.compute[i].cpu),
+			    ff::make_unique<Saver>(&saver_stats[i], plan.io[n_workers + i].cpu)
 			));
 		}
+		auto farm = ff::make_unique<ff::ff_Farm<task>>(std::move(pipes));
+		schedule_farm(farm.get(), depth, false);
 		ff::ff_Pipe<task> pipe(
 			ff::make_unique<Emitter>(src_path),
-			ff::make_unique<ff::ff_Farm<task>>(std::move(pipes))
+			std::move(farm)
+		);
+		auto start = std::chrono::high_resolution_clock::now();
+		pipe.run_and_wait_end();
+		auto msec    = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		std::cout << "Elapsed time is " << msec << " msecs " << std::endl;
+	}
+	// All-to-all from the loaders to the marker-saver pipes
+	else if (par_type == 2){
+		std::cout << "ALL TO ALL " << std::endl;
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<std::string> names = list_images(src_path);
+
+		std::vector<ff::ff_node*> loaders;
+		for (int i = 0; i < n_loaders; i++)
+			loaders.push_back(new A2aLoader(names, src_path, i, n_loaders, n_chunks, batch_pixels, &loader_stats[i], plan.io[i].cpu));
+
+		std::vector<ff::ff_node*> pipes;
+		for (int i = 0; i < n_markers; i++)
+			pipes.push_back(new ff::ff_Pipe<task_batch>(
+				ff::make_unique<A2aMarker>(intensity, &marker_stats[i], plan.compute[i].cpu),
+				ff::make_unique<Saver>(&saver_stats[i], plan.io[n_loaders + i].cpu)
+			));
+
+		ff::ff_a2a a2a;
+		// The loaders send to the markers round robin, or on demand with -q
+		a2a.add_firstset(loaders, depth, true);
+		a2a.add_secondset(pipes, true);
+		a2a.run_and_wait_end();
+		auto msec    = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		std::cout << "Elapsed time is " << msec << " msecs " << std::endl;
+	}
+	// Pipe of the loaders, a data-parallel marking stage and the savers
+	else if (par_type == 3){
+		std::cout << "LATENCY MODE " << std::endl;
+		std::vector<std::unique_ptr<ff::ff_node>> loaders;
+		for (int i = 0; i < n_loaders; i++)
+			loaders.push_back(ff::make_unique<Loader>(1, batch_pixels, false, &loader_stats[i], plan.io[i].cpu));
+
+		std::vector<std::unique_ptr<ff::ff_node>> savers;
+		for (int i = 0; i < n_savers; i++)
+			savers.push_back(ff::make_unique<Saver>(&saver_stats[i], plan.io[n_loaders + i].cpu));
+
+		auto load_farm = ff::make_unique<ff::ff_Farm<task>>(std::move(loaders));
+		auto save_farm = ff::make_unique<ff::ff_Farm<task>>(std::move(savers));
+		schedule_farm(load_farm.get(), depth, false);
+		schedule_farm(save_farm.get(), depth, false);
+		marker_stats.resize(1);
+		ff::ff_Pipe<task> pipe(
+			ff::make_unique<Emitter>(src_path),
+			std::move(load_farm),
+			ff::make_unique<BandMarker>(intensity, n_markers, n_chunks, &marker_stats[0], plan.compute),
+			std::move(save_farm)
 		);
 		auto start = std::chrono::high_resolution_clock::now();
 		pipe.run_and_wait_end();
@@ -288,5 +889,18 @@ int main(int argc, char* argv[]){
 		std::cout << "Elapsed time is " << msec << " msecs " << std::endl;
 	}
 	std::cout << "Processed a total of " << processed << " images" << std::endl;
+	std::cout << "Per-image latency, load to save " << latency_summary(latencies) << std::endl;
+	std::cout << "Loaders: " << workers_summary(loader_stats) << std::endl;
+	std::cout << "Markers: " << workers_summary(marker_stats) << std::endl;
+	std::cout << "Savers: " << workers_summary(saver_stats) << std::endl;
+	if (done_manifest){
+		std::cout << "Skipped " << skipped << " up to date images" << std::endl;
+		delete done_manifest;
+	}
+	if (dedupe_cache){
+		dedupe_cache -> report();
+		delete dedupe_cache;
+	}
+	delete prepared;
 	delete wmark;
 }
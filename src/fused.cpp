@@ -0,0 +1,557 @@
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "fused.h"
+#include "codec.h"
+#include "queue.h"
+
+// Function to run the engine, reading from in (or data) and writing to out_file (or out)
+static void mark_fused(std::FILE * in, const unsigned char * data, size_t size, std::FILE * out_file,
+	std::vector<unsigned char> * out, const prepared_wmark * wmark, float intensity, int quality){
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	codec_error_mgr jerr;
+	src.err = jpeg_std_error(&jerr.original);
+	dst.err = src.err;
+	jerr.original.error_exit = codec_error_exit;
+	unsigned char * buffer = nullptr;
+	unsigned long out_size = 0;
+	unsigned char * volatile band = nullptr;
+	volatile bool compressing = false;
+	if (setjmp(jerr.setjmp_buffer)){
+		if (compressing)
+			jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(buffer);
+		delete[] band;
+		throw cimg_library::CImgIOException("mark_fused(): %s", jerr.message);
+	}
+	jpeg_create_decompress(&src);
+	if (in)
+		jpeg_stdio_src(&src, in);
+	else
+		jpeg_mem_src(&src, (unsigned char *) data, size);
+	jpeg_read_header(&src, TRUE);
+	jpeg_start_decompress(&src);
+	int width = src.output_width, channels = src.output_components;
+	if (channels != 1 && channels != 3){
+		jpeg_destroy_decompress(&src);
+		throw cimg_library::CImgIOException("mark_fused(): Unsupported number of components %d.", channels);
+	}
+
+	jpeg_create_compress(&dst);
+	compressing = true;
+	if (out_file)
+		jpeg_stdio_dest(&dst, out_file);
+	else
+		jpeg_mem_dest(&dst, &buffer, &out_size);
+	dst.image_width = width;
+	dst.image_height = src.output_height;
+	dst.input_components = channels;
+	dst.in_color_space = channels == 3 ? JCS_RGB : JCS_GRAYSCALE;
+	jpeg_set_defaults(&dst);
+	jpeg_set_quality(&dst, quality, TRUE);
+	jpeg_start_compress(&dst, TRUE);
+
+	// One MCU row at a time: decode the band, mark it and hand it over to the encoder
+	int band_rows = src.max_v_samp_factor * DCTSIZE;
+	JSAMPROW rows[MAX_SAMP_FACTOR * DCTSIZE];
+	band = new unsigned char[band_rows * width * channels];
+	for (int i = 0; i < band_rows; i++)
+		rows[i] = band + i * width * channels;
+	row_kernel kernel = pick_row_kernel(channels, wmark, intensity);
+	while (src.output_scanline < src.output_height){
+		int first = src.output_scanline, n = 0;
+		while (n < band_rows && src.output_scanline < src.output_height)
+			n += jpeg_read_scanlines(&src, rows + n, band_rows - n);
+		for (int i = 0; i < n; i++)
+			kernel(rows[i], width, first + i, wmark, intensity);
+		jpeg_write_scanlines(&dst, rows, n);
+	}
+	delete[] band;
+	band = nullptr;
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	compressing = false;
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	if (out)
+		out -> assign(buffer, buffer + out_size);
+	free(buffer);
+}
+
+// Function to mark a JPEG image held in memory, throws CImgIOException on errors
+void mark_fused_jpeg(const unsigned char * data, size_t size, const prepared_wmark * wmark, float intensity,
+	std::vector<unsigned char> * out, int quality){
+	mark_fused(nullptr, data, size, nullptr, out, wmark, intensity, quality);
+}
+
+// Function to mark a JPEG file into another streaming from file to file, throws CImgIOException on errors
+void mark_fused_file(const std::string& load_path, const std::string& save_path, const prepared_wmark * wmark,
+	float intensity, int quality){
+	std::FILE * in = std::fopen(&load_path[0u], "rb");
+	if (!in)
+		throw cimg_library::CImgIOException("mark_fused_file(): Failed to open file '%s' for reading.", load_path.c_str());
+	std::FILE * out = std::fopen(&save_path[0u], "wb");
+	if (!out){
+		std::fclose(in);
+		throw cimg_library::CImgIOException("mark_fused_file(): Failed to open file '%s' for writing.", save_path.c_str());
+	}
+	try{
+		mark_fused(in, nullptr, 0, out, nullptr, wmark, intensity, quality);
+	}catch (const cimg_library::CImgIOException&) {
+		std::fclose(in);
+		std::fclose(out);
+		std::remove(&save_path[0u]);
+		throw;
+	}
+	std::fclose(in);
+	if (std::fclose(out) != 0){
+		std::remove(&save_path[0u]);
+		throw cimg_library::CImgIOException("mark_fused_file(): Failed to write file '%s'.", save_path.c_str());
+	}
+}
+
+// Data structure holding the blend of every sample of a component over one watermark tile:
+// a sample becomes value * keep + add, keep is 1 (and add 0) where the watermark is transparent
+struct plane_blend{
+	std::vector<float> keep;
+	std::vector<float> add;
+	int width;	// Samples per watermark row, 0 if the watermark does not split in whole samples
+	int height;
+	// What the blend was computed for, so that it is reused across the images of a thread: the plane
+	// pointer tells the planes of a watermark apart, the generation a freed watermark from a new one
+	uint64_t generation = 0;
+	const float * wplane = nullptr;
+	int fx = 0;
+	int fy = 0;
+	float intensity = -1;
+};
+
+// Function to blend one sample covering the pixels [x0, x1) x [y0, y1) the slow way, for samples
+// clipped by the image border or straddling the edge of the watermark
+static JSAMPLE blend_sample(JSAMPLE sample, int x0, int x1, int y0, int y1, const float * wplane,
+	const unsigned char * mask, const float * alpha, int wm_width, int wm_height, float intensity, float rounding){
+	float marked = 0, sum = 0;
+	int pixels = 0;
+	for (int y = y0; y < y1; y++){
+		int wrow = (y % wm_height) * wm_width;
+		for (int x = x0; x < x1; x++, pixels++){
+			int i = wrow + x % wm_width;
+			if (!mask || mask[i]){
+				float weight = alpha ? alpha[i] : 1;
+				marked += weight;
+				sum += weight * wplane[i];
+			}
+		}
+	}
+	if (marked == 0)
+		return sample;
+	float value = sample + intensity * (sum - marked * sample) / pixels;
+	return (JSAMPLE) (value < 0 ? 0 : (value > 255 ? 255 : value + rounding));
+}
+
+// Function to precompute the blend of the samples of a component with fx x fy pixels per sample
+static void prepare_plane(plane_blend * pb, uint64_t generation, int fx, int fy, const float * wplane, const unsigned char * mask,
+	const float * alpha, int wm_width, int wm_height, float intensity){
+	if (pb -> generation == generation && pb -> wplane == wplane && pb -> fx == fx && pb -> fy == fy && pb -> intensity == intensity)
+		return;
+	pb -> generation = generation;
+	pb -> wplane = wplane;
+	pb -> fx = fx;
+	pb -> fy = fy;
+	pb -> intensity = intensity;
+	pb -> width = 0;
+	if (wm_width % fx != 0 || wm_height % fy != 0)
+		return;
+	pb -> width = wm_width / fx;
+	pb -> height = wm_height / fy;
+	pb -> keep.assign(pb -> width * pb -> height, 1);
+	pb -> add.assign(pb -> width * pb -> height, 0);
+	float pixels = fx * fy;
+	for (int y = 0; y < wm_height; y++)
+		for (int x = 0; x < wm_width; x++){
+			int i = y * wm_width + x, s = y / fy * pb -> width + x / fx;
+			if (!mask || mask[i]){
+				float weight = intensity * (alpha ? alpha[i] : 1) / pixels;
+				pb -> keep[s] -= weight;
+				pb -> add[s] += weight * wplane[i];
+			}
+		}
+}
+
+// Function to blend the rows of a component plane, each sample covers fx x fy pixels starting at row first_row.
+// Without mask every pixel is blended, as mark_chunk does without 3 channels, with alpha each pixel is weighted by it.
+// Samples are rounded by rounding: 0.5 for colour planes, 0 for grayscale ones, whose samples are the pixels and are
+// truncated as mark_chunk and CImg truncate them.
+static void mark_plane(JSAMPARRAY rows, int n_rows, int first_row, int fx, int fy, int width, int height,
+	const plane_blend * pb, const float * wplane, const unsigned char * mask, const float * alpha, const prepared_wmark * wmark,
+	float intensity, float rounding){
+	int wm_width = wmark -> img -> width(), wm_height = wmark -> img -> height();
+	int samples = (width + fx - 1) / fx, whole = width / fx;
+	for (int r = 0; r < n_rows; r++){
+		int y0 = first_row + r * fy;
+		if (y0 >= height)
+			return;
+		int y1 = std::min(y0 + fy, height);
+		JSAMPROW row = rows[r];
+		int s = 0;
+		if (pb -> width > 0 && y1 - y0 == fy){
+			// Whole samples: one multiply-add each, walking the watermark row without modulo
+			const float * keep = &pb -> keep[(y0 % wm_height) / fy * pb -> width];
+			const float * add = &pb -> add[(y0 % wm_height) / fy * pb -> width];
+			for (int ws = 0; s < whole; s++){
+				if (keep[ws] != 1){
+					float value = row[s] * keep[ws] + add[ws];
+					row[s] = (JSAMPLE) (value < 0 ? 0 : (value > 255 ? 255 : value + rounding));
+				}
+				if (++ws == pb -> width)
+					ws = 0;
+			}
+		}
+		for (; s < samples; s++)
+			row[s] = blend_sample(row[s], s * fx, std::min(s * fx + fx, width), y0, y1, wplane, mask, alpha, wm_width, wm_height, intensity, rounding);
+	}
+}
+
+// Function to run the YCbCr engine, returns false without writing anything if the image is not supported
+static bool mark_ycc(std::FILE * in, const unsigned char * data, size_t size, std::FILE * out_file,
+	std::vector<unsigned char> * out, const prepared_wmark * wmark, float intensity, int quality){
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	codec_error_mgr jerr;
+	src.err = jpeg_std_error(&jerr.original);
+	dst.err = src.err;
+	jerr.original.error_exit = codec_error_exit;
+	unsigned char * buffer = nullptr;
+	unsigned long out_size = 0;
+	unsigned char * volatile planes = nullptr;
+	volatile bool compressing = false;
+	// Blends of the last image marked by this thread, recomputed only when something changes
+	thread_local plane_blend blends[MAX_COMPONENTS];
+	if (setjmp(jerr.setjmp_buffer)){
+		if (compressing)
+			jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(buffer);
+		delete[] planes;
+		throw cimg_library::CImgIOException("mark_ycc(): %s", jerr.message);
+	}
+	jpeg_create_decompress(&src);
+	if (in)
+		jpeg_stdio_src(&src, in);
+	else
+		jpeg_mem_src(&src, (unsigned char *) data, size);
+	jpeg_read_header(&src, TRUE);
+	int channels = src.num_components;
+	bool has_3_chan = wmark -> img -> spectrum() >= 3;
+	bool supported = src.data_precision == 8 && ((src.jpeg_color_space == JCS_YCbCr && channels == 3 && has_3_chan) ||
+		(src.jpeg_color_space == JCS_GRAYSCALE && channels == 1));
+	for (int c = 0; c < channels && supported; c++)
+		supported = src.max_h_samp_factor % src.comp_info[c].h_samp_factor == 0 &&
+			src.max_v_samp_factor % src.comp_info[c].v_samp_factor == 0;
+	if (!supported){
+		jpeg_destroy_decompress(&src);
+		return false;
+	}
+	src.raw_data_out = TRUE;
+	jpeg_start_decompress(&src);
+
+	// Same colour space and sampling factors as the input, the planes are handed over as they are
+	jpeg_create_compress(&dst);
+	compressing = true;
+	if (out_file)
+		jpeg_stdio_dest(&dst, out_file);
+	else
+		jpeg_mem_dest(&dst, &buffer, &out_size);
+	dst.image_width = src.image_width;
+	dst.image_height = src.image_height;
+	dst.input_components = channels;
+	dst.in_color_space = src.jpeg_color_space;
+	jpeg_set_defaults(&dst);
+	jpeg_set_colorspace(&dst, src.jpeg_color_space);
+	for (int c = 0; c < channels; c++){
+		dst.comp_info[c].h_samp_factor = src.comp_info[c].h_samp_factor;
+		dst.comp_info[c].v_samp_factor = src.comp_info[c].v_samp_factor;
+	}
+	dst.raw_data_in = TRUE;
+	jpeg_set_quality(&dst, quality, TRUE);
+	jpeg_start_compress(&dst, TRUE);
+
+	// One iMCU row of every component at a time
+	JSAMPROW rows[MAX_COMPONENTS][MAX_SAMP_FACTOR * DCTSIZE];
+	JSAMPARRAY image[MAX_COMPONENTS];
+	int stride[MAX_COMPONENTS], total = 0;
+	for (int c = 0; c < channels; c++){
+		stride[c] = src.comp_info[c].width_in_blocks * DCTSIZE;
+		total += stride[c] * src.comp_info[c].v_samp_factor * DCTSIZE;
+	}
+	planes = new unsigned char[total];
+	for (int c = 0, offset = 0; c < channels; c++){
+		for (int r = 0; r < src.comp_info[c].v_samp_factor * DCTSIZE; r++, offset += stride[c])
+			rows[c][r] = planes + offset;
+		image[c] = rows[c];
+	}
+	const float * wplanes[3] = {wmark -> img -> data(), nullptr, nullptr};
+	if (channels == 3)
+		for (int c = 0; c < 3; c++)
+			wplanes[c] = wmark -> ycc.data() + c * wmark -> img -> width() * wmark -> img -> height();
+	const unsigned char * mask = channels == 3 ? wmark -> mask.data() : nullptr;
+	const float * alpha = channels == 3 && !wmark -> alpha.empty() ? wmark -> alpha.data() : nullptr;
+	int fx[MAX_COMPONENTS], fy[MAX_COMPONENTS];
+	for (int c = 0; c < channels; c++){
+		fx[c] = src.max_h_samp_factor / src.comp_info[c].h_samp_factor;
+		fy[c] = src.max_v_samp_factor / src.comp_info[c].v_samp_factor;
+		prepare_plane(&blends[c], wmark -> generation, fx[c], fy[c], wplanes[c], mask, alpha, wmark -> img -> width(), wmark -> img -> height(), intensity);
+	}
+	int mcu_rows = src.max_v_samp_factor * DCTSIZE, width = src.image_width, height = src.image_height;
+	while (src.output_scanline < src.output_height){
+		int first = src.output_scanline;
+		jpeg_read_raw_data(&src, image, mcu_rows);
+		for (int c = 0; c < channels; c++)
+			mark_plane(image[c], src.comp_info[c].v_samp_factor * DCTSIZE, first, fx[c], fy[c], width, height,
+				&blends[c], wplanes[c], mask, alpha, wmark, intensity, channels == 3 ? 0.5f : 0);
+		jpeg_write_raw_data(&dst, image, mcu_rows);
+	}
+	delete[] planes;
+	planes = nullptr;
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	compressing = false;
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	if (out)
+		out -> assign(buffer, buffer + out_size);
+	free(buffer);
+	return true;
+}
+
+// Function to mark a JPEG image held in memory blending in YCbCr
+void mark_ycc_jpeg(const unsigned char * data, size_t size, const prepared_wmark * wmark, float intensity,
+	std::vector<unsigned char> * out, int quality){
+	if (!mark_ycc(nullptr, data, size, nullptr, out, wmark, intensity, quality))
+		mark_fused(nullptr, data, size, nullptr, out, wmark, intensity, quality);
+}
+
+// Function to mark a JPEG file into another blending in YCbCr
+void mark_ycc_file(const std::string& load_path, const std::string& save_path, const prepared_wmark * wmark,
+	float intensity, int quality){
+	std::FILE * in = std::fopen(&load_path[0u], "rb");
+	if (!in)
+		throw cimg_library::CImgIOException("mark_ycc_file(): Failed to open file '%s' for reading.", load_path.c_str());
+	std::FILE * out = std::fopen(&save_path[0u], "wb");
+	if (!out){
+		std::fclose(in);
+		throw cimg_library::CImgIOException("mark_ycc_file(): Failed to open file '%s' for writing.", save_path.c_str());
+	}
+	try{
+		if (!mark_ycc(in, nullptr, 0, out, nullptr, wmark, intensity, quality)){
+			std::rewind(in);
+			mark_fused(in, nullptr, 0, out, nullptr, wmark, intensity, quality);
+		}
+	}catch (const cimg_library::CImgIOException&) {
+		std::fclose(in);
+		std::fclose(out);
+		std::remove(&save_path[0u]);
+		throw;
+	}
+	std::fclose(in);
+	if (std::fclose(out) != 0){
+		std::remove(&save_path[0u]);
+		throw cimg_library::CImgIOException("mark_ycc_file(): Failed to write file '%s'.", save_path.c_str());
+	}
+}
+
+// Data structure defining a band of rows of a banded image
+struct image_band{
+	unsigned char * pixels;
+	int first_row;
+	int rows;
+	std::atomic<int> pending;	// pieces still to be marked
+};
+
+// Data structure defining a piece of a band to be marked
+struct band_piece{
+	image_band * band;
+	int s_row;
+	int e_row;
+};
+
+// Function to run a step on a libjpeg object, returns false if libjpeg raised an error
+template <typename F>
+static bool jpeg_step(codec_error_mgr * jerr, F step){
+	if (setjmp(jerr -> setjmp_buffer))
+		return false;
+	step();
+	return true;
+}
+
+// Function to mark a JPEG file of any size in bounded memory: the image goes through bands of rows that fit
+// band_budget bytes (three bands in flight: decoding, marking, encoding), each band is marked by n_markers threads
+void mark_banded_file(const std::string& load_path, const std::string& save_path, const prepared_wmark * wmark,
+	float intensity, int n_markers, size_t band_budget, int quality){
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	codec_error_mgr src_err, dst_err;
+	src.err = jpeg_std_error(&src_err.original);
+	src_err.original.error_exit = codec_error_exit;
+	dst.err = jpeg_std_error(&dst_err.original);
+	dst_err.original.error_exit = codec_error_exit;
+	src_err.message[0] = '\0';
+	dst_err.message[0] = '\0';
+
+	std::FILE * in = std::fopen(&load_path[0u], "rb");
+	if (!in)
+		throw cimg_library::CImgIOException("mark_banded_file(): Failed to open file '%s' for reading.", load_path.c_str());
+	std::FILE * out = std::fopen(&save_path[0u], "wb");
+	if (!out){
+		std::fclose(in);
+		throw cimg_library::CImgIOException("mark_banded_file(): Failed to open file '%s' for writing.", save_path.c_str());
+	}
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+	bool ok = jpeg_step(&src_err, [&]{
+		jpeg_stdio_src(&src, in);
+		jpeg_read_header(&src, TRUE);
+		jpeg_start_decompress(&src);
+	});
+	int width = src.output_width, channels = src.output_components;
+	if (ok && channels != 1 && channels != 3){
+		std::snprintf(src_err.message, sizeof(src_err.message), "Unsupported number of components %d.", channels);
+		ok = false;
+	}
+	ok = ok && jpeg_step(&dst_err, [&]{
+		jpeg_stdio_dest(&dst, out);
+		dst.image_width = width;
+		dst.image_height = src.output_height;
+		dst.input_components = channels;
+		dst.in_color_space = channels == 3 ? JCS_RGB : JCS_GRAYSCALE;
+		jpeg_set_defaults(&dst);
+		jpeg_set_quality(&dst, quality, TRUE);
+		jpeg_start_compress(&dst, TRUE);
+	});
+	if (!ok){
+		std::string message = src_err.message[0] ? src_err.message : dst_err.message;
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		std::fclose(in);
+		std::fclose(out);
+		std::remove(&save_path[0u]);
+		throw cimg_library::CImgIOException("mark_banded_file(): %s", message.c_str());
+	}
+
+	// Bands are a whole number of MCU rows, as many as the budget allows for the three bands in flight
+	size_t row_bytes = (size_t) width * channels;
+	int mcu_rows = src.max_v_samp_factor * DCTSIZE;
+	size_t fit = band_budget / 3 / row_bytes / mcu_rows, all = (src.output_height + mcu_rows - 1) / mcu_rows;
+	int band_rows = (int) std::max(std::min(fit, all), (size_t) 1) * mcu_rows;
+
+	queue<image_band *> free_bands, encode_queue;
+	queue<band_piece *> mark_queue;
+	std::mutex done_mutex;
+	std::condition_variable done_cond;
+	std::vector<image_band *> bands;
+	for (int i = 0; i < 3; i++){
+		image_band * band = new image_band;
+		band -> pixels = new unsigned char[band_rows * row_bytes];
+		bands.push_back(band);
+		free_bands.push(band);
+	}
+
+	// Markers mark the pieces of the bands, the last one of a band wakes up the encoder
+	row_kernel kernel = pick_row_kernel(channels, wmark, intensity);
+	std::vector<std::thread> markers;
+	for (int i = 0; i < n_markers; i++)
+		markers.push_back(std::thread([&]{
+			while (true){
+				band_piece * piece = mark_queue.pop();
+				if (piece == EOS)
+					return;
+				for (int row = piece -> s_row; row < piece -> e_row; row++)
+					kernel(piece -> band -> pixels + row * row_bytes, width, piece -> band -> first_row + row, wmark, intensity);
+				if (piece -> band -> pending.fetch_sub(1) == 1){
+					std::unique_lock<std::mutex> lock(done_mutex);
+					done_cond.notify_all();
+				}
+				delete(piece);
+			}
+		}));
+
+	// The encoder writes the bands in order as soon as they are marked
+	std::atomic<bool> encoded(true);
+	std::thread encoder([&]{
+		while (true){
+			image_band * band = encode_queue.pop();
+			if (band == EOS)
+				return;
+			{
+				std::unique_lock<std::mutex> lock(done_mutex);
+				done_cond.wait(lock, [&]{ return band -> pending == 0; });
+			}
+			if (encoded && !jpeg_step(&dst_err, [&]{
+				JSAMPROW rows[MAX_SAMP_FACTOR * DCTSIZE];
+				for (int first = 0; first < band -> rows; first += mcu_rows){
+					int n = std::min(mcu_rows, band -> rows - first);
+					for (int i = 0; i < n; i++)
+						rows[i] = band -> pixels + (first + i) * row_bytes;
+					jpeg_write_scanlines(&dst, rows, n);
+				}
+			}))
+				encoded = false;
+			free_bands.push(band);
+		}
+	});
+
+	// The decoder fills the bands and splits them among the markers
+	bool decoded = true;
+	while (decoded && encoded && src.output_scanline < src.output_height){
+		image_band * band = free_bands.pop();
+		band -> first_row = src.output_scanline;
+		band -> rows = 0;
+		decoded = jpeg_step(&src_err, [&]{
+			JSAMPROW rows[MAX_SAMP_FACTOR * DCTSIZE];
+			while (band -> rows < band_rows && src.output_scanline < src.output_height){
+				int n = std::min(mcu_rows, band_rows - band -> rows);
+				for (int i = 0; i < n; i++)
+					rows[i] = band -> pixels + (band -> rows + i) * row_bytes;
+				band -> rows += jpeg_read_scanlines(&src, rows, n);
+			}
+		});
+		int pieces = std::min(n_markers, band -> rows);
+		band -> pending = std::max(pieces, 0);
+		encode_queue.push(band);
+		for (int i = 0; i < pieces; i++){
+			band_piece * piece = new band_piece;
+			piece -> band = band;
+			piece -> s_row = band -> rows * i / pieces;
+			piece -> e_row = band -> rows * (i + 1) / pieces;
+			mark_queue.push(piece);
+		}
+	}
+	for (int i = 0; i < n_markers; i++)
+		mark_queue.push(EOS);
+	for (std::thread& t : markers)
+		t.join();
+	encode_queue.push(EOS);
+	encoder.join();
+	for (image_band * band : bands){
+		delete[] band -> pixels;
+		delete(band);
+	}
+
+	ok = decoded && encoded && jpeg_step(&dst_err, [&]{ jpeg_finish_compress(&dst); }) &&
+		jpeg_step(&src_err, [&]{ jpeg_finish_decompress(&src); });
+	std::string message = !decoded ? src_err.message : dst_err.message;
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	std::fclose(in);
+	if (std::fclose(out) != 0 && ok){
+		ok = false;
+		message = "Failed to write file '" + save_path + "'.";
+	}
+	if (!ok){
+		std::remove(&save_path[0u]);
+		throw cimg_library::CImgIOException("mark_banded_file(): %s", message.c_str());
+	}
+}
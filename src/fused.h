@@ -0,0 +1,49 @@
+#ifndef __FUSED_H__
+#define __FUSED_H__
+
+#include <string>
+#include <vector>
+#include "wmark.h"
+
+/***
+	Fused decode-mark-encode engine for JPEG images. Instead of decoding into a whole CImg, marking it and
+	reading it again to encode it, the image goes through a band of scanlines one MCU row high: the decoder
+	fills the band, the watermark is applied while the band is still in cache and the encoder consumes it.
+	Only the band is kept in memory, the decoded image is never materialised. The output is the same as
+	loading with CImg, marking with mark_chunk and saving with CImg at the same quality.
+	The banded variant is meant for images that don't fit in memory: decoding, marking and encoding overlap on
+	bands sized from a memory budget, and the rows of a band are marked in parallel. Progressive JPEGs still
+	need libjpeg to buffer the whole coefficient image while decoding.
+***/
+
+// Function to mark a JPEG image held in memory, throws CImgIOException on errors
+void mark_fused_jpeg(const unsigned char * data, size_t size, const prepared_wmark * wmark, float intensity,
+	std::vector<unsigned char> * out, int quality = 100);
+
+// Function to mark a JPEG file into another streaming from file to file, throws CImgIOException on errors
+void mark_fused_file(const std::string& load_path, const std::string& save_path, const prepared_wmark * wmark,
+	float intensity, int quality = 100);
+
+// Functions to mark a JPEG image blending in YCbCr straight on the planes of the decoder (raw data, chroma
+// still subsampled) with the watermark converted once by prepare_wmark, so both colour conversions are skipped.
+// A subsampled chroma sample gets the average of the blends of the pixels it covers, weighted by their alpha
+// with RGBA watermarks. Images that are not YCbCr or grayscale, or 3 channels images with a 1 channel
+// watermark, go through mark_fused instead.
+// The reference is the RGB blend of mark_chunk on the decoded image, before any encoding. The RGB path already
+// drifts from it since chroma is upsampled, converted and subsampled again (about 0.7 to 3.5 levels on average
+// at quality 100), the YCbCr path skips that round trip and lands closer (0.04 to 1.2): its mean absolute
+// difference from the reference may exceed the one of the RGB path by at most YCC_MEAN_TOLERANCE levels per
+// channel (checked by seqwatermarker -v, on subsampled and grayscale images by test/ycc_tolerance.sh). Grayscale
+// samples are truncated as in the RGB path, colour ones are rounded.
+#define YCC_MEAN_TOLERANCE 0.25
+void mark_ycc_jpeg(const unsigned char * data, size_t size, const prepared_wmark * wmark, float intensity,
+	std::vector<unsigned char> * out, int quality = 100);
+void mark_ycc_file(const std::string& load_path, const std::string& save_path, const prepared_wmark * wmark,
+	float intensity, int quality = 100);
+
+// Function to mark a JPEG file of any size in bounded memory: the image goes through bands of rows that fit
+// band_budget bytes (three bands in flight: decoding, marking, encoding), each band is marked by n_markers threads
+void mark_banded_file(const std::string& load_path, const std::string& save_path, const prepared_wmark * wmark,
+	float intensity, int n_markers, size_t band_budget, int quality = 100);
+
+#endif
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include "guided.h"
+
+static inline uint64_t span_of(uint32_t next, uint32_t end){
+	return (uint64_t) next << 32 | end;
+}
+
+guided_rows::guided_rows(int n_workers)
+	: m_workers(std::max(1, n_workers)), m_total(0), m_claimed(0), m_claims(0), m_splits(0)
+{
+	m_spans = new std::atomic<uint64_t>[m_workers];
+	for (int w = 0; w < m_workers; w++)
+		m_spans[w] = 0;
+}
+
+guided_rows::~guided_rows(){
+	delete[](m_spans);
+}
+
+// Add an image, before the workers start
+void guided_rows::add(cimg_library::CImg<float> * img){
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_imgs.push_back(img);
+	m_offsets.push_back(m_total);
+	m_total += img -> height();
+}
+
+// Claim a range from the global counter, remaining / (GUIDED_FACTOR * workers) rows and at least a step
+bool guided_rows::claim(int worker){
+	uint32_t first = m_claimed, size;
+	do{
+		if (first >= m_total)
+			return false;
+		uint32_t remaining = m_total - first;
+		size = std::min(remaining, std::max((uint32_t) GUIDED_STEP_ROWS, remaining / (GUIDED_FACTOR * m_workers)));
+	}while (!m_claimed.compare_exchange_weak(first, first + size));
+	m_spans[worker] = span_of(first, first + size);
+	m_claims += 1;
+	return true;
+}
+
+// Take the upper half of the largest range in progress, if it is worth at least two steps
+bool guided_rows::split(int worker){
+	while (true){
+		int victim = -1;
+		uint64_t largest = 0;
+		uint32_t left = 0;
+		for (int w = 0; w < m_workers; w++){
+			uint64_t span = m_spans[w];
+			uint32_t next = span >> 32, end = (uint32_t) span;
+			if (w != worker && end > next && end - next > left){
+				victim = w;
+				largest = span;
+				left = end - next;
+			}
+		}
+		if (victim == -1 || left < 2 * GUIDED_STEP_ROWS)
+			return false;
+		uint32_t next = largest >> 32, end = (uint32_t) largest, middle = next + left / 2;
+		// The owner may have moved on in the meantime, then look again
+		if (m_spans[victim].compare_exchange_strong(largest, span_of(next, middle))){
+			m_spans[worker] = span_of(middle, end);
+			m_splits += 1;
+			return true;
+		}
+	}
+}
+
+// Get the next band of rows (first to last, included) of an image for a worker, false once every row has been handed out
+bool guided_rows::next(int worker, cimg_library::CImg<float> ** img, int * first_row, int * last_row){
+	while (true){
+		uint64_t span = m_spans[worker];
+		uint32_t next = span >> 32, end = (uint32_t) span;
+		if (next >= end){
+			if (!claim(worker) && !split(worker))
+				return false;
+			continue;
+		}
+		// A band never crosses the end of an image
+		int i = std::upper_bound(m_offsets.begin(), m_offsets.end(), next) - m_offsets.begin() - 1;
+		uint32_t img_end = m_offsets[i] + m_imgs[i] -> height();
+		uint32_t step = std::min(std::min((uint32_t) GUIDED_STEP_ROWS, end - next), img_end - next);
+		if (!m_spans[worker].compare_exchange_strong(span, span_of(next + step, end)))
+			continue;
+		*img = m_imgs[i];
+		*first_row = next - m_offsets[i];
+		*last_row = *first_row + step - 1;
+		return true;
+	}
+}
+
+long guided_rows::claims(){
+	return m_claims;
+}
+
+long guided_rows::splits(){
+	return m_splits;
+}
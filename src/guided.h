@@ -0,0 +1,52 @@
+#ifndef __GUIDED_H__
+#define __GUIDED_H__
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include "CImg.h"
+
+/***
+	Guided scheduling of the rows of a set of images, instead of cutting each image into n equal chunks up front.
+	The rows of all the images are numbered one after the other. A worker with nothing to do claims from a global
+	counter a range of remaining / (GUIDED_FACTOR * workers) rows, so ranges are large at the start and shrink
+	as the rows run out, and marks its range GUIDED_STEP_ROWS rows at a time. Once the counter is exhausted an
+	idle worker splits the largest range still in progress and takes its upper half, so no worker is left
+	alone on a big range at the end of the run. A range is (next, end) packed in one 64 bit word: the owner
+	advances next and a thief lowers end, both with a compare and swap.
+***/
+
+#define GUIDED_FACTOR 2
+#define GUIDED_STEP_ROWS 16
+
+class guided_rows{
+public:
+	guided_rows(int n_workers);
+	~guided_rows();
+
+	// Add an image, before the workers start
+	void add(cimg_library::CImg<float> * img);
+
+	// Get the next band of rows (first to last, included) of an image for a worker, false once every row has been handed out
+	bool next(int worker, cimg_library::CImg<float> ** img, int * first_row, int * last_row);
+
+	// Ranges claimed from the global counter and split from other workers so far
+	long claims();
+	long splits();
+
+private:
+	int m_workers;
+	std::mutex m_mutex;
+	std::vector<cimg_library::CImg<float> *> m_imgs;
+	std::vector<uint32_t> m_offsets;	// First row of each image
+	uint32_t m_total;
+	std::atomic<uint32_t> m_claimed;
+	std::atomic<uint64_t> * m_spans;	// Range of each worker, next << 32 | end
+	std::atomic<long> m_claims, m_splits;
+
+	bool claim(int worker);
+	bool split(int worker);
+};
+
+#endif
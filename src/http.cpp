@@ -0,0 +1,174 @@
+#include "http.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Whether the connection is to be kept open after this message
+bool http_message::keep_alive() const{
+	auto it = headers.find("connection");
+	std::string connection = it == headers.end() ? "" : it -> second;
+	std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+	bool http11 = start[0] == "HTTP/1.1" || start[2] == "HTTP/1.1";
+	return http11 ? connection != "close" : connection == "keep-alive";
+}
+
+http_stream::http_stream(int fd, size_t max_body)
+	: m_fd(fd), m_max_body(max_body), m_too_large(false), m_buffer(1 << 16), m_start(0), m_end(0)
+{
+}
+
+bool http_stream::too_large() const{
+	return m_too_large;
+}
+
+// Read more data, compacting the buffer first
+bool http_stream::fill(){
+	if (m_start > 0){
+		std::memmove(&m_buffer[0], &m_buffer[m_start], m_end - m_start);
+		m_end -= m_start;
+		m_start = 0;
+	}
+	if (m_end == m_buffer.size())
+		m_buffer.resize(m_buffer.size() * 2);
+	ssize_t n;
+	do{
+		n = recv(m_fd, &m_buffer[m_end], m_buffer.size() - m_end, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return false;
+	m_end += n;
+	return true;
+}
+
+// Read the next message with its body, returns false on end of stream, error or malformed message
+bool http_stream::read(http_message * msg){
+	// Wait for the end of the head
+	size_t head_end;
+	while (true){
+		char * begin = &m_buffer[m_start];
+		char * found = std::search(begin, begin + (m_end - m_start), "\r\n\r\n", "\r\n\r\n" + 4);
+		if (found != begin + (m_end - m_start)){
+			head_end = m_start + (found - begin);
+			break;
+		}
+		if (m_end - m_start > (1 << 16) || !fill())
+			return false;
+	}
+
+	// Parse start line and headers
+	std::string head(&m_buffer[m_start], head_end - m_start);
+	m_start = head_end + 4;
+	size_t line_end = head.find("\r\n");
+	std::string line = head.substr(0, line_end);
+	for (int i = 0; i < 3; i++){
+		size_t space = i < 2 ? line.find(' ') : std::string::npos;
+		msg -> start[i] = line.substr(0, space);
+		line = space == std::string::npos ? "" : line.substr(space + 1);
+	}
+	msg -> headers.clear();
+	while (line_end != std::string::npos){
+		size_t next = head.find("\r\n", line_end + 2);
+		std::string header = head.substr(line_end + 2, next == std::string::npos ? std::string::npos : next - line_end - 2);
+		size_t colon = header.find(':');
+		if (colon != std::string::npos){
+			std::string name = header.substr(0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+			size_t value = header.find_first_not_of(" \t", colon + 1);
+			msg -> headers[name] = value == std::string::npos ? "" : header.substr(value);
+		}
+		line_end = next;
+	}
+
+	// Read the body
+	size_t length = 0;
+	auto it = msg -> headers.find("content-length");
+	if (it != msg -> headers.end()){
+		char * end;
+		length = strtoul(&(it -> second)[0u], &end, 10);
+		if (*end != '\0')
+			return false;
+	}
+	m_too_large = length > m_max_body;
+	if (m_too_large)
+		return false;
+	msg -> body.resize(length);
+	size_t copied = std::min(length, m_end - m_start);
+	std::memcpy(msg -> body.data(), &m_buffer[m_start], copied);
+	m_start += copied;
+	while (copied < length){
+		ssize_t n = recv(m_fd, msg -> body.data() + copied, length - copied, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		copied += n;
+	}
+	return true;
+}
+
+// Write a message made of the given head (start line and headers, without the empty line) and body
+bool http_stream::write(const std::string& head, const unsigned char * body, size_t size){
+	std::string full_head = head + "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+	struct iovec parts[2];
+	parts[0].iov_base = (void *) full_head.data();
+	parts[0].iov_len = full_head.size();
+	parts[1].iov_base = (void *) body;
+	parts[1].iov_len = size;
+	struct msghdr out;
+	std::memset(&out, 0, sizeof(out));
+	out.msg_iov = parts;
+	out.msg_iovlen = 2;
+	while (parts[0].iov_len + parts[1].iov_len > 0){
+		ssize_t n = sendmsg(m_fd, &out, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		for (auto& part : parts){
+			size_t sent = std::min((size_t) n, part.iov_len);
+			part.iov_base = (char *) part.iov_base + sent;
+			part.iov_len -= sent;
+			n -= sent;
+		}
+	}
+	return true;
+}
+
+// Function to connect to a Unix domain socket (if path is not empty) or to localhost:port, -1 on failure
+int http_connect(const std::string& path, int port){
+	int fd;
+	if (!path.empty()){
+		struct sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, &path[0u], sizeof(addr.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0){
+			close(fd);
+			return -1;
+		}
+	}
+	else{
+		struct sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0){
+			close(fd);
+			return -1;
+		}
+		int one = 1;
+		if (fd >= 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
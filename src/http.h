@@ -0,0 +1,49 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <string>
+#include <vector>
+#include <map>
+
+/***
+	Minimal HTTP/1.1 framing over a connected socket (TCP or Unix domain), used by servewatermarker and loadgen.
+	Only bodies with a Content-Length are supported, which is all the two sides ever send.
+***/
+
+// Data structure defining a request or a response
+struct http_message{
+	std::string start[3];						// method, target, version or version, status, reason
+	std::map<std::string, std::string> headers;	// names are lower case
+	std::vector<unsigned char> body;
+
+	// Whether the connection is to be kept open after this message
+	bool keep_alive() const;
+};
+
+class http_stream{
+public:
+	http_stream(int fd, size_t max_body);
+
+	// Read the next message with its body, returns false on end of stream, error or malformed message
+	bool read(http_message * msg);
+
+	// Write a message made of the given head (start line and headers, without the empty line) and body
+	bool write(const std::string& head, const unsigned char * body, size_t size);
+
+	// Whether the last read failed because the body was too large
+	bool too_large() const;
+
+private:
+	int m_fd;
+	size_t m_max_body;
+	bool m_too_large;
+	std::vector<char> m_buffer;
+	size_t m_start, m_end;
+
+	bool fill();
+};
+
+// Function to connect to a Unix domain socket (if path is not empty) or to localhost:port, -1 on failure
+int http_connect(const std::string& path, int port);
+
+#endif
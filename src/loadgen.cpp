@@ -0,0 +1,136 @@
+/***
+	Load generator for servewatermarker.
+	Opens the given number of connections and posts the same image over each of them,
+	then reports the requests per second and the latency distribution.
+***/
+#include <unistd.h>
+#include <mutex>
+#include "my_utils.h"
+#include "http.h"
+
+std::mutex stats_lock;
+std::vector<long> latencies;
+std::atomic<int> failed;
+
+// Send the requests of a connection, reconnecting for each one if keep alive is disabled
+void client(std::string socket_path, int port, const std::vector<unsigned char> * image, std::string target, int n_requests, bool keep_alive){
+	std::vector<long> mine;
+	std::string head = "POST " + target + " HTTP/1.1\r\nHost: localhost\r\nContent-Type: image/jpeg\r\n"
+		+ (keep_alive ? "" : "Connection: close\r\n");
+	int fd = -1;
+	http_stream * stream = nullptr;
+	http_message res;
+	for (int i = 0; i < n_requests; i++){
+		if (fd < 0){
+			fd = http_connect(socket_path, port);
+			if (fd < 0){
+				std::cerr << "Error connecting: " << strerror(errno) << std::endl;
+				failed += n_requests - i;
+				break;
+			}
+			stream = new http_stream(fd, 1 << 30);
+		}
+		auto start = std::chrono::steady_clock::now();
+		bool ok = stream -> write(head, image -> data(), image -> size()) && stream -> read(&res);
+		if (ok && res.start[1] == "200")
+			mine.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+		else
+			failed += 1;
+		if (!ok || !res.keep_alive()){
+			delete(stream);
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd >= 0){
+		delete(stream);
+		close(fd);
+	}
+	std::unique_lock<std::mutex> lock(stats_lock);
+	latencies.insert(latencies.end(), mine.begin(), mine.end());
+}
+
+int main(int argc, char* argv[]){
+
+	std::string socket_path, image_file, target = "/mark";
+	int c, port = 0, n_connections = 1, n_requests = 100;
+	bool keep_alive = true;
+	char * end;
+	const char * USAGE = "Usage -f <image_file> [-u <socket_path>] [-p <port>] -c <connections> -r <requests> [-i <intensity>] [-x]\n"
+	"-f image_file --- JPEG image to be posted\n"
+	"-u socket_path --- Unix domain socket of the server\n"
+	"-p port --- Localhost TCP port of the server\n"
+	"-c connections --- Number of concurrent connections, defaults to 1\n"
+	"-r requests --- Number of requests per connection, defaults to 100\n"
+	"-i intensity --- Intensity to be requested, defaults to the server one\n"
+	"-x --- Open a new connection for each request instead of keeping it alive\n";
+
+	while ((c = getopt (argc, argv, "f:u:p:c:r:i:x")) != -1)
+		switch (c){
+			case 'f':
+				image_file = optarg;
+				break;
+			case 'u':
+				socket_path = optarg;
+				break;
+			case 'p':
+			case 'c':
+			case 'r':
+			case 'i':{
+				long value = strtol(optarg, &end, 10);
+				if (*end != '\0' || value < 0) {
+					std::cerr << "Invalid value for -" << (char) c << ".\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				if (c == 'p')
+					port = value;
+				else if (c == 'c')
+					n_connections = value;
+				else if (c == 'r')
+					n_requests = value;
+				else
+					target = "/mark?intensity=" + std::to_string(value);
+				break;
+			}
+			case 'x':
+				keep_alive = false;
+				break;
+			case '?':
+				std::cerr << USAGE << std::endl;
+				return 1;
+			default:
+				exit(1);
+		}
+
+	if (image_file.empty() || (socket_path.empty() && port == 0)){
+		std::cerr << USAGE << std::endl;
+		return 1;
+	}
+
+	// Read the image once, all the requests share it
+	std::FILE * file = std::fopen(&image_file[0u], "rb");
+	if (!file){
+		std::cerr << "Error reading image " << image_file << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	std::vector<unsigned char> image;
+	unsigned char buffer[1 << 16];
+	size_t n;
+	while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		image.insert(image.end(), buffer, buffer + n);
+	std::fclose(file);
+
+	std::vector<std::thread> clients;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < n_connections; i++)
+		clients.push_back(std::thread(client, socket_path, port, &image, target, n_requests, keep_alive));
+	join_em(&clients);
+	auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Sent " << (long) n_connections * n_requests << " requests over " << n_connections << " connections in " << msec << " msecs ("
+		<< failed << " failed)" << std::endl;
+	std::cout << "Requests per second: " << (msec > 0 ? latencies.size() * 1000.0 / msec : 0) << std::endl;
+	std::cout << "Latency " << latency_summary(latencies) << std::endl;
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+#include "manifest.h"
+#include "my_utils.h"
+#include <cinttypes>
+
+#define MANIFEST_HEADER "# watermarker manifest v2\n"
+
+// Function to get size and modification time (in nsecs) of a file
+static bool stat_file(const std::string& path, long long * size, long long * mtime){
+	struct stat st;
+	if (stat(&path[0u], &st) != 0)
+		return false;
+	*size = st.st_size;
+	*mtime = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	return true;
+}
+
+static uint64_t path_key_of(const std::string& path){
+	uint64_t key = hash_bytes(&path[0u], path.size());
+	return key == 0 ? 1 : key;
+}
+
+static uint64_t stamp_of(long long size, long long mtime){
+	uint64_t stamp = hash_bytes(&size, sizeof(size));
+	return hash_bytes(&mtime, sizeof(mtime), stamp);
+}
+
+static uint64_t job_hash(uint64_t wmark_fp, int intensity, const std::string& out_path){
+	uint64_t job = hash_bytes(&wmark_fp, sizeof(wmark_fp));
+	job = hash_bytes(&intensity, sizeof(intensity), job);
+	return hash_bytes(&out_path[0u], out_path.size(), job);
+}
+
+manifest::manifest(std::string path, uint64_t wmark_fp, int intensity)
+	: m_path(path), m_wmark_fp(wmark_fp), m_intensity(intensity), m_log(nullptr), m_used(0)
+{
+	m_slots.resize(1 << 16);
+}
+
+manifest::~manifest(){
+	if (m_log)
+		std::fclose(m_log);
+}
+
+// Load the existing records (if any) and open the log for appending, returns false on failure
+bool manifest::open(){
+	std::FILE * file = std::fopen(&m_path[0u], "r");
+	if (file){
+		char * line = nullptr;
+		size_t cap = 0;
+		ssize_t len;
+		while ((len = getline(&line, &cap, file)) > 0){
+			if (line[0] == '#')
+				continue;
+			if (line[len-1] == '\n')
+				line[--len] = '\0';
+			// path, size, mtime, content hash, watermark fingerprint, intensity, output path, output size and mtime
+			// (v1 records have no output fields, their output never matches and is processed again)
+			char * fields[9];
+			int n = 0;
+			char * p = line;
+			fields[n++] = p;
+			while (n < 9 && (p = strchr(p, '\t')) != nullptr){
+				*p++ = '\0';
+				fields[n++] = p;
+			}
+			if (n != 7 && n != 9)
+				continue;
+			long long size = strtoll(fields[1], nullptr, 10);
+			long long mtime = strtoll(fields[2], nullptr, 10);
+			manifest_slot slot;
+			slot.path_key = path_key_of(fields[0]);
+			slot.stamp = stamp_of(size, mtime);
+			slot.content_hash = strtoull(fields[3], nullptr, 16);
+			slot.job = job_hash(strtoull(fields[4], nullptr, 16), atoi(fields[5]), fields[6]);
+			slot.out_stamp = n == 9 ? stamp_of(strtoll(fields[7], nullptr, 10), strtoll(fields[8], nullptr, 10)) : 0;
+			insert(slot);
+		}
+		free(line);
+		std::fclose(file);
+	}
+	m_log = std::fopen(&m_path[0u], "a");
+	if (!m_log)
+		return false;
+	if (!file)
+		std::fputs(MANIFEST_HEADER, m_log);
+	return true;
+}
+
+// Check whether the output of an input is up to date, i.e. the input didn't change, it was marked with the same job
+// and the output is still the one that was recorded
+bool manifest::up_to_date(const std::string& in_path, const std::string& out_path){
+	uint64_t key = path_key_of(in_path);
+	manifest_slot known;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		manifest_slot * slot = find(key);
+		if (!slot || slot -> job != job_of(out_path))
+			return false;
+		known = *slot;
+	}
+	long long size, mtime, out_size, out_mtime;
+	if (!stat_file(in_path, &size, &mtime) || !stat_file(out_path, &out_size, &out_mtime))
+		return false;
+	// The output has been rewritten (e.g. by a run without the manifest) or replaced since it was recorded
+	if (stamp_of(out_size, out_mtime) != known.out_stamp)
+		return false;
+	if (stamp_of(size, mtime) == known.stamp)
+		return true;
+
+	// The file has been touched, it is still up to date if its content didn't change
+	uint64_t content_hash;
+	if (!hash_file(in_path, &content_hash) || content_hash != known.content_hash)
+		return false;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	known.stamp = stamp_of(size, mtime);
+	insert(known);
+	append(in_path, size, mtime, content_hash, out_path, out_size, out_mtime);
+	return true;
+}
+
+// Record that an input has been processed into the given output
+void manifest::record(const std::string& in_path, const std::string& out_path){
+	long long size, mtime, out_size, out_mtime;
+	uint64_t content_hash;
+	if (!stat_file(in_path, &size, &mtime) || !hash_file(in_path, &content_hash) || !stat_file(out_path, &out_size, &out_mtime)){
+		std::cerr << "Error adding " << in_path << " to the manifest" << std::endl;
+		return;
+	}
+	manifest_slot slot;
+	slot.path_key = path_key_of(in_path);
+	slot.stamp = stamp_of(size, mtime);
+	slot.content_hash = content_hash;
+	slot.job = job_of(out_path);
+	slot.out_stamp = stamp_of(out_size, out_mtime);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	insert(slot);
+	append(in_path, size, mtime, content_hash, out_path, out_size, out_mtime);
+}
+
+// Number of inputs in the manifest
+size_t manifest::size(){
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_used;
+}
+
+uint64_t manifest::job_of(const std::string& out_path){
+	return job_hash(m_wmark_fp, m_intensity, out_path);
+}
+
+manifest_slot * manifest::find(uint64_t path_key){
+	size_t mask = m_slots.size() - 1;
+	for (size_t i = path_key & mask; m_slots[i].path_key != 0; i = (i + 1) & mask)
+		if (m_slots[i].path_key == path_key)
+			return &m_slots[i];
+	return nullptr;
+}
+
+// Insert a slot, replacing the one with the same path if present
+void manifest::insert(const manifest_slot& slot){
+	if ((m_used + 1) * 10 > m_slots.size() * 7)
+		grow();
+	size_t mask = m_slots.size() - 1;
+	size_t i = slot.path_key & mask;
+	while (m_slots[i].path_key != 0 && m_slots[i].path_key != slot.path_key)
+		i = (i + 1) & mask;
+	if (m_slots[i].path_key == 0)
+		m_used += 1;
+	m_slots[i] = slot;
+}
+
+void manifest::grow(){
+	std::vector<manifest_slot> old;
+	old.swap(m_slots);
+	m_slots.resize(old.size() * 2);
+	m_used = 0;
+	for (const manifest_slot& slot : old)
+		if (slot.path_key != 0)
+			insert(slot);
+}
+
+void manifest::append(const std::string& in_path, long long size, long long mtime, uint64_t content_hash, const std::string& out_path,
+	long long out_size, long long out_mtime){
+	if (!m_log || in_path.find_first_of("\t\n") != std::string::npos || out_path.find_first_of("\t\n") != std::string::npos)
+		return;
+	std::fprintf(m_log, "%s\t%lld\t%lld\t%016" PRIx64 "\t%016" PRIx64 "\t%d\t%s\t%lld\t%lld\n",
+		&in_path[0u], size, mtime, content_hash, m_wmark_fp, m_intensity, &out_path[0u], out_size, out_mtime);
+	std::fflush(m_log);
+}
+
+// Function to open the manifest of the images marked from src_path with the given watermark and intensity, nullptr on failure
+manifest * open_manifest(const std::string& src_path, const std::string& wmark_file, float intensity, uint64_t variant){
+	uint64_t wmark_fp;
+	if (!hash_file(wmark_file, &wmark_fp)){
+		std::cerr << "Error fingerprinting watermark " << wmark_file << std::endl;
+		return nullptr;
+	}
+	if (variant != 0)
+		wmark_fp = hash_bytes(&variant, sizeof(variant), wmark_fp);
+	manifest * m = new manifest(src_path + "/watermarked/.manifest", wmark_fp, (int)(intensity * 100 + 0.5));
+	if (!m -> open()){
+		std::cerr << "Error opening manifest in " << src_path << "/watermarked/" << std::endl;
+		delete(m);
+		return nullptr;
+	}
+	std::cout << "Manifest holds " << m -> size() << " marked images" << std::endl;
+	return m;
+}
@@ -0,0 +1,67 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+
+/***
+	On-disk manifest of the images that have already been watermarked.
+	Every processed input is appended to a log file as a line holding its path, size, mtime, content hash,
+	the watermark fingerprint, the intensity, the output path and the size and mtime of the output, so that
+	an output rewritten or removed by another run is processed again. When the manifest is opened the log
+	is replayed into a compact in-memory index (fixed size slots, open addressing) so that lookups stay
+	O(1) and cheap in memory even with tens of millions of entries.
+***/
+
+// Slot of the in-memory index, paths are only kept as hashes
+struct manifest_slot{
+	uint64_t path_key;		// hash of the input path, 0 means empty slot
+	uint64_t stamp;			// hash of size and mtime of the input
+	uint64_t content_hash;	// hash of the input bytes
+	uint64_t job;			// hash of watermark fingerprint, intensity and output path
+	uint64_t out_stamp;		// hash of size and mtime of the output when it was recorded
+};
+
+class manifest{
+public:
+	manifest(std::string path, uint64_t wmark_fp, int intensity);
+	~manifest();
+
+	// Load the existing records (if any) and open the log for appending, returns false on failure
+	bool open();
+
+	// Check whether the output of an input is up to date, i.e. the input didn't change, it was marked with the same job
+	// and the output is still the one that was recorded
+	bool up_to_date(const std::string& in_path, const std::string& out_path);
+
+	// Record that an input has been processed into the given output
+	void record(const std::string& in_path, const std::string& out_path);
+
+	// Number of inputs in the manifest
+	size_t size();
+
+private:
+	std::string m_path;
+	uint64_t m_wmark_fp;
+	int m_intensity;
+	std::FILE * m_log;
+	std::mutex m_mutex;
+	std::vector<manifest_slot> m_slots;
+	size_t m_used;
+
+	uint64_t job_of(const std::string& out_path);
+	manifest_slot * find(uint64_t path_key);
+	void insert(const manifest_slot& slot);
+	void grow();
+	void append(const std::string& in_path, long long size, long long mtime, uint64_t content_hash, const std::string& out_path,
+		long long out_size, long long out_mtime);
+};
+
+// Function to open the manifest of the images marked from src_path with the given watermark and intensity, nullptr on failure.
+// Options changing the output other than watermark and intensity (e.g. the placement) are folded in the fingerprint through variant.
+manifest * open_manifest(const std::string& src_path, const std::string& wmark_file, float intensity, uint64_t variant = 0);
+
+#endif
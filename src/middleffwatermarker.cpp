@@ -1,37 +1,68 @@
 /***
 	Parallel version of the program using FastFlow (see @ https://github.com/fastflow/fastflow).
-	Loading and saving are not parallelized and put in a pipeline, but rather preloaded in memory.
-	Parallelization is done on the marking stage only (the emitter simply sends out the pre-loaded images).
+	Loading and saving are not put in a pipeline, but rather done in separate phases before and after the marking
+	stage: the images are preloaded in memory and saved afterwards by the threads of a ParallelFor. The marking
+	stage is timed on its own (the emitter simply sends out the pre-loaded images).
 ***/
 
 #include <ff/farm.hpp>
 #include <ff/pipeline.hpp>
+#include <ff/parallel_for.hpp>
 #include <dirent.h> 
 #include <sstream>
 #include "queue.h"
 #include "my_utils.h"
+#include "manifest.h"
+#include "cache.h"
+#include "wmark.h"
+#include "topology.h"
 
 std::atomic<int> processed;
 
 // Watermark
 cimg_library::CImg<float> * wmark;
+prepared_wmark * prepared;
+
+// Manifest of the already processed images (only in incremental mode)
+manifest * done_manifest = nullptr;
+
+// Cache of the outputs of byte-identical images (only in dedupe mode)
+output_cache * dedupe_cache = nullptr;
 
 std::vector<task*> tasks;
 
+// Target pixels of a work item, 0 to send every chunk on its own
+long batch_pixels = 0;
+
 struct Img_save{
 	std::string save_path;
+	std::string load_path;
+	uint64_t cache_key;
 	cimg_library::CImg<float> *img;
 };
 
-// Node that emits the image paths (that have been pre-loaded)
-struct Emitter : public ff::ff_node_t<task, std::string>{
+// Node that emits the chunks of the pre-loaded images, in batches of at least batch_pixels pixels
+struct Emitter : public ff::ff_node_t<task_batch>{
    Emitter(std::string dir)
         : src_path(dir)
     {
     }
-	std::string* svc(task*) {
-		for (task *t:tasks)
-			ff_send_out(t);
+	task_batch* svc(task_batch*) {
+		task_batch * open = nullptr;
+		for (task *t:tasks){
+			if (!open){
+				open = new task_batch;
+				open -> pixels = 0;
+			}
+			open -> tasks.push_back(t);
+			open -> pixels += (long) (t -> chunk -> e_row - t -> chunk -> s_row + 1) * (t -> chunk -> e_col - t -> chunk -> s_col + 1);
+			if (open -> pixels >= batch_pixels){
+				ff_send_out(open);
+				open = nullptr;
+			}
+		}
+		if (open)
+			ff_send_out(open);
 		return EOS;
 	}
 
@@ -40,38 +71,59 @@ private:
 };
 
 
-// Node that marks the chunks of the images
-struct Marker : public ff::ff_node_t<task, std::string>{
-	Marker(float intensity) : _intensity(intensity){};
-		std::string *svc(task * t){
-			mark_chunk(t -> img, t -> chunk, wmark, _intensity);
-			delete(t -> chunk);
+// Node that marks the batches of chunks of the images
+struct Marker : public ff::ff_node_t<task_batch>{
+	Marker(float intensity, worker_stats * stats, int cpu) : _intensity(intensity), stats(stats), cpu(cpu){};
+
+		// FastFlow's default mapping is kept when not pinning
+		int svc_init(){
+			if (cpu >= 0 && ff::ff_mapThreadToCpu(cpu) != 0)
+				std::cerr << "Failed to pin marker to CPU " << cpu << std::endl;
+			return 0;
+		}
+
+		task_batch *svc(task_batch * batch){
+			auto start = std::chrono::steady_clock::now();
+			for (task * t : batch -> tasks){
+				mark_chunk(t -> img, t -> chunk, prepared, _intensity);
+				delete(t -> chunk);
+			}
+			delete(batch);
+			account_task(stats, start);
 			return GO_ON;
 		}
 
 private:
 	float _intensity;
+	worker_stats * stats;
+	int cpu;
 };
 
 
 int main(int argc, char* argv[]){
 
 	std::string src_path, wmark_file;
-	int sflag = -1, wflag = -1;
-	int c, n_workers = 1, n_chunks = 0;
+	int sflag = -1, wflag = -1, mflag = -1, dflag = -1;
+	int c, n_workers = 1, n_chunks = 0, depth = 0, skipped = 0;
+	pin_policy pinning = PIN_NONE;
 	float intensity = 0.3;
 	char * end;
-	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -c <chunks> -n <parallelism degree> -i <intensity>\n"
+	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -c <chunks> -n <parallelism degree> -i <intensity> -a <affinity> -k <batch> -q <depth> [-m] [-d]\n"
 	"-s src_path --- Directory containing the images to be watermarked\n"
 	"-w watermark_file --- Path of the watermark to be used\n"
 	"-c chunks --- Number of chunks to divide each image in, defaults to parallelism degree\n"
 	"-n parallelism degree --- Parallelism degree to be used\n"
-	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n";
+	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-a affinity --- Pin the markers: none (FastFlow mapping, default), spread or smt (one per core round robin over the NUMA nodes)\n"
+	"-k batch --- Batch the chunks into work items of at least batch thousands of pixels, images smaller than a batch are not split\n"
+	"-q depth --- On-demand scheduling, each marker queue holds at most depth work items (round robin if not given)\n"
+	"-m --- Incremental mode, skip the images already marked with the same watermark and intensity\n"
+	"-d --- Dedupe mode, byte-identical images are marked once and their output is linked from a cache\n";
 	std::vector<std::thread> workers;
 	std::vector<Img_save> images;
 
 	// Parse command line arguments
-	while ((c = getopt (argc, argv, "s:w:n:i:c:")) != -1)
+	while ((c = getopt (argc, argv, "s:w:n:i:c:a:k:q:md")) != -1)
 		switch (c){
 			case 's':
 				sflag = 1;
@@ -116,6 +168,36 @@ int main(int argc, char* argv[]){
 					std::cerr << "Intensity set to default " << intensity << " cause given value was out of range (0,100)" << std::endl;
 				}
 				break;
+			case 'a':
+				if (!parse_pin_policy(optarg, &pinning)) {
+					std::cerr << "Invalid affinity.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'k':
+				batch_pixels = strtol(optarg, &end, 10);
+				if (*end != '\0' || batch_pixels <= 0) {
+					std::cerr << "Invalid batch size.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				batch_pixels *= 1000;
+				break;
+			case 'q':
+				depth = strtol(optarg, &end, 10);
+				if (*end != '\0' || depth <= 0) {
+					std::cerr << "Invalid queue depth.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'm':
+				mflag = 1;
+				break;
+			case 'd':
+				dflag = 1;
+				break;
 			case '?':
 				if (optopt == 's' || optopt =='w')
 					std::cerr << USAGE << std::endl;
@@ -144,78 +226,147 @@ int main(int argc, char* argv[]){
 		exit(1);
 	}
 	std::cout << "Watermark size: (" << wmark -> width() <<", " << wmark -> height() << ")" << std::endl;
+	prepared = prepare_wmark(wmark);
+	std::cout << "Watermark tiles: " << prepared -> n_empty << " empty, " << prepared -> n_full << " full, " << prepared -> n_mixed << " mixed" << std::endl;
+
+	// In incremental mode load the manifest of the images already processed
+	if (mflag == 1)
+		done_manifest = open_manifest(src_path, wmark_file, intensity);
+
+	// In dedupe mode outputs are linked from the content-addressed cache
+	if (dflag == 1)
+		dedupe_cache = open_cache(src_path, wmark_file, intensity, done_manifest);
 
 	// If number of chunks has not been specified then set it to the parallelism degree
 	if(n_chunks == 0)
 		n_chunks = n_workers;
+	if (batch_pixels > 0)
+		std::cout << "Chunks will be batched into work items of at least " << batch_pixels << " pixels" << std::endl;
 
 	// Open the directory containing the images to be watermarked
+	std::vector<std::string> names;
 	DIR *dirp;
 	struct dirent *directory;
 	dirp = opendir(&src_path[0u]);
 	if (dirp){
 	    while ((directory = readdir(dirp)) != NULL){
 			if (strendswith(directory->d_name, ".jpg")){
-
-				cimg_library::CImg<float> * img = new cimg_library::CImg<float>;
-				try{
-					img -> load(&(src_path +"/" + directory->d_name)[0u]);
-				
-					
-					// Split the image into chunks
-					std::vector<img_chunk*> chunks = chunker(img, n_chunks);
-
-					Img_save is;
-					is.img = img;
-					is.save_path = src_path+"/watermarked/" + directory->d_name;
-					images.push_back(is);
-
-					// Push the chunks into a queue
-					for (unsigned int i = 0; i < chunks.size(); i++){
-						task *t = new task;
-						t -> img = img;
-						t -> save_path = src_path+"/watermarked/" + directory->d_name;
-						t -> chunk = chunks.at(i);
-						tasks.push_back(t);
-					}
-				}catch (const cimg_library::CImgIOException& e) {
-					std::cerr << "Error loading image " << (src_path +"/" + directory->d_name) << ": " << e.what() << std::endl;	
+				if (done_manifest && done_manifest -> up_to_date(src_path +"/" + directory->d_name, src_path+"/watermarked/" + directory->d_name)){
+					skipped += 1;
+					continue;
 				}
+				names.push_back(directory->d_name);
 			}
 	    }
+		closedir(dirp);
+	}
+
+	// Load the images in parallel, each into its own slot so that the chunks are sent out in directory order
+	ff::ParallelFor pf(n_workers);
+	std::vector<Img_save> slots(names.size());
+	auto total_start = std::chrono::high_resolution_clock::now();
+	auto start = total_start;
+	pf.parallel_for(0, names.size(), 1, 1, [&](const long i){
+		Img_save& is = slots[i];
+		is.img = nullptr;
+		is.load_path = src_path +"/" + names[i];
+		is.save_path = src_path+"/watermarked/" + names[i];
+		is.cache_key = 0;
+		if (dedupe_cache && dedupe_cache -> fetch(is.load_path, is.save_path, &is.cache_key) != CACHE_MISS)
+			return;
+
+		cimg_library::CImg<float> * img = new cimg_library::CImg<float>;
+		try{
+			img -> load(&(is.load_path)[0u]);
+			is.img = img;
+		}catch (const cimg_library::CImgIOException& e) {
+			std::cerr << "Error loading image " << is.load_path << ": " << e.what() << std::endl;	
+			delete(img);
+			if (dedupe_cache)
+				dedupe_cache -> abort(is.cache_key);
+		}
+	}, n_workers);
+	auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << "Loading stage done in " << msec << std::endl;
+
+	for (Img_save& is : slots){
+		if (!is.img)
+			continue;
+		images.push_back(is);
+
+		// Split the image into chunks
+		std::vector<img_chunk*> chunks = chunker(is.img, batch_chunks(is.img, n_chunks, batch_pixels));
+		for (unsigned int i = 0; i < chunks.size(); i++){
+			task *t = new task;
+			t -> img = is.img;
+			t -> save_path = is.save_path;
+			t -> chunk = chunks.at(i);
+			tasks.push_back(t);
+		}
 	}
-	closedir(dirp);
-	delete(directory);
 
 
+	affinity_plan plan = plan_affinity(read_topology(), pinning, n_workers, 0);
+	if (pinning != PIN_NONE)
+		std::cout << "Pinned markers: " << describe_plan(plan) << std::endl;
+	std::vector<worker_stats> marker_stats(n_workers, {0, 0});
 	std::vector<std::unique_ptr<ff::ff_node>> pipes;
 	for (int i = 0; i < n_workers; i++) {
-		pipes.push_back(ff::make_unique<Marker>(intensity));
+		pipes.push_back(ff::make_unique<Marker>(intensity, &marker_stats[i], plan.compute[i].cpu));
 	}
-	ff::ff_Pipe<task> pipe(
+	// Round robin by default, on demand with worker queues of depth work items if given
+	auto farm = ff::make_unique<ff::ff_Farm<task_batch>>(std::move(pipes));
+	if (depth > 0){
+		farm -> set_scheduling_ondemand(depth);
+		std::cout << "On-demand scheduling, marker queues of " << depth << " work items" << std::endl;
+	}
+	ff::ff_Pipe<task_batch> pipe(
 		ff::make_unique<Emitter>(src_path),
-		ff::make_unique<ff::ff_Farm<task>>(std::move(pipes))
+		std::move(farm)
 	);
-	auto start = std::chrono::high_resolution_clock::now();
+	start = std::chrono::high_resolution_clock::now();
 	pipe.run_and_wait_end();
-	auto msec    = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	msec    = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
 	std::cout << "Elapsed time is " << msec << " msecs " << std::endl;
+	std::cout << "Markers: " << workers_summary(marker_stats) << std::endl;
 
-	// Save the images
-	for (Img_save is : images){
+	// Save the images in parallel
+	start = std::chrono::high_resolution_clock::now();
+	pf.parallel_for(0, images.size(), 1, 1, [&](const long i){
+		Img_save& is = images[i];
 		try{
 			is.img -> save(&(is.save_path)[0u]);
 			processed += 1;
+			if (done_manifest)
+				done_manifest -> record(is.load_path, is.save_path);
+			if (dedupe_cache)
+				dedupe_cache -> store(is.cache_key, is.save_path);
 		}
 		catch (const std::exception& e) {
             std::cerr << "Error saving image " << is.save_path << ": " << e.what() << std::endl;
+			if (dedupe_cache)
+				dedupe_cache -> abort(is.cache_key);
         }
 		
 		delete(is.img);
-	}
+	}, n_workers);
+	msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << "Saving stage done in " << msec << std::endl;
+	msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - total_start).count();
+	std::cout << "Total time is " << msec << " msecs" << std::endl;
+
 	for (std::vector<task *>::iterator i = tasks.begin(); i != tasks.end(); ++i) {
 		delete *i;
 	}
 	std::cout << "Processed a total of " << processed << " images" << std::endl;
+	if (done_manifest){
+		std::cout << "Skipped " << skipped << " up to date images" << std::endl;
+		delete done_manifest;
+	}
+	if (dedupe_cache){
+		dedupe_cache -> report();
+		delete dedupe_cache;
+	}
+	delete prepared;
 	delete wmark;
 }
@@ -1,5 +1,7 @@
 //#define DEBUG
 #include "my_utils.h"
+#include <algorithm>
+#include <sstream>
 
 
 
@@ -30,9 +32,79 @@ bool strendswith(const char* str, const char* suffix)
     return strcmp(str, suffix) == 0;
 }
 
+// Function to hash a buffer of bytes (64 bit FNV-1a), the seed allows chaining several buffers
+uint64_t hash_bytes(const void * data, size_t len, uint64_t seed){
+	const unsigned char * bytes = (const unsigned char *) data;
+	uint64_t hash = seed;
+	for (size_t i = 0; i < len; i++){
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Function to hash the whole content of a file, returns false if the file can't be read
+bool hash_file(const std::string& path, uint64_t * hash){
+	std::FILE * file = std::fopen(&path[0u], "rb");
+	if (!file)
+		return false;
+	char buffer[1 << 16];
+	size_t n;
+	*hash = 14695981039346656037ULL;
+	while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		*hash = hash_bytes(buffer, n, *hash);
+	bool ok = !std::ferror(file);
+	std::fclose(file);
+	return ok;
+}
+
+// Function to summarize latencies (in usecs) as "(min avg p50 p99 p99.9 max (msecs)= ...)"
+std::string latency_summary(std::vector<long> usecs){
+	if (usecs.empty())
+		return "(no samples)";
+	std::sort(usecs.begin(), usecs.end());
+	long total = 0;
+	for (long usec : usecs)
+		total += usec;
+	size_t n = usecs.size();
+	std::ostringstream out;
+	out << "(min avg p50 p99 p99.9 max (msecs)= " << usecs.front()/1000.0 << " " << total/n/1000.0 << " "
+		<< usecs[n/2]/1000.0 << " " << usecs[(n*99)/100]/1000.0 << " " << usecs[(n*999)/1000]/1000.0 << " "
+		<< usecs.back()/1000.0 << ")";
+	return out.str();
+}
+
+// Function to account for a work item a worker has been serving since start
+void account_task(worker_stats * stats, std::chrono::steady_clock::time_point start){
+	stats -> tasks += 1;
+	stats -> busy_usecs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Function to summarize the load of the workers of a farm as "n workers (tasks/msecs per task)= ... imbalance ...",
+// the imbalance being the busy time of the busiest worker over the mean one (1 when perfectly balanced)
+std::string workers_summary(const std::vector<worker_stats>& workers){
+	std::ostringstream out;
+	long busiest = 0, total = 0;
+	out << workers.size() << " workers (tasks/msecs per task)=";
+	for (const worker_stats& w : workers){
+		out << " " << w.tasks << "/" << (w.tasks > 0 ? w.busy_usecs / 1000.0 / w.tasks : 0);
+		busiest = std::max(busiest, w.busy_usecs);
+		total += w.busy_usecs;
+	}
+	if (total > 0)
+		out << ", imbalance (max/mean busy)= " << (double) busiest * workers.size() / total;
+	return out.str();
+}
+
 // Function to split an image into n parts - row wise then column wise
 std::vector<img_chunk *> chunker(cimg_library::CImg<float> * img, int n){
 	std::vector<img_chunk *> chunks;
+	chunker(img, n, &chunks, nullptr);
+	return chunks;
+}
+
+// Function to split an image into n parts appended to chunks, the descriptors are taken from spare while it has any
+void chunker(cimg_library::CImg<float> * img, int n, std::vector<img_chunk *> * chunks, std::vector<img_chunk *> * spare){
 	int img_width = img -> width();
 	int img_height = img -> height();
 	int chunk_size = img_width*img_height / n;
@@ -46,7 +118,13 @@ std::vector<img_chunk *> chunker(cimg_library::CImg<float> * img, int n){
 	int curr_col = 0;
 
 	for (int i = 0; i < n; i++){
-		img_chunk *chunk = new img_chunk;
+		img_chunk *chunk;
+		if (spare && !spare -> empty()){
+			chunk = spare -> back();
+			spare -> pop_back();
+		}
+		else
+			chunk = new img_chunk;
 		int rows = chunk_size / img_width;
 		int cols = chunk_size % img_width;
 		cols = cols - 1;
@@ -83,9 +161,8 @@ std::vector<img_chunk *> chunker(cimg_library::CImg<float> * img, int n){
 		#ifdef DEBUG
 		std::cout << "Chunk " << i << " from (" << chunk -> s_row << "," << chunk -> s_col << ") to (" << chunk -> e_row << "," << chunk -> e_col << ")" << std::endl;
 		#endif
-		chunks.push_back(chunk);	
+		chunks -> push_back(chunk);	
 	}
-	return chunks;
 }
 
 // Function defining how the image pixel and the watermark one mix up
@@ -116,5 +193,11 @@ void mark_chunk(cimg_library::CImg<float> * img,  img_chunk *chunk, cimg_library
 	}
 }
 
-
-
+// Function to get the number of chunks to split an image in when batching work items of batch_pixels pixels:
+// n, but no chunk smaller than a batch so that small images go whole (n without batching, batch_pixels 0)
+int batch_chunks(cimg_library::CImg<float> * img, int n, long batch_pixels){
+	if (batch_pixels <= 0)
+		return n;
+	long pixels = (long) img -> width() * img -> height();
+	return std::max(1, (int) std::min((long) n, pixels / batch_pixels));
+}
@@ -5,6 +5,9 @@
 #include <iostream>
 #include <ctime>
 #include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <vector>
 #include <cstring>
@@ -19,11 +22,32 @@ void join_em (std::vector<std::thread> *tids);
 
 bool strendswith(const char* str, const char* suffix);
 
+// Function to hash a buffer of bytes (64 bit FNV-1a), the seed allows chaining several buffers
+uint64_t hash_bytes(const void * data, size_t len, uint64_t seed = 14695981039346656037ULL);
+
+// Function to hash the whole content of a file, returns false if the file can't be read
+bool hash_file(const std::string& path, uint64_t * hash);
+
 struct split_path{
 	std::string prefix;
 	std::string suffix;
 };
 
+// Function to summarize latencies (in usecs) as "(min avg p50 p99 p99.9 max (msecs)= ...)"
+std::string latency_summary(std::vector<long> usecs);
+
+// Data structure defining the load of a worker of a farm: work items served and time spent serving them
+struct worker_stats{
+	long tasks;
+	long busy_usecs;
+};
+
+// Function to account for a work item a worker has been serving since start
+void account_task(worker_stats * stats, std::chrono::steady_clock::time_point start);
+
+// Function to summarize the load of the workers of a farm as "n workers (tasks/msecs per task)= ... imbalance ..."
+std::string workers_summary(const std::vector<worker_stats>& workers);
+
 // Data structure defining a chunk of an image (i.e. start position and end position)
 struct img_chunk{
 	int s_row;
@@ -38,11 +62,28 @@ struct task {
 	struct img_chunk * chunk;
 	std::atomic<int> * n_chunks;
 	std::string save_path;
+	std::string load_path;
+	uint64_t cache_key;
+	std::chrono::steady_clock::time_point started;	// When the image started loading (FastFlow latency report)
 };
 
 // Function to split an image into n parts - row wise then column wise
 std::vector<img_chunk *> chunker(cimg_library::CImg<float> * img, int n);
 
+// Function to split an image into n parts appended to chunks, the descriptors are taken from spare while it has any
+void chunker(cimg_library::CImg<float> * img, int n, std::vector<img_chunk *> * chunks, std::vector<img_chunk *> * spare);
+
+// Data structure defining a batch of tasks (i.e. chunks of one or more images marked as a single work item)
+struct task_batch {
+	std::vector<task *> tasks;
+	long pixels;
+	std::vector<task *> spent;	// Tasks whose image was completed by another batch, going back to be reused (FastFlow recycling mode)
+};
+
+// Function to get the number of chunks to split an image in when batching work items of batch_pixels pixels:
+// n, but no chunk smaller than a batch so that small images go whole (n without batching, batch_pixels 0)
+int batch_chunks(cimg_library::CImg<float> * img, int n, long batch_pixels);
+
 // Function defining how the image pixel and the watermark one mix up
 int mark_pixel(int in_pix, int w_pix, float intensity);
 
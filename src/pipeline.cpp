@@ -0,0 +1,355 @@
+#include "pipeline.h"
+#include <algorithm>
+
+static const char * STAGE_NAMES[3] = {"load", "mark", "save"};
+
+mark_pipeline::mark_pipeline(prepared_wmark * wmark, float intensity, int n_loaders, int n_markers, int n_savers, int n_chunks)
+	: m_wmark(wmark), m_intensity(intensity), m_loaders(n_loaders), m_markers(n_markers), m_savers(n_savers), m_chunks(n_chunks),
+	m_manifest(nullptr), m_cache(nullptr), m_period(0), m_rebalances(0), m_move_from(-1), m_move_to(-1), m_move_samples(0),
+	m_pending(0), m_stopping(false), m_failed(0)
+{
+	int n_workers = n_loaders + n_markers + n_savers;
+	m_plan = plan_affinity(topology(), PIN_NONE, n_markers, n_loaders + n_savers);
+	m_roles = new std::atomic<int>[n_workers];
+	m_item_stage = new int[n_workers];
+	m_item_start = new std::chrono::steady_clock::time_point[n_workers];
+	for (int i = 0; i < n_workers; i++)
+		m_item_stage[i] = -1;
+	for (int s = 0; s < 3; s++){
+		m_busy[s] = 0;
+		m_completed[s] = 0;
+	}
+}
+
+mark_pipeline::~mark_pipeline(){
+	if (!m_threads.empty())
+		stop();
+	delete[](m_roles);
+	delete[](m_item_stage);
+	delete[](m_item_start);
+}
+
+void mark_pipeline::set_manifest(manifest * done_manifest){
+	m_manifest = done_manifest;
+}
+
+void mark_pipeline::set_cache(output_cache * cache){
+	m_cache = cache;
+}
+
+void mark_pipeline::set_affinity(const affinity_plan& plan){
+	m_plan = plan;
+}
+
+void mark_pipeline::set_rebalance(int period){
+	m_period = period;
+}
+
+// Start the workers, loaders first then markers and savers, and the controller if rebalancing
+void mark_pipeline::start(){
+	m_workers[ROLE_LOAD] = m_loaders;
+	m_workers[ROLE_MARK] = m_markers;
+	m_workers[ROLE_SAVE] = m_savers;
+	for (int i = 0; i < m_loaders; i++){
+		m_roles[i] = ROLE_LOAD;
+		m_threads.push_back(std::thread(&mark_pipeline::working_stage, this, i, m_plan.io[i].cpu));
+	}
+	for (int i = 0; i < m_markers; i++){
+		m_roles[m_loaders + i] = ROLE_MARK;
+		m_threads.push_back(std::thread(&mark_pipeline::working_stage, this, m_loaders + i, m_plan.compute[i].cpu));
+	}
+	for (int i = 0; i < m_savers; i++){
+		m_roles[m_loaders + m_markers + i] = ROLE_SAVE;
+		m_threads.push_back(std::thread(&mark_pipeline::working_stage, this, m_loaders + m_markers + i, m_plan.io[m_loaders + i].cpu));
+	}
+	if (m_period > 0)
+		m_controller = std::thread(&mark_pipeline::controlling_stage, this);
+}
+
+// Submit an image, ingested is the time the image has been made available
+void mark_pipeline::submit(const std::string& load_path, const std::string& save_path, ingest_time ingested){
+	pipe_image * image = new pipe_image;
+	image -> img = nullptr;
+	image -> load_path = load_path;
+	image -> save_path = save_path;
+	image -> cache_key = 0;
+	image -> ingested = ingested;
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		m_pending += 1;
+	}
+	m_load_queue.push(image);
+}
+
+// Wait for the submitted images to be saved and stop the threads
+void mark_pipeline::stop(){
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		m_drained.wait(lock, [=]{ return m_pending == 0; });
+		m_stopping = true;
+	}
+	m_drained.notify_all();
+	if (m_controller.joinable())
+		m_controller.join();
+	for (unsigned int i = 0; i < m_threads.size(); i++)
+		m_roles[i] = ROLE_STOP;
+	for (std::thread& t : m_threads)
+		t.join();
+	m_threads.clear();
+}
+
+// Print the number of processed images and the ingest to output latencies
+void mark_pipeline::report(){
+	std::unique_lock<std::mutex> lock(m_stats_mutex);
+	std::cout << "Processed a total of " << m_latencies.size() << " images (" << m_failed << " failed)" << std::endl;
+	if (!m_latencies.empty())
+		std::cout << "Ingest to output latency " << latency_summary(m_latencies) << std::endl;
+	if (m_period > 0)
+		std::cout << "Rebalanced " << m_rebalances << " times, ended with " << m_workers[ROLE_LOAD] << " loaders, "
+			<< m_workers[ROLE_MARK] << " markers, " << m_workers[ROLE_SAVE] << " savers" << std::endl;
+}
+
+// Work for the stage of the current role, an idle worker checks its role again every STAGE_TICK_MSECS
+void mark_pipeline::working_stage(int worker, int cpu){
+	if (!pin_self(cpu))
+		std::cerr << "Failed to pin worker " << worker << " to CPU " << cpu << std::endl;
+	std::chrono::milliseconds tick(STAGE_TICK_MSECS);
+	while (true){
+		int role = m_roles[worker];
+		if (role == ROLE_STOP)
+			return;
+		pipe_image * image;
+		pipe_chunk * c;
+		if (role == ROLE_LOAD){
+			if (!m_load_queue.pop_for(&image, tick))
+				continue;
+			begin_item(worker, role);
+			load(image);
+		}
+		else if (role == ROLE_MARK){
+			if (!m_mark_queue.pop_for(&c, tick))
+				continue;
+			begin_item(worker, role);
+			mark(c);
+		}
+		else{
+			if (!m_save_queue.pop_for(&image, tick))
+				continue;
+			begin_item(worker, role);
+			save(image);
+		}
+		end_item(worker);
+	}
+}
+
+// Mark a worker as working on an item of a stage from now on
+void mark_pipeline::begin_item(int worker, int role){
+	std::unique_lock<std::mutex> lock(m_busy_mutex);
+	m_item_stage[worker] = role;
+	m_item_start[worker] = std::chrono::steady_clock::now();
+}
+
+// Credit the item a worker has finished to its stage
+void mark_pipeline::end_item(int worker){
+	std::unique_lock<std::mutex> lock(m_busy_mutex);
+	int role = m_item_stage[worker];
+	m_busy[role] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_item_start[worker]).count();
+	m_completed[role] += 1;
+	m_item_stage[worker] = -1;
+}
+
+// Sample the stages every period and rebalance the workers, until the pipeline stops. The busy time of a stage
+// in a period is the growth of the time of its finished items plus the time of its items in progress, so long
+// items count in every period they run through rather than all at once in the one they finish in
+void mark_pipeline::controlling_stage(){
+	long last_busy[3] = {0, 0, 0}, last_finished[3] = {0, 0, 0}, last_completed[3] = {0, 0, 0};
+	auto last = std::chrono::steady_clock::now();
+	while (true){
+		{
+			std::unique_lock<std::mutex> lock(m_pending_mutex);
+			if (m_drained.wait_for(lock, std::chrono::milliseconds(m_period), [=]{ return m_stopping; }))
+				return;
+		}
+		auto now = std::chrono::steady_clock::now();
+		long period_usecs = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+		last = now;
+		long queued[3] = {(long) m_load_queue.size(), (long) m_mark_queue.size(), (long) m_save_queue.size()};
+		long finished[3], completed[3], running[3] = {0, 0, 0}, oldest[3] = {0, 0, 0};
+		{
+			std::unique_lock<std::mutex> lock(m_busy_mutex);
+			for (int s = 0; s < 3; s++){
+				finished[s] = m_busy[s];
+				completed[s] = m_completed[s];
+			}
+			for (int i = 0; i < m_loaders + m_markers + m_savers; i++){
+				int s = m_item_stage[i];
+				if (s < 0)
+					continue;
+				long age = std::chrono::duration_cast<std::chrono::microseconds>(now - m_item_start[i]).count();
+				running[s] += age;
+				oldest[s] = std::max(oldest[s], age);
+			}
+		}
+		long busy[3];
+		double service[3];
+		for (int s = 0; s < 3; s++){
+			busy[s] = finished[s] + running[s] - last_busy[s];
+			last_busy[s] = finished[s] + running[s];
+			// Mean time of the items finished in the period, at least as long as the oldest item in progress if
+			// none finished (0 if the stage has done nothing yet, its backlog can't be told from an idle stage)
+			long n = completed[s] - last_completed[s];
+			service[s] = n > 0 ? (double) (finished[s] - last_finished[s]) / n : oldest[s];
+			last_finished[s] = finished[s];
+			last_completed[s] = completed[s];
+		}
+		rebalance(queued, busy, service, period_usecs);
+	}
+}
+
+// Move a worker to the stage whose backlog would take longest to drain, from the stage with the lowest busy
+// share among the ones without a backlog that can spare a worker without going over REBALANCE_HEADROOM,
+// once REBALANCE_SAMPLES samples in a row have called for the same move
+void mark_pipeline::rebalance(const long * queued, const long * busy, const double * service, long period_usecs){
+	double share[3], drain[3];
+	for (int s = 0; s < 3; s++){
+		share[s] = std::min(1.0, std::max(0.0, (double) busy[s] / ((double) m_workers[s] * period_usecs)));
+		drain[s] = queued[s] * service[s] / m_workers[s];
+	}
+	int to = 0, from = -1;
+	for (int s = 1; s < 3; s++)
+		if (drain[s] > drain[to])
+			to = s;
+	if (drain[to] <= period_usecs){
+		m_move_samples = 0;
+		return;
+	}
+	for (int s = 0; s < 3; s++)
+		if (s != to && m_workers[s] > 1 && drain[s] <= period_usecs &&
+			share[s] * m_workers[s] / (m_workers[s] - 1) < REBALANCE_HEADROOM && (from == -1 || share[s] < share[from]))
+			from = s;
+	if (from == -1){
+		m_move_samples = 0;
+		return;
+	}
+	if (from != m_move_from || to != m_move_to){
+		m_move_from = from;
+		m_move_to = to;
+		m_move_samples = 0;
+	}
+	if (++m_move_samples < REBALANCE_SAMPLES)
+		return;
+	m_move_samples = 0;
+
+	// The worker finishes the item at hand, then works for the new stage
+	for (int i = m_loaders + m_markers + m_savers - 1; i >= 0; i--)
+		if (m_roles[i] == from){
+			m_roles[i] = to;
+			break;
+		}
+	m_workers[from] -= 1;
+	m_workers[to] += 1;
+	m_rebalances += 1;
+	std::cout << "Rebalance: worker moved from " << STAGE_NAMES[from] << " to " << STAGE_NAMES[to] << ", now "
+		<< m_workers[ROLE_LOAD] << " loaders " << m_workers[ROLE_MARK] << " markers " << m_workers[ROLE_SAVE] << " savers"
+		<< " (queued " << queued[0] << " " << queued[1] << " " << queued[2]
+		<< ", busy " << (int) (share[0] * 100) << "% " << (int) (share[1] * 100) << "% " << (int) (share[2] * 100) << "%"
+		<< ", drain " << (long) drain[0] / 1000 << " " << (long) drain[1] / 1000 << " " << (long) drain[2] / 1000 << " msecs)" << std::endl;
+}
+
+// Load an image, split it into chunks and hand them over to the markers
+void mark_pipeline::load(pipe_image * image){
+	if (m_manifest && m_manifest -> up_to_date(image -> load_path, image -> save_path)){
+		delete(image);
+		finished();
+		return;
+	}
+	if (m_cache){
+		cache_result cached = m_cache -> fetch(image -> load_path, image -> save_path, &image -> cache_key, image);
+		if (cached == CACHE_HIT){
+			done(image, true);
+			return;
+		}
+		// Handed back by the store() or abort() of the identical image, once its output exists
+		if (cached == CACHE_PENDING)
+			return;
+	}
+	image -> img = new cimg_library::CImg<float>;
+	try{
+		image -> img -> load(&(image -> load_path)[0u]);
+	}catch (const cimg_library::CImgIOException& e) {
+		std::cerr << "Error reading image " << image -> load_path << ": " << e.what() << std::endl;
+		std::vector<cache_waiter> released;
+		if (m_cache)
+			m_cache -> abort(image -> cache_key, &released);
+		done(image, false);
+		done_waiters(released);
+		return;
+	}
+	std::vector<img_chunk*> chunks = chunker(image -> img, m_chunks);
+	image -> pending_chunks = chunks.size();
+	for (img_chunk * chunk : chunks){
+		pipe_chunk * c = new pipe_chunk;
+		c -> image = image;
+		c -> chunk = chunk;
+		m_mark_queue.push(c);
+	}
+}
+
+// Mark a chunk, the marker that completes an image hands it over to the savers
+void mark_pipeline::mark(pipe_chunk * c){
+	mark_chunk(c -> image -> img, c -> chunk, m_wmark, m_intensity);
+	if (c -> image -> pending_chunks.fetch_sub(1) == 1)
+		m_save_queue.push(c -> image);
+	delete(c -> chunk);
+	delete(c);
+}
+
+// Save a marked image
+void mark_pipeline::save(pipe_image * image){
+	bool saved = false;
+	std::vector<cache_waiter> released;
+	try{
+		image -> img -> save(&(image -> save_path)[0u]);
+		saved = true;
+		if (m_manifest)
+			m_manifest -> record(image -> load_path, image -> save_path);
+		if (m_cache)
+			m_cache -> store(image -> cache_key, image -> save_path, &released);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error saving image " << image -> save_path << ": " << e.what() << std::endl;
+		if (m_cache)
+			m_cache -> abort(image -> cache_key, &released);
+	}
+	done(image, saved);
+	done_waiters(released);
+}
+
+// Account for an image leaving the pipeline
+void mark_pipeline::done(pipe_image * image, bool saved){
+	if (saved){
+		long usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - image -> ingested).count();
+		std::unique_lock<std::mutex> lock(m_stats_mutex);
+		m_latencies.push_back(usec);
+		std::cout << image -> save_path << " ready " << usec/1000.0 << " msecs after ingest" << std::endl;
+	}
+	else
+		m_failed += 1;
+	delete(image -> img);
+	delete(image);
+	finished();
+}
+
+// Account for the identical images that waited on a cached key, their outputs have been copied (or not)
+void mark_pipeline::done_waiters(const std::vector<cache_waiter>& released){
+	for (const cache_waiter& w : released)
+		done((pipe_image *) w.context, w.copied);
+}
+
+// Account for an image out of the pipeline, saved or not
+void mark_pipeline::finished(){
+	std::unique_lock<std::mutex> lock(m_pending_mutex);
+	m_pending -= 1;
+	if (m_pending == 0)
+		m_drained.notify_all();
+}
@@ -0,0 +1,131 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <chrono>
+#include <mutex>
+#include "queue.h"
+#include "my_utils.h"
+#include "manifest.h"
+#include "cache.h"
+#include "wmark.h"
+#include "topology.h"
+
+/***
+	Streaming load-mark-save pipeline built on std::threads and queue<T>.
+	Unlike watermarker.cpp, where the stages run one after the other, the three stages run concurrently and
+	the threads stay up between images, so images can be submitted at any time to a warm pipeline
+	(watermark already loaded, threads already running). The time from ingest to saved output is tracked per image.
+	The threads are a shared pool, each one working for a stage (role) that can change while running: with
+	rebalancing on, a controller samples every period the occupancy of the queues and the busy time and
+	throughput of each stage (counting the time of the items still in progress), and moves one worker to the
+	stage whose backlog would take longest to drain from a stage that can spare it, once the same move has
+	been called for by REBALANCE_SAMPLES samples in a row, keeping the total number of workers (the core
+	budget) unchanged.
+***/
+
+typedef std::chrono::steady_clock::time_point ingest_time;
+
+#define STAGE_TICK_MSECS 20		// Longest wait of an idle worker before checking its role again
+#define REBALANCE_HEADROOM 0.9	// Busy share the workers left in the donor stage must stay under
+#define REBALANCE_SAMPLES 2		// Consecutive samples calling for the same move before it is made
+
+// Roles of the workers of the pool
+enum stage_role {ROLE_LOAD, ROLE_MARK, ROLE_SAVE, ROLE_STOP};
+
+// Data structure defining an image going through the pipeline
+struct pipe_image{
+	cimg_library::CImg<float> * img;
+	std::string load_path;
+	std::string save_path;
+	uint64_t cache_key;
+	std::atomic<int> pending_chunks;
+	ingest_time ingested;
+};
+
+// Data structure defining a chunk of an image to be marked
+struct pipe_chunk{
+	pipe_image * image;
+	img_chunk * chunk;
+};
+
+class mark_pipeline{
+public:
+	mark_pipeline(prepared_wmark * wmark, float intensity, int n_loaders, int n_markers, int n_savers, int n_chunks);
+	~mark_pipeline();
+
+	// Optional manifest and dedupe cache, to be set before start()
+	void set_manifest(manifest * done_manifest);
+	void set_cache(output_cache * cache);
+
+	// Optional placement of the threads, compute for the markers and io for the loaders then the savers, to be set before start().
+	// A thread keeps its CPU when moved to another stage
+	void set_affinity(const affinity_plan& plan);
+
+	// Optional rebalancing of the workers between the stages every period msecs, to be set before start()
+	void set_rebalance(int period);
+
+	// Start the threads of the three stages
+	void start();
+
+	// Submit an image, ingested is the time the image has been made available
+	void submit(const std::string& load_path, const std::string& save_path, ingest_time ingested);
+
+	// Wait for the submitted images to be saved and stop the threads
+	void stop();
+
+	// Print the number of processed images and the ingest to output latencies
+	void report();
+
+private:
+	prepared_wmark * m_wmark;
+	float m_intensity;
+	int m_loaders, m_markers, m_savers, m_chunks;
+	manifest * m_manifest;
+	output_cache * m_cache;
+	affinity_plan m_plan;
+	std::vector<std::thread> m_threads;
+
+	// Workers and their roles, the controller is the only one changing them after start()
+	std::atomic<int> * m_roles;
+	int m_workers[3];
+	int m_period;
+	std::thread m_controller;
+	int m_rebalances;
+	int m_move_from, m_move_to, m_move_samples;	// Move called for by the last samples, and how many in a row
+
+	// Images submitted and not out yet, stop() waits for them to drain
+	std::mutex m_pending_mutex;
+	std::condition_variable m_drained;
+	long m_pending;
+	bool m_stopping;
+
+	// Usecs spent on the finished items and items finished by each stage, and the item each worker is on
+	// (its stage and start, -1 if idle), sampled together by the controller under m_busy_mutex
+	std::mutex m_busy_mutex;
+	long m_busy[3];
+	long m_completed[3];
+	int * m_item_stage;
+	std::chrono::steady_clock::time_point * m_item_start;
+
+	queue<pipe_image *> m_load_queue;
+	queue<pipe_chunk *> m_mark_queue;
+	queue<pipe_image *> m_save_queue;
+
+	std::mutex m_stats_mutex;
+	std::vector<long> m_latencies;	// usecs from ingest to saved output
+	std::atomic<int> m_failed;
+
+	void working_stage(int worker, int cpu);
+	void begin_item(int worker, int role);
+	void end_item(int worker);
+	void controlling_stage();
+	void rebalance(const long * queued, const long * busy, const double * service, long period_usecs);
+	void load(pipe_image * image);
+	void mark(pipe_chunk * c);
+	void save(pipe_image * image);
+	void done(pipe_image * image, bool saved);
+	void done_waiters(const std::vector<cache_waiter>& released);
+	void finished();
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "pool.h"
+
+mark_pool::mark_pool(prepared_wmark * wmark, int n_markers, int n_chunks, int batch_size, int batch_usecs)
+	: m_wmark(wmark), m_chunks(n_chunks), m_batch_size(batch_size), m_batch_window(batch_usecs), m_closing(false), m_batches(0), m_images(0)
+{
+	for (int i = 0; i < n_markers; i++)
+		m_markers.push_back(std::thread(&mark_pool::marking_stage, this));
+	m_dispatcher = std::thread(&mark_pool::dispatching_stage, this);
+}
+
+mark_pool::~mark_pool(){
+	{
+		std::unique_lock<std::mutex> lock(m_batch_mutex);
+		m_closing = true;
+	}
+	m_batch_cond.notify_all();
+	m_dispatcher.join();
+	for (unsigned int i = 0; i < m_markers.size(); i++)
+		m_queue.push(EOS);
+	join_em(&m_markers);
+}
+
+// Mark an image, blocking until all of its chunks have been marked
+void mark_pool::mark(cimg_library::CImg<float> * img, float intensity){
+	pool_job job;
+	job.img = img;
+	job.intensity = intensity;
+	job.done = false;
+	{
+		std::unique_lock<std::mutex> lock(m_batch_mutex);
+		m_batch.push_back(&job);
+	}
+	// The dispatcher waits for the first image of a batch, then for a full batch or the end of the window
+	m_batch_cond.notify_all();
+	std::unique_lock<std::mutex> lock(job.mutex);
+	job.marked.wait(lock, [&]{ return job.done; });
+}
+
+long mark_pool::batches(){
+	return m_batches;
+}
+
+long mark_pool::images(){
+	return m_images;
+}
+
+// Collect the images of a batch and push all of their chunks at once
+void mark_pool::dispatching_stage(){
+	std::vector<pool_job *> batch;
+	std::vector<pool_chunk *> chunks;
+	while (true){
+		{
+			std::unique_lock<std::mutex> lock(m_batch_mutex);
+			m_batch_cond.wait(lock, [&]{ return m_closing || !m_batch.empty(); });
+			if (m_batch.empty())
+				return;
+			// Give the other requests a chance to join the batch
+			m_batch_cond.wait_for(lock, m_batch_window, [&]{ return m_closing || (int) m_batch.size() >= m_batch_size; });
+			batch.swap(m_batch);
+		}
+		for (pool_job * job : batch){
+			std::vector<img_chunk *> img_chunks = chunker(job -> img, m_chunks);
+			job -> pending_chunks = img_chunks.size();
+			for (img_chunk * chunk : img_chunks){
+				pool_chunk * c = new pool_chunk;
+				c -> job = job;
+				c -> chunk = chunk;
+				chunks.push_back(c);
+			}
+		}
+		m_queue.push_all(chunks);
+		m_batches += 1;
+		m_images += batch.size();
+		chunks.clear();
+		batch.clear();
+	}
+}
+
+// Mark the chunks, the marker that completes an image wakes up its caller
+void mark_pool::marking_stage(){
+	while (true){
+		pool_chunk * c = m_queue.pop();
+		if (c == EOS)
+			return;
+		pool_job * job = c -> job;
+		mark_chunk(job -> img, c -> chunk, m_wmark, job -> intensity);
+		delete(c -> chunk);
+		delete(c);
+		if (job -> pending_chunks.fetch_sub(1) == 1){
+			std::unique_lock<std::mutex> lock(job -> mutex);
+			job -> done = true;
+			job -> marked.notify_one();
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <condition_variable>
+#include "queue.h"
+#include "my_utils.h"
+#include "wmark.h"
+
+/***
+	Warm pool of marking threads shared by concurrent callers (e.g. the requests of servewatermarker).
+	The images handed to mark() are batched: a dispatcher waits up to a small window for more images
+	and pushes the chunks of the whole batch into the marking queue at once.
+***/
+
+// Data structure defining an image waiting to be marked by the pool
+struct pool_job{
+	cimg_library::CImg<float> * img;
+	float intensity;
+	std::atomic<int> pending_chunks;
+	std::mutex mutex;
+	std::condition_variable marked;
+	bool done;
+};
+
+// Data structure defining a chunk of an image to be marked by the pool
+struct pool_chunk{
+	pool_job * job;
+	img_chunk * chunk;
+};
+
+class mark_pool{
+public:
+	mark_pool(prepared_wmark * wmark, int n_markers, int n_chunks, int batch_size, int batch_usecs);
+	~mark_pool();
+
+	// Mark an image, blocking until all of its chunks have been marked
+	void mark(cimg_library::CImg<float> * img, float intensity);
+
+	// Number of batches dispatched and images marked so far
+	long batches();
+	long images();
+
+private:
+	prepared_wmark * m_wmark;
+	int m_chunks, m_batch_size;
+	std::chrono::microseconds m_batch_window;
+	queue<pool_chunk *> m_queue;
+	std::vector<std::thread> m_markers;
+	std::thread m_dispatcher;
+
+	std::mutex m_batch_mutex;
+	std::condition_variable m_batch_cond;
+	std::vector<pool_job *> m_batch;
+	bool m_closing;
+	std::atomic<long> m_batches, m_images;
+
+	void dispatching_stage();
+	void marking_stage();
+};
+
+#endif
@@ -2,8 +2,10 @@
 #define __QUEUE_H__
 
 #include <deque>
+#include <vector>
 #include <mutex>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 
 #define EOS nullptr
@@ -25,6 +27,44 @@ public:
 	this->d_condition.notify_one();
   }
   
+  void push_all(std::vector<T> const& values) {
+	{
+		std::unique_lock<std::mutex> lock(this->d_mutex);
+		for (T const& value : values)
+			d_queue.push_front(value);
+	}
+	this->d_condition.notify_all();
+  }
+
+  // Pop waiting at most timeout, returns false if nothing arrived
+  template <typename Rep, typename Period>
+  bool pop_for(T * value, std::chrono::duration<Rep, Period> timeout) {
+	std::unique_lock<std::mutex> lock(this->d_mutex);
+	if (!this->d_condition.wait_for(lock, timeout, [=]{ return !this->d_queue.empty(); }))
+		return false;
+	*value = std::move(this->d_queue.back());
+	this->d_queue.pop_back();
+	return true;
+  }
+
+  // Pop up to max values with a single lock, waiting for the first one. Stops after an EOS, so that each
+  // consumer still gets its own
+  void pop_many(std::vector<T> * values, size_t max) {
+	std::unique_lock<std::mutex> lock(this->d_mutex);
+	this->d_condition.wait(lock, [=]{ return !this->d_queue.empty(); });
+	while (!d_queue.empty() && values->size() < max){
+		values->push_back(std::move(this->d_queue.back()));
+		this->d_queue.pop_back();
+		if (values->back() == EOS)
+			break;
+	}
+  }
+
+  size_t size() {
+	std::unique_lock<std::mutex> lock(this->d_mutex);
+	return d_queue.size();
+  }
+
   T pop() {
 	std::unique_lock<std::mutex> lock(this->d_mutex);
 	this->d_condition.wait(lock, [=]{ return !this->d_queue.empty(); });
@@ -0,0 +1,351 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "region.h"
+#include "codec.h"
+#include "my_utils.h"
+
+// Function to parse a placement: tl, tr, bl, br, c or <x>,<y>, returns false if the spec is not valid
+bool parse_placement(const char * spec, placement * p){
+	std::string s(spec);
+	p -> x = 0;
+	p -> y = 0;
+	if (s == "tl")
+		p -> mode = PLACE_TOP_LEFT;
+	else if (s == "tr")
+		p -> mode = PLACE_TOP_RIGHT;
+	else if (s == "bl")
+		p -> mode = PLACE_BOTTOM_LEFT;
+	else if (s == "br")
+		p -> mode = PLACE_BOTTOM_RIGHT;
+	else if (s == "c")
+		p -> mode = PLACE_CENTER;
+	else{
+		char * end;
+		p -> x = strtol(spec, &end, 10);
+		if (end == spec || *end != ',')
+			return false;
+		const char * y_spec = end + 1;
+		p -> y = strtol(y_spec, &end, 10);
+		if (end == y_spec || *end != '\0' || p -> x < 0 || p -> y < 0)
+			return false;
+		p -> mode = PLACE_OFFSET;
+	}
+	return true;
+}
+
+// Function to get a key of the placement, to be mixed in the fingerprints of the manifest and of the cache
+uint64_t placement_key(const placement& p){
+	if (p.mode == PLACE_TILE)
+		return 0;
+	int fields[3] = {p.mode, p.x, p.y};
+	return hash_bytes(fields, sizeof(fields));
+}
+
+// Function to get the variant of the manifest and of the cache: the placement and, for a tiled watermark, the blend engine
+uint64_t variant_key(const placement& p, blend_engine blend){
+	// A placed watermark always goes through the DCT domain marking, the plain CImg blend keeps the keys it always had
+	if (p.mode != PLACE_TILE || blend == BLEND_CIMG)
+		return placement_key(p);
+	int engine = blend;
+	return hash_bytes(&engine, sizeof(engine));
+}
+
+// Function to get the top left corner of the watermark in an image of the given size
+void place_watermark(const placement& p, int img_width, int img_height, int wm_width, int wm_height, int * x, int * y){
+	switch (p.mode){
+		case PLACE_TOP_RIGHT:
+			*x = img_width - wm_width;
+			*y = 0;
+			break;
+		case PLACE_BOTTOM_LEFT:
+			*x = 0;
+			*y = img_height - wm_height;
+			break;
+		case PLACE_BOTTOM_RIGHT:
+			*x = img_width - wm_width;
+			*y = img_height - wm_height;
+			break;
+		case PLACE_CENTER:
+			*x = (img_width - wm_width) / 2;
+			*y = (img_height - wm_height) / 2;
+			break;
+		case PLACE_OFFSET:
+			*x = p.x;
+			*y = p.y;
+			break;
+		default:
+			*x = 0;
+			*y = 0;
+	}
+}
+
+// Function to mark a decoded image with a single watermark at the given position
+void mark_region(cimg_library::CImg<float> * img, cimg_library::CImg<float> * wmark, float intensity, int x, int y){
+	int s_row = std::max(y, 0), e_row = std::min(y + wmark -> height(), img -> height());
+	int s_col = std::max(x, 0), e_col = std::min(x + wmark -> width(), img -> width());
+	bool has_3_chan = (*img).spectrum() == 3 && (*wmark).spectrum() >= 3;
+	bool has_alpha = has_3_chan && (*wmark).spectrum() == 4;
+	for (int row = s_row; row < e_row; row++)
+		for (int col = s_col; col < e_col; col++){
+			int wx = col - x, wy = row - y;
+			if (!has_3_chan || (has_alpha ? (*wmark)(wx,wy,0,3) > 0 : (*wmark)(wx,wy,0,0) + (*wmark)(wx,wy,0,1) + (*wmark)(wx,wy,0,2) < 500)){
+				float weight = has_alpha ? intensity * (*wmark)(wx,wy,0,3) / 255 : intensity;
+				(*img)(col,row,0,0) = mark_pixel((*img)(col,row,0,0), (*wmark)(wx,wy,0,0), weight);
+				if (has_3_chan){
+					(*img)(col,row,0,1) = mark_pixel((*img)(col,row,0,1), (*wmark)(wx,wy,0,1), weight);
+					(*img)(col,row,0,2) = mark_pixel((*img)(col,row,0,2), (*wmark)(wx,wy,0,2), weight);
+				}
+			}
+		}
+}
+
+// Orthonormal 8x8 DCT basis, dct_cos[x][u] = C(u)/2 * cos((2x+1)u*pi/16)
+static float dct_cos[8][8];
+
+static bool init_dct(){
+	for (int x = 0; x < 8; x++)
+		for (int u = 0; u < 8; u++)
+			dct_cos[x][u] = (u == 0 ? std::sqrt(0.5) : 1.0) / 2 * std::cos((2 * x + 1) * u * M_PI / 16);
+	return true;
+}
+
+static const bool dct_ready = init_dct();
+
+// Function to dequantize and inverse transform a block into 8x8 samples of a plane
+static void idct_block(const JCOEF * coef, const UINT16 * quant, float * out, int stride){
+	float tmp[8][8];
+	for (int v = 0; v < 8; v++)
+		for (int x = 0; x < 8; x++){
+			float sum = 0;
+			for (int u = 0; u < 8; u++)
+				sum += dct_cos[x][u] * coef[v * 8 + u] * quant[v * 8 + u];
+			tmp[v][x] = sum;
+		}
+	for (int y = 0; y < 8; y++)
+		for (int x = 0; x < 8; x++){
+			float sum = 0;
+			for (int v = 0; v < 8; v++)
+				sum += dct_cos[y][v] * tmp[v][x];
+			out[y * stride + x] = sum + 128;
+		}
+}
+
+// Function to transform and quantize 8x8 samples of a plane into a block
+static void fdct_block(const float * in, int stride, const UINT16 * quant, JCOEF * coef){
+	float tmp[8][8];
+	for (int y = 0; y < 8; y++)
+		for (int u = 0; u < 8; u++){
+			float sum = 0;
+			for (int x = 0; x < 8; x++)
+				sum += dct_cos[x][u] * (in[y * stride + x] - 128);
+			tmp[y][u] = sum;
+		}
+	for (int v = 0; v < 8; v++)
+		for (int u = 0; u < 8; u++){
+			float sum = 0;
+			for (int y = 0; y < 8; y++)
+				sum += dct_cos[y][v] * tmp[y][u];
+			coef[v * 8 + u] = (JCOEF) std::lround(sum / quant[v * 8 + u]);
+		}
+}
+
+static inline int clamp_pixel(float value){
+	return value < 0 ? 0 : (value > 255 ? 255 : (int) (value + 0.5f));
+}
+
+// Function to mark a JPEG image held in memory re-encoding only the MCUs under the watermark
+void mark_region_jpeg(const unsigned char * data, size_t size, cimg_library::CImg<float> * wmark, float intensity,
+	const placement& p, std::vector<unsigned char> * out){
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	codec_error_mgr jerr;
+	src.err = jpeg_std_error(&jerr.original);
+	dst.err = src.err;
+	jerr.original.error_exit = codec_error_exit;
+	unsigned char * buffer = nullptr;
+	unsigned long out_size = 0;
+	float * volatile planes[MAX_COMPONENTS] = {};
+	float * volatile deltas[MAX_COMPONENTS] = {};
+	unsigned char * volatile dirty[MAX_COMPONENTS] = {};
+	volatile bool compressing = false;
+	if (setjmp(jerr.setjmp_buffer)){
+		if (compressing)
+			jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(buffer);
+		for (int c = 0; c < MAX_COMPONENTS; c++){
+			delete[] planes[c];
+			delete[] deltas[c];
+			delete[] dirty[c];
+		}
+		throw cimg_library::CImgIOException("mark_region_jpeg(): %s", jerr.message);
+	}
+	jpeg_create_decompress(&src);
+	jpeg_mem_src(&src, (unsigned char *) data, size);
+	jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+	for (int m = 0; m < 16; m++)
+		jpeg_save_markers(&src, JPEG_APP0 + m, 0xFFFF);
+	jpeg_read_header(&src, TRUE);
+
+	// Only 8 bit YCbCr and grayscale images are marked in the DCT domain, the others are decoded
+	int channels = src.num_components;
+	bool supported = src.data_precision == 8 && ((src.jpeg_color_space == JCS_YCbCr && channels == 3) ||
+		(src.jpeg_color_space == JCS_GRAYSCALE && channels == 1));
+	for (int c = 0; c < channels && supported; c++)
+		supported = src.max_h_samp_factor % src.comp_info[c].h_samp_factor == 0 &&
+			src.max_v_samp_factor % src.comp_info[c].v_samp_factor == 0;
+	if (!supported){
+		jpeg_destroy_decompress(&src);
+		cimg_library::CImg<float> img;
+		decode_jpeg(data, size, &img);
+		int x, y;
+		place_watermark(p, img.width(), img.height(), wmark -> width(), wmark -> height(), &x, &y);
+		mark_region(&img, wmark, intensity, x, y);
+		encode_jpeg(img, out);
+		return;
+	}
+
+	jvirt_barray_ptr * coefs = jpeg_read_coefficients(&src);
+	int width = src.image_width, height = src.image_height, x, y;
+	place_watermark(p, width, height, wmark -> width(), wmark -> height(), &x, &y);
+	int s_col = std::max(x, 0), e_col = std::min(x + wmark -> width(), width);
+	int s_row = std::max(y, 0), e_row = std::min(y + wmark -> height(), height);
+
+	if (s_col < e_col && s_row < e_row){
+		// Area covered by the MCUs under the watermark, every component has whole blocks in it
+		int mcu_width = 8 * src.max_h_samp_factor, mcu_height = 8 * src.max_v_samp_factor;
+		int a_col = s_col / mcu_width * mcu_width, a_row = s_row / mcu_height * mcu_height;
+		int a_width = (e_col + mcu_width - 1) / mcu_width * mcu_width - a_col;
+		int a_height = (e_row + mcu_height - 1) / mcu_height * mcu_height - a_row;
+		int fx[MAX_COMPONENTS], fy[MAX_COMPONENTS], pw[MAX_COMPONENTS], ph[MAX_COMPONENTS];
+
+		// Bring the blocks back to samples, one plane per component at its own resolution
+		for (int c = 0; c < channels; c++){
+			jpeg_component_info * comp = &src.comp_info[c];
+			fx[c] = src.max_h_samp_factor / comp -> h_samp_factor;
+			fy[c] = src.max_v_samp_factor / comp -> v_samp_factor;
+			pw[c] = a_width / fx[c];
+			ph[c] = a_height / fy[c];
+			planes[c] = new float[pw[c] * ph[c]];
+			deltas[c] = new float[pw[c] * ph[c]]();
+			dirty[c] = new unsigned char[pw[c] / 8 * ph[c] / 8]();
+			int bx0 = a_col / fx[c] / 8, by0 = a_row / fy[c] / 8;
+			for (int by = 0; by < ph[c] / 8; by++){
+				JBLOCKARRAY blocks = (*src.mem -> access_virt_barray)((j_common_ptr) &src, coefs[c], by0 + by, 1, FALSE);
+				for (int bx = 0; bx < pw[c] / 8; bx++)
+					idct_block(blocks[0][bx0 + bx], comp -> quant_table -> quantval, planes[c] + by * 8 * pw[c] + bx * 8, pw[c]);
+			}
+		}
+
+		// Mark the pixels as mark_chunk does, subsampled components get the average of the changes
+		bool has_3_chan = channels == 3 && wmark -> spectrum() >= 3;
+		bool has_alpha = has_3_chan && wmark -> spectrum() == 4;
+		for (int row = s_row; row < e_row; row++)
+			for (int col = s_col; col < e_col; col++){
+				int wx = col - x, wy = row - y;
+				if (has_alpha ? (*wmark)(wx,wy,0,3) <= 0 : has_3_chan && (*wmark)(wx,wy,0,0) + (*wmark)(wx,wy,0,1) + (*wmark)(wx,wy,0,2) >= 500)
+					continue;
+				float weight = has_alpha ? intensity * (*wmark)(wx,wy,0,3) / 255 : intensity;
+				int idx[MAX_COMPONENTS];
+				for (int c = 0; c < channels; c++)
+					idx[c] = (row - a_row) / fy[c] * pw[c] + (col - a_col) / fx[c];
+				float ycc[3] = {planes[0][idx[0]], 0, 0}, marked[3];
+				int pix[3], in_pix[3];
+				if (channels == 3){
+					ycc[1] = planes[1][idx[1]] - 128;
+					ycc[2] = planes[2][idx[2]] - 128;
+					pix[0] = clamp_pixel(ycc[0] + 1.402f * ycc[2]);
+					pix[1] = clamp_pixel(ycc[0] - 0.344136f * ycc[1] - 0.714136f * ycc[2]);
+					pix[2] = clamp_pixel(ycc[0] + 1.772f * ycc[1]);
+				}
+				else
+					pix[0] = clamp_pixel(ycc[0]);
+				std::copy(pix, pix + 3, in_pix);
+				pix[0] = mark_pixel(pix[0], (*wmark)(wx,wy,0,0), weight);
+				if (has_3_chan){
+					pix[1] = mark_pixel(pix[1], (*wmark)(wx,wy,0,1), weight);
+					pix[2] = mark_pixel(pix[2], (*wmark)(wx,wy,0,2), weight);
+				}
+				if (std::equal(pix, pix + channels, in_pix))
+					continue;
+				if (channels == 3){
+					marked[0] = 0.299f * pix[0] + 0.587f * pix[1] + 0.114f * pix[2];
+					marked[1] = -0.168736f * pix[0] - 0.331264f * pix[1] + 0.5f * pix[2] + 128;
+					marked[2] = 0.5f * pix[0] - 0.418688f * pix[1] - 0.081312f * pix[2] + 128;
+				}
+				else
+					marked[0] = pix[0];
+				for (int c = 0; c < channels; c++){
+					deltas[c][idx[c]] += (marked[c] - planes[c][idx[c]]) / (fx[c] * fy[c]);
+					dirty[c][(row - a_row) / fy[c] / 8 * (pw[c] / 8) + (col - a_col) / fx[c] / 8] = 1;
+				}
+			}
+
+		// Quantize again the blocks that changed, the others keep their original coefficients
+		for (int c = 0; c < channels; c++){
+			jpeg_component_info * comp = &src.comp_info[c];
+			int bx0 = a_col / fx[c] / 8, by0 = a_row / fy[c] / 8;
+			for (int i = 0; i < pw[c] * ph[c]; i++)
+				planes[c][i] += deltas[c][i];
+			for (int by = 0; by < ph[c] / 8; by++){
+				JBLOCKARRAY blocks = (*src.mem -> access_virt_barray)((j_common_ptr) &src, coefs[c], by0 + by, 1, TRUE);
+				for (int bx = 0; bx < pw[c] / 8; bx++)
+					if (dirty[c][by * (pw[c] / 8) + bx])
+						fdct_block(planes[c] + by * 8 * pw[c] + bx * 8, pw[c], comp -> quant_table -> quantval, blocks[0][bx0 + bx]);
+			}
+			delete[] planes[c];
+			delete[] deltas[c];
+			delete[] dirty[c];
+			planes[c] = nullptr;
+			deltas[c] = nullptr;
+			dirty[c] = nullptr;
+		}
+	}
+
+	// Write the coefficients back, with the markers of the original image
+	jpeg_create_compress(&dst);
+	compressing = true;
+	jpeg_mem_dest(&dst, &buffer, &out_size);
+	jpeg_copy_critical_parameters(&src, &dst);
+	if (src.progressive_mode)
+		jpeg_simple_progression(&dst);
+	jpeg_write_coefficients(&dst, coefs);
+	for (jpeg_saved_marker_ptr marker = src.marker_list; marker; marker = marker -> next){
+		if (dst.write_JFIF_header && marker -> marker == JPEG_APP0 && marker -> data_length >= 5 &&
+			std::memcmp(marker -> data, "JFIF", 5) == 0)
+			continue;
+		if (dst.write_Adobe_marker && marker -> marker == JPEG_APP0 + 14 && marker -> data_length >= 5 &&
+			std::memcmp(marker -> data, "Adobe", 5) == 0)
+			continue;
+		jpeg_write_marker(&dst, marker -> marker, marker -> data, marker -> data_length);
+	}
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	compressing = false;
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	out -> assign(buffer, buffer + out_size);
+	free(buffer);
+}
+
+// Function to mark a JPEG file into another with mark_region_jpeg, throws CImgIOException on errors
+void mark_region_file(const std::string& load_path, const std::string& save_path, cimg_library::CImg<float> * wmark,
+	float intensity, const placement& p){
+	std::vector<unsigned char> data, marked;
+	std::FILE * file = std::fopen(&load_path[0u], "rb");
+	if (!file)
+		throw cimg_library::CImgIOException("mark_region_file(): Failed to open file '%s' for reading.", load_path.c_str());
+	unsigned char buffer[1 << 16];
+	size_t n;
+	while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	std::fclose(file);
+	mark_region_jpeg(data.data(), data.size(), wmark, intensity, p, &marked);
+	file = std::fopen(&save_path[0u], "wb");
+	if (!file)
+		throw cimg_library::CImgIOException("mark_region_file(): Failed to open file '%s' for writing.", save_path.c_str());
+	bool written = std::fwrite(marked.data(), 1, marked.size(), file) == marked.size();
+	if (std::fclose(file) != 0 || !written)
+		throw cimg_library::CImgIOException("mark_region_file(): Failed to write file '%s'.", save_path.c_str());
+}
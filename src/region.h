@@ -0,0 +1,53 @@
+#ifndef __REGION_H__
+#define __REGION_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "CImg.h"
+
+/***
+	Region-restricted watermarking: instead of tiling the watermark over the whole image (mark_chunk),
+	a single copy is placed in a corner, in the centre or at a given offset.
+	JPEG images are marked in the DCT domain: the coefficients are read without decoding the image, only the
+	MCUs intersecting the watermark are brought back to pixels, marked and quantized again, every other block
+	is copied as it is. Untouched regions keep their original quality and the cost of marking depends on the
+	size of the watermark rather than on the size of the photo.
+***/
+
+enum placement_mode { PLACE_TILE, PLACE_TOP_LEFT, PLACE_TOP_RIGHT, PLACE_BOTTOM_LEFT, PLACE_BOTTOM_RIGHT, PLACE_CENTER, PLACE_OFFSET };
+
+// Engines a tiled watermark is blended with, their outputs differ in the last bits
+enum blend_engine { BLEND_CIMG, BLEND_FUSED, BLEND_FIXED, BLEND_YCC, BLEND_BANDED, BLEND_BANDED_FIXED };
+
+// Data structure defining where the watermark goes (x and y only for PLACE_OFFSET)
+struct placement{
+	placement_mode mode;
+	int x;
+	int y;
+};
+
+// Function to parse a placement: tl, tr, bl, br, c or <x>,<y>, returns false if the spec is not valid
+bool parse_placement(const char * spec, placement * p);
+
+// Function to get a key of the placement, to be mixed in the fingerprints of the manifest and of the cache
+uint64_t placement_key(const placement& p);
+
+// Function to get the variant of the manifest and of the cache: the placement and, for a tiled watermark, the blend engine
+uint64_t variant_key(const placement& p, blend_engine blend);
+
+// Function to get the top left corner of the watermark in an image of the given size
+void place_watermark(const placement& p, int img_width, int img_height, int wm_width, int wm_height, int * x, int * y);
+
+// Function to mark a decoded image with a single watermark at the given position
+void mark_region(cimg_library::CImg<float> * img, cimg_library::CImg<float> * wmark, float intensity, int x, int y);
+
+// Function to mark a JPEG image held in memory re-encoding only the MCUs under the watermark
+void mark_region_jpeg(const unsigned char * data, size_t size, cimg_library::CImg<float> * wmark, float intensity,
+	const placement& p, std::vector<unsigned char> * out);
+
+// Function to mark a JPEG file into another with mark_region_jpeg, throws CImgIOException on errors
+void mark_region_file(const std::string& load_path, const std::string& save_path, cimg_library::CImg<float> * wmark,
+	float intensity, const placement& p);
+
+#endif
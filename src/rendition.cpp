@@ -0,0 +1,209 @@
+#include <sstream>
+#include <cstdlib>
+#include <cmath>
+#include "rendition.h"
+#include "codec.h"
+
+// Function to parse a rendition: <name>[:i=<intensity>][,s=<width>x<height>][,q=<quality>][,w=<watermark_file>],
+// unset fields get the given defaults, returns false if the spec is not valid
+bool parse_rendition(const char * spec, float intensity, const std::string& wmark_file, rendition * r){
+	std::string s(spec);
+	size_t colon = s.find(':');
+	r -> name = s.substr(0, colon);
+	r -> intensity = intensity;
+	r -> width = r -> height = 0;
+	r -> quality = 100;
+	r -> wmark_file = wmark_file;
+	r -> wmark = nullptr;
+	r -> prepared = nullptr;
+	// The name is the directory of the rendition
+	if (r -> name.empty() || r -> name == "." || r -> name == ".." || r -> name.find('/') != std::string::npos)
+		return false;
+	if (colon == std::string::npos)
+		return true;
+
+	std::stringstream fields(s.substr(colon + 1));
+	std::string field;
+	while (std::getline(fields, field, ',')){
+		if (field.size() < 3 || field[1] != '=')
+			return false;
+		const char * value = field.c_str() + 2;
+		char * end;
+		switch (field[0]){
+			case 'i':{
+				long level = strtol(value, &end, 10);
+				if (*end != '\0' || end == value || level < 0 || level > 100)
+					return false;
+				r -> intensity = level;
+				r -> intensity = r -> intensity / 100;
+				break;
+			}
+			case 's':
+				r -> width = strtol(value, &end, 10);
+				if (*end != 'x' || end == value || r -> width <= 0)
+					return false;
+				value = end + 1;
+				r -> height = strtol(value, &end, 10);
+				if (*end != '\0' || end == value || r -> height <= 0)
+					return false;
+				break;
+			case 'q':
+				r -> quality = strtol(value, &end, 10);
+				if (*end != '\0' || end == value || r -> quality < 1 || r -> quality > 100)
+					return false;
+				break;
+			case 'w':
+				r -> wmark_file = value;
+				break;
+			default:
+				return false;
+		}
+	}
+	return true;
+}
+
+// Function to load the watermarks of the renditions, the ones sharing a file share the loaded watermark.
+// Throws CImgIOException if one can't be loaded
+void load_renditions(std::vector<rendition>& renditions){
+	for (unsigned int i = 0; i < renditions.size(); i++){
+		for (unsigned int j = 0; j < i && !renditions[i].wmark; j++)
+			if (renditions[j].wmark_file == renditions[i].wmark_file){
+				renditions[i].wmark = renditions[j].wmark;
+				renditions[i].prepared = renditions[j].prepared;
+			}
+		if (renditions[i].wmark)
+			continue;
+		cimg_library::CImg<float> * wmark = new cimg_library::CImg<float>;
+		try{
+			wmark -> load(&(renditions[i].wmark_file)[0u]);
+		}catch (const cimg_library::CImgIOException&) {
+			delete(wmark);
+			throw;
+		}
+		renditions[i].wmark = wmark;
+		renditions[i].prepared = prepare_wmark(wmark);
+	}
+}
+
+// Function to free the watermarks loaded by load_renditions
+void free_renditions(std::vector<rendition>& renditions){
+	for (unsigned int i = 0; i < renditions.size(); i++){
+		bool shared = false;
+		for (unsigned int j = 0; j < i; j++)
+			shared = shared || renditions[j].wmark == renditions[i].wmark;
+		if (!shared){
+			delete(renditions[i].prepared);
+			delete(renditions[i].wmark);
+		}
+	}
+	for (rendition& r : renditions)
+		r.wmark = nullptr, r.prepared = nullptr;
+}
+
+// Data structure defining how the pixels of a line are averaged into a shorter one: output pixel o covers
+// the input pixels from first[o] to first[o] + count[o] - 1, weights[o][k] being the share of each
+struct area_map{
+	std::vector<int> first;
+	std::vector<int> count;
+	std::vector<std::vector<float>> weights;
+};
+
+// Function to map a line of in pixels onto out pixels, each output pixel averaging the area it covers
+static void map_area(int in, int out, area_map * m){
+	double scale = (double) in / out;
+	m -> first.resize(out);
+	m -> count.resize(out);
+	m -> weights.resize(out);
+	for (int o = 0; o < out; o++){
+		double start = o * scale, end = (o + 1) * scale;
+		int first = (int) start, last = std::min((int) std::ceil(end), in);
+		m -> first[o] = first;
+		m -> count[o] = last - first;
+		m -> weights[o].resize(last - first);
+		for (int i = first; i < last; i++)
+			m -> weights[o][i - first] = (std::min(end, i + 1.0) - std::max(start, (double) i)) / scale;
+	}
+}
+
+// Function to shrink an image averaging the area each output pixel covers, rows first then columns
+static cimg_library::CImg<float> shrink_area(const cimg_library::CImg<float> * source, int width, int height){
+	area_map cols, rows;
+	map_area(source -> width(), width, &cols);
+	map_area(source -> height(), height, &rows);
+	cimg_library::CImg<float> narrow(width, source -> height(), 1, source -> spectrum());
+	cimg_library::CImg<float> img(width, height, 1, source -> spectrum(), 0);
+	for (int c = 0; c < source -> spectrum(); c++){
+		for (int y = 0; y < source -> height(); y++){
+			const float * in = source -> data(0, y, 0, c);
+			float * out = narrow.data(0, y, 0, c);
+			for (int x = 0; x < width; x++){
+				float sum = 0;
+				const float * w = cols.weights[x].data();
+				for (int k = 0; k < cols.count[x]; k++)
+					sum += in[cols.first[x] + k] * w[k];
+				out[x] = sum;
+			}
+		}
+		// Whole rows are accumulated, so that the columns pass walks memory in order as well
+		for (int y = 0; y < height; y++){
+			float * out = img.data(0, y, 0, c);
+			for (int k = 0; k < rows.count[y]; k++){
+				const float * in = narrow.data(0, rows.first[y] + k, 0, c);
+				float w = rows.weights[y][k];
+				for (int x = 0; x < width; x++)
+					out[x] += in[x] * w;
+			}
+		}
+	}
+	return img;
+}
+
+// Function to get the size of a rendition of an image of the given size, fitting its box and never upscaling
+void rendition_size(const rendition& r, int src_width, int src_height, int * width, int * height){
+	*width = src_width;
+	*height = src_height;
+	if (r.width > 0 && (src_width > r.width || src_height > r.height)){
+		double scale = std::min((double) r.width / src_width, (double) r.height / src_height);
+		*width = std::max(1, (int) (src_width * scale + 0.5));
+		*height = std::max(1, (int) (src_height * scale + 0.5));
+	}
+}
+
+// Function to decode a JPEG source at the smallest DCT scale still covering every rendition, throws
+// CImgIOException if it can't be decoded
+shared_source * decode_source(const std::string& path, const std::vector<rendition>& renditions){
+	int src_width, src_height, max_width = 0, max_height = 0;
+	jpeg_file_size(path, &src_width, &src_height);
+	for (const rendition& r : renditions){
+		int width, height;
+		rendition_size(r, src_width, src_height, &width, &height);
+		max_width = std::max(max_width, width);
+		max_height = std::max(max_height, height);
+	}
+	cimg_library::CImg<float> * img = new cimg_library::CImg<float>;
+	try{
+		decode_jpeg_file(path, img, pick_scale(src_width, src_height, max_width, max_height));
+	}catch (const cimg_library::CImgIOException&) {
+		delete(img);
+		throw;
+	}
+	shared_source * source = new shared_source;
+	source -> img = img;
+	source -> width = src_width;
+	source -> height = src_height;
+	source -> pending = renditions.size();
+	return source;
+}
+
+// Function to render a rendition of a source image: resize or copy, mark and encode, the source is only read
+void render(const shared_source * source, const rendition& r, const std::string& save_path){
+	int width, height;
+	rendition_size(r, source -> width, source -> height, &width, &height);
+	// The copy is marked after shrinking so that the watermark keeps its size
+	const cimg_library::CImg<float> * decoded = source -> img;
+	cimg_library::CImg<float> img = (width == decoded -> width() && height == decoded -> height()) ?
+		cimg_library::CImg<float>(*decoded) : shrink_area(decoded, width, height);
+	img_chunk whole = {0, 0, img.height() - 1, img.width() - 1};
+	mark_chunk(&img, &whole, r.prepared, r.intensity);
+	img.save_jpeg(&save_path[0u], r.quality);
+}
@@ -0,0 +1,69 @@
+#ifndef __RENDITION_H__
+#define __RENDITION_H__
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include "CImg.h"
+#include "wmark.h"
+
+/***
+	Multi-rendition fan-out: several variants of every image (different intensities, a thumbnail, a web size
+	copy...) are published from a single decode. Each rendition declares its intensity, the box its size has
+	to fit in, the JPEG quality and the watermark, the decoded image is shared read-only by the N rendering
+	tasks of the image and freed by the last one. A rendering task resizes (or copies) the source, marks the
+	copy and encodes it into watermarked/<name>/.
+	When every rendition is smaller than the source, the source is decoded scaled down in the DCT domain
+	(1/2, 1/4 or 1/8) to the smallest size still covering the largest rendition, the rest of the way is an
+	area average and the watermark is applied at output resolution.
+***/
+
+// Data structure defining a rendition of the images
+struct rendition{
+	std::string name;
+	float intensity;
+	int width;	// Box the rendition fits in keeping the aspect ratio, 0 to keep the size of the source
+	int height;
+	int quality;
+	std::string wmark_file;
+	cimg_library::CImg<float> * wmark;
+	prepared_wmark * prepared;
+};
+
+// Data structure defining a decoded image shared by its renditions, the last rendering task frees it
+struct shared_source{
+	cimg_library::CImg<float> * img;	// Possibly decoded at a reduced scale
+	int width;	// Size of the source image, the sizes of the renditions depend on it
+	int height;
+	std::atomic<int> pending;
+};
+
+// Data structure defining a rendering task (i.e. source image, rendition and path to save it in)
+struct render_task{
+	shared_source * source;
+	const rendition * target;
+	std::string save_path;
+};
+
+// Function to parse a rendition: <name>[:i=<intensity>][,s=<width>x<height>][,q=<quality>][,w=<watermark_file>],
+// unset fields get the given defaults, returns false if the spec is not valid
+bool parse_rendition(const char * spec, float intensity, const std::string& wmark_file, rendition * r);
+
+// Function to load the watermarks of the renditions, the ones sharing a file share the loaded watermark.
+// Throws CImgIOException if one can't be loaded
+void load_renditions(std::vector<rendition>& renditions);
+
+// Function to free the watermarks loaded by load_renditions
+void free_renditions(std::vector<rendition>& renditions);
+
+// Function to get the size of a rendition of an image of the given size, fitting its box and never upscaling
+void rendition_size(const rendition& r, int src_width, int src_height, int * width, int * height);
+
+// Function to decode a JPEG source at the smallest DCT scale still covering every rendition, throws
+// CImgIOException if it can't be decoded
+shared_source * decode_source(const std::string& path, const std::vector<rendition>& renditions);
+
+// Function to render a rendition of a source image: resize or copy, mark and encode, the source is only read
+void render(const shared_source * source, const rendition& r, const std::string& save_path);
+
+#endif
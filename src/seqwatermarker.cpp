@@ -4,31 +4,77 @@
 #include <dirent.h> 
 #include <sstream>
 #include <climits>
+#include <fstream>
+#include <iterator>
 #include "queue.h"
 #include "my_utils.h"
+#include "manifest.h"
+#include "cache.h"
+#include "region.h"
+#include "fused.h"
+#include "codec.h"
 
 // Watermark
 cimg_library::CImg<float> * wmark;
+prepared_wmark * prepared;
 
+// Manifest of the already processed images (only in incremental mode)
+manifest * done_manifest = nullptr;
+
+// Cache of the outputs of byte-identical images (only in dedupe mode)
+output_cache * dedupe_cache = nullptr;
+
+// Placement of the watermark, tiled over the whole image unless given
+placement place = {PLACE_TILE, 0, 0};
+
+// Function to compare the YCbCr and RGB paths on an image against the RGB blend of the decoded image,
+// accumulates the absolute differences of both
+void verify_ycc(const std::string& load_path, float intensity, double * rgb_sum, double * ycc_sum, long * samples, int * max_diff){
+	std::ifstream file(load_path, std::ios::binary);
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()), rgb, ycc;
+	mark_fused_jpeg(data.data(), data.size(), prepared, intensity, &rgb);
+	mark_ycc_jpeg(data.data(), data.size(), prepared, intensity, &ycc);
+	cimg_library::CImg<float> reference, rgb_marked, ycc_marked;
+	decode_jpeg(data.data(), data.size(), &reference);
+	img_chunk whole = {0, 0, reference.height() - 1, reference.width() - 1};
+	mark_chunk(&reference, &whole, prepared, intensity);
+	decode_jpeg(rgb.data(), rgb.size(), &rgb_marked);
+	decode_jpeg(ycc.data(), ycc.size(), &ycc_marked);
+	cimg_foroff(reference, i){
+		int diff = std::abs((int) reference[i] - (int) ycc_marked[i]);
+		*rgb_sum += std::abs((int) reference[i] - (int) rgb_marked[i]);
+		*ycc_sum += diff;
+		*max_diff = std::max(*max_diff, diff);
+	}
+	*samples += reference.size();
+}
 
 int main(int argc, char* argv[]){
 
 	std::string src_path, wmark_file;
 	DIR *dirp;
     struct dirent *directory;
-	int sflag = -1, wflag = -1, processed = 0;
+	int sflag = -1, wflag = -1, mflag = -1, dflag = -1, fflag = -1, yflag = -1, vflag = -1, xflag = -1, eflag = -1, processed = 0, skipped = 0;
 	char * end;
 	int c;
 	float intensity = 0.3;
-	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -i <intensity>\n"
+	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -i <intensity> -l <placement> [-f] [-y] [-v] [-x] [-e] [-m] [-d]\n"
 	"-s src_path --- Directory containing the images to be watermarked\n"
 	"-w watermark_file --- Path of the watermark to be used\n"
-	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n";
+	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-l placement --- Mark a single watermark in a corner (tl, tr, bl, br), in the centre (c) or at <x>,<y>, re-encoding only the JPEG blocks under it\n"
+	"-f --- Fused mode, JPEG images are decoded, marked and encoded one band of scanlines at a time\n"
+	"-y --- YCbCr mode, JPEG images are blended straight on the planes of the decoder, skipping the colour conversions\n"
+	"-v --- Verify the YCbCr mode against the RGB path, fails if it strays from the RGB blend more than the RGB path plus the documented tolerance\n"
+	"-x --- Fixed point mode, the fused mode (implied) blends 8 bit samples with integer weights, within 1 LSB of the float blend\n"
+	"-e --- Check the fixed point blend exhaustively against the float one and exit, fails if it is more than 1 LSB off\n"
+	"-m --- Incremental mode, skip the images already marked with the same watermark and intensity\n"
+	"-d --- Dedupe mode, byte-identical images are marked once and their output is linked from a cache\n";
 
 	std::vector<std::thread> workers;
 
 	// Parse command line arguments
-	while ((c = getopt (argc, argv, "s:w:i:")) != -1)
+	while ((c = getopt (argc, argv, "s:w:i:l:fyvxemd")) != -1)
 		switch (c){
 			case 's':
 				sflag = 1;
@@ -52,6 +98,36 @@ int main(int argc, char* argv[]){
 					std::cerr << "Intensity set to default " << intensity << " cause given value was out of range (0,100)" << std::endl;
 				}
 				break;
+			case 'l':
+				if (!parse_placement(optarg, &place)) {
+					std::cerr << "Invalid placement.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'f':
+				fflag = 1;
+				break;
+			case 'y':
+				yflag = 1;
+				break;
+			case 'v':
+				yflag = 1;
+				vflag = 1;
+				break;
+			case 'x':
+				fflag = 1;
+				xflag = 1;
+				break;
+			case 'e':
+				eflag = 1;
+				break;
+			case 'm':
+				mflag = 1;
+				break;
+			case 'd':
+				dflag = 1;
+				break;
 			case '?':
 				if (optopt == 's' || optopt =='w')
 					std::cerr << USAGE << std::endl;
@@ -64,6 +140,17 @@ int main(int argc, char* argv[]){
 				exit(1);
 		}
 	
+	// The check does not need any image
+	if (eflag == 1){
+		int max_dev = verify_fixed();
+		std::cout << "Fixed point blend: max deviation from the float blend " << max_dev << " LSB over every pixel, watermark and intensity" << std::endl;
+		if (max_dev > 1){
+			std::cerr << "Fixed point blend out of tolerance" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
 	// Make sure all the required paths have been set
 	if (sflag == -1 || wflag == -1){
 		std::cerr << USAGE << std::endl;
@@ -79,11 +166,27 @@ int main(int argc, char* argv[]){
 		exit(1);
 	}
 	std::cout << "Watermark size: (" << wmark -> width() <<", " << wmark -> height() << ")" << std::endl;
+	prepared = prepare_wmark(wmark);
+	if (xflag == 1)
+		prepare_fixed(prepared, intensity);
+	std::cout << "Watermark tiles: " << prepared -> n_empty << " empty, " << prepared -> n_full << " full, " << prepared -> n_mixed << " mixed" << std::endl;
+
+	// In incremental mode load the manifest of the images already processed, the engines are told apart
+	blend_engine blend = yflag == 1 ? BLEND_YCC : xflag == 1 ? BLEND_FIXED : fflag == 1 ? BLEND_FUSED : BLEND_CIMG;
+	if (mflag == 1)
+		done_manifest = open_manifest(src_path, wmark_file, intensity, variant_key(place, blend));
+
+	// In dedupe mode outputs are linked from the content-addressed cache
+	if (dflag == 1)
+		dedupe_cache = open_cache(src_path, wmark_file, intensity, done_manifest, variant_key(place, blend));
 
 	// Open the directory containing the images to be watermarked
     dirp = opendir(&src_path[0u]);
 
 	long int time_marking = 0;
+	double rgb_sum = 0, ycc_sum = 0;
+	long samples = 0;
+	int max_diff = 0;
     if (dirp){
         while ((directory = readdir(dirp)) != NULL){
 			if (strendswith(directory->d_name, ".jpg")){
@@ -92,39 +195,67 @@ int main(int argc, char* argv[]){
 				// Open the img and prepare the loading tasks
 				std::string load_path = src_path+tmp;
 				std::string save_path = src_path+"/watermarked/"+directory->d_name;
+				if (done_manifest && done_manifest -> up_to_date(load_path, save_path)){
+					skipped += 1;
+					continue;
+				}
+				uint64_t key = 0;
+				if (dedupe_cache && dedupe_cache -> fetch(load_path, save_path, &key) != CACHE_MISS)
+					continue;
+				if (place.mode != PLACE_TILE || fflag == 1 || yflag == 1){
+					// Only the blocks under the watermark are decoded, marked and encoded again, or the
+					// image goes through the fused or YCbCr engine: marking time includes decoding and encoding
+					try{
+						auto start = std::chrono::high_resolution_clock::now();
+						if (place.mode != PLACE_TILE)
+							mark_region_file(load_path, save_path, wmark, intensity, place);
+						else if (yflag == 1)
+							mark_ycc_file(load_path, save_path, prepared, intensity);
+						else
+							mark_fused_file(load_path, save_path, prepared, intensity);
+						auto elapsed = std::chrono::high_resolution_clock::now() - start;
+						time_marking += std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+						if (vflag == 1)
+							verify_ycc(load_path, intensity, &rgb_sum, &ycc_sum, &samples, &max_diff);
+						processed += 1;
+						if (done_manifest)
+							done_manifest -> record(load_path, save_path);
+						if (dedupe_cache)
+							dedupe_cache -> store(key, save_path);
+					}
+					catch (const cimg_library::CImgIOException& e) {
+						std::cerr << "Error marking image " << load_path << ": " << e.what() << std::endl;
+						if (dedupe_cache)
+							dedupe_cache -> abort(key);
+					}
+					continue;
+				}
 				cimg_library::CImg<float> img;
 				try{
 					img.load(&(load_path)[0u]);
 					auto start = std::chrono::high_resolution_clock::now();
 				
-					int width = wmark -> width();
-					int height = wmark -> height();
-					int img_height = img.height();
-					int img_width = img.width();
-					bool has_3_chan = img.spectrum() == 3 && (*wmark).spectrum()==3;
-					for (int row = 0; row < img_height; row++)
-						for (int col = 0; col < img_width; col++){
-							if (!has_3_chan||((*wmark)(col%width,row%height,0,0) + 
-								(*wmark)(col%width,row%height,0,1) + 
-								(*wmark)(col%width,row%height,0,2) < 500)){
-									img(col,row,0,0) = mark_pixel(img(col,row,0,0), (*wmark)(col%width,row%height,0,0), intensity);
-									if(has_3_chan){
-										img(col,row,0,1) = mark_pixel(img(col,row,0,1), (*wmark)(col%width,row%height,0,1), intensity);		
-										img(col,row,0,2) = mark_pixel(img(col,row,0,2), (*wmark)(col%width,row%height,0,2), intensity);	
-									}
-							}
-						}
+					img_chunk whole = {0, 0, img.height() - 1, img.width() - 1};
+					mark_chunk(&img, &whole, prepared, intensity);
 					auto elapsed = std::chrono::high_resolution_clock::now() - start;
 					auto msec    = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
 					time_marking += msec;
 					img.save(&(save_path)[0u]);
 					processed += 1;
+					if (done_manifest)
+						done_manifest -> record(load_path, save_path);
+					if (dedupe_cache)
+						dedupe_cache -> store(key, save_path);
 				}
 				catch (const cimg_library::CImgIOException& e) {
 				    std::cerr << "Error reading image " << load_path << ": " << e.what() << std::endl;
+					if (dedupe_cache)
+						dedupe_cache -> abort(key);
 				}
 				catch (const std::exception& e) {
 				    std::cerr << "Error saving image " << save_path << ": " << e.what() << std::endl;
+					if (dedupe_cache)
+						dedupe_cache -> abort(key);
 				}				
 
 			}
@@ -132,7 +263,25 @@ int main(int argc, char* argv[]){
 
 		std::cout << "Spent a total of " << time_marking << " msecs marking images" << std::endl;
 		std::cout << "Processed a total of " << processed << " images" << std::endl;
+		if (vflag == 1){
+			double rgb_mean = samples > 0 ? rgb_sum / samples : 0, ycc_mean = samples > 0 ? ycc_sum / samples : 0;
+			std::cout << "Mean absolute difference from the RGB blend: " << ycc_mean << " YCbCr (max " << max_diff << "), "
+				<< rgb_mean << " RGB, tolerance " << YCC_MEAN_TOLERANCE << std::endl;
+			if (ycc_mean > rgb_mean + YCC_MEAN_TOLERANCE){
+				std::cerr << "YCbCr mode out of tolerance" << std::endl;
+				return 1;
+			}
+		}
+		if (done_manifest){
+			std::cout << "Skipped " << skipped << " up to date images" << std::endl;
+			delete(done_manifest);
+		}
+		if (dedupe_cache){
+			dedupe_cache -> report();
+			delete(dedupe_cache);
+		}
 		closedir(dirp);
+		delete(prepared);
 		delete(wmark);
 		delete(directory);
     }
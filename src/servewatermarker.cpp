@@ -0,0 +1,356 @@
+/***
+	Server version of the program using standard c++ mechanisms only.
+	Images are posted over a Unix domain socket or localhost HTTP and the watermarked JPEG is sent back in
+	the response, nothing touches the disk. Decoding and encoding run in the connection threads while the
+	marking is done by a warm pool of markers that batches the images of concurrent requests.
+	Requests: POST /mark[?intensity=<0-100>] with the JPEG as body, GET /metrics. Stop it with SIGINT or SIGTERM.
+***/
+#include <csignal>
+#include <condition_variable>
+#include <set>
+#include <sstream>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "pool.h"
+#include "codec.h"
+#include "http.h"
+
+#define MAX_LATENCIES (1 << 20)
+
+// Watermark and marking pool, shared by all the connections
+cimg_library::CImg<float> * wmark;
+prepared_wmark * prepared;
+mark_pool * pool;
+float default_intensity = 0.3;
+int quality = 100;
+size_t max_body = 64 << 20;
+long max_pixels = 64L << 20;	// Largest image decoded, the header can declare any size whatever the body
+
+// Per-request metrics, the latencies of the last MAX_LATENCIES requests are kept
+std::mutex metrics_lock;
+std::vector<long> latencies;
+long n_requests = 0, n_failed = 0;
+std::chrono::steady_clock::time_point started;
+
+// Open connections, bounded by max_connections
+std::mutex conn_lock;
+std::condition_variable conn_cond;
+std::set<int> connections;
+unsigned int max_connections = 64;
+int keep_alive_secs = 5;
+
+int stop_pipe[2];
+
+// Stop accepting connections on SIGINT/SIGTERM
+void stop_serving(int){
+	char c = 0;
+	if (write(stop_pipe[1], &c, 1) < 0)
+		return;
+}
+
+void record_request(long usec, bool ok){
+	std::unique_lock<std::mutex> lock(metrics_lock);
+	if (latencies.size() < MAX_LATENCIES)
+		latencies.push_back(usec);
+	else
+		latencies[n_requests % MAX_LATENCIES] = usec;
+	n_requests += 1;
+	if (!ok)
+		n_failed += 1;
+}
+
+std::string metrics(){
+	std::unique_lock<std::mutex> lock(metrics_lock);
+	double secs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count() / 1000.0;
+	std::ostringstream out;
+	out << "requests " << n_requests << "\n"
+		<< "failed " << n_failed << "\n"
+		<< "requests_per_sec " << (secs > 0 ? n_requests / secs : 0) << "\n"
+		<< "batches " << pool -> batches() << "\n"
+		<< "images_per_batch " << (pool -> batches() > 0 ? (double) pool -> images() / pool -> batches() : 0) << "\n"
+		<< "latency " << latency_summary(latencies) << "\n";
+	{
+		std::unique_lock<std::mutex> conn_guard(conn_lock);
+		out << "connections " << connections.size() << "\n";
+	}
+	return out.str();
+}
+
+// Intensity given in the query string of the target, if any
+float intensity_of(const std::string& target){
+	size_t query = target.find("intensity=", target.find('?'));
+	if (target.find('?') == std::string::npos || query == std::string::npos)
+		return default_intensity;
+	long value = strtol(&target[query + 10], nullptr, 10);
+	if (value < 0 || value > 100)
+		return default_intensity;
+	return value / 100.0;
+}
+
+// Serve the requests of a connection until it is closed
+void serve_connection(int fd){
+	struct timeval timeout = {keep_alive_secs, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	http_stream stream(fd, max_body);
+	http_message req;
+	while (stream.read(&req)){
+		auto start = std::chrono::steady_clock::now();
+		bool keep_alive = req.keep_alive();
+		std::string connection = keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+		std::string path = req.start[1].substr(0, req.start[1].find('?'));
+		bool ok = true, written;
+		if (req.start[0] == "GET" && path == "/metrics"){
+			std::string text = metrics();
+			written = stream.write("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n" + connection, (const unsigned char *) text.data(), text.size());
+		}
+		else if (req.start[0] == "POST" && path == "/mark"){
+			try{
+				// The size is checked before decoding, libjpeg fills a truncated image up to its declared size
+				int width, height;
+				jpeg_size(req.body.data(), req.body.size(), &width, &height);
+				if ((long) width * height > max_pixels){
+					std::string text = "Image of " + std::to_string(width) + "x" + std::to_string(height) + " pixels, more than " +
+						std::to_string(max_pixels) + "\n";
+					ok = false;
+					written = stream.write("HTTP/1.1 413 Payload Too Large\r\nContent-Type: text/plain\r\n" + connection, (const unsigned char *) text.data(), text.size());
+				}
+				else{
+					cimg_library::CImg<float> img;
+					decode_jpeg(req.body.data(), req.body.size(), &img);
+					pool -> mark(&img, intensity_of(req.start[1]));
+					std::vector<unsigned char> out;
+					encode_jpeg(img, &out, quality);
+					written = stream.write("HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\n" + connection, out.data(), out.size());
+				}
+			}
+			catch (const cimg_library::CImgException& e) {
+				std::string text = std::string(e.what()) + "\n";
+				ok = false;
+				written = stream.write("HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\n" + connection, (const unsigned char *) text.data(), text.size());
+			}
+		}
+		else{
+			ok = false;
+			written = stream.write("HTTP/1.1 404 Not Found\r\n" + connection, nullptr, 0);
+		}
+		record_request(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(), ok);
+		if (!written || !keep_alive)
+			break;
+	}
+	if (stream.too_large())
+		stream.write("HTTP/1.1 413 Payload Too Large\r\nConnection: close\r\n", nullptr, 0);
+
+	std::unique_lock<std::mutex> lock(conn_lock);
+	connections.erase(fd);
+	close(fd);
+	conn_cond.notify_all();
+}
+
+int listen_unix(const std::string& path){
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, &path[0u], sizeof(addr.sun_path) - 1);
+	unlink(&path[0u]);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0){
+		std::cerr << "Error listening on " << path << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	return fd;
+}
+
+int listen_tcp(int port){
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0){
+		std::cerr << "Error listening on localhost:" << port << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	return fd;
+}
+
+int main(int argc, char* argv[]){
+
+	std::string socket_path, wmark_file;
+	int wflag = -1;
+	int c, port = 0, n_workers = 1, n_chunks = 0, batch_size = 0, batch_usecs = 200;
+	char * end;
+	const char * USAGE = "Usage -w <watermark_file> [-u <socket_path>] [-p <port>] -i <intensity> -c <chunks> -n <parallelism degree> -k <max connections> -b <batch size> -t <batch window> -q <quality> -a <keep alive> -z <max megapixels>\n"
+	"-w watermark_file --- Path of the watermark to be used\n"
+	"-u socket_path --- Unix domain socket to listen on\n"
+	"-p port --- Localhost TCP port to listen on (at least one of -u and -p is required)\n"
+	"-i intensity --- Default intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-c chunks --- Number of chunks to divide each image in, defaults to parallelism degree\n"
+	"-n parallelism degree --- Number of marking threads\n"
+	"-k max connections --- Maximum number of connections served at the same time, defaults to 64\n"
+	"-b batch size --- Maximum number of images marked in a batch, defaults to parallelism degree\n"
+	"-t batch window --- Usecs waited for more images before dispatching a batch, defaults to 200\n"
+	"-q quality --- JPEG quality of the responses, defaults to 100\n"
+	"-a keep alive --- Secs an idle connection is kept open, defaults to 5\n"
+	"-z max megapixels --- Largest image accepted, larger ones are answered 413 before being decoded, defaults to 64\n";
+
+	// Parse command line arguments
+	while ((c = getopt (argc, argv, "w:u:p:i:c:n:k:b:t:q:a:z:")) != -1){
+		long value = 0;
+		if (c != 'w' && c != 'u' && c != '?'){
+			value = strtol(optarg, &end, 10);
+			if (*end != '\0' || value < 0) {
+				std::cerr << "Invalid value for -" << (char) c << ".\n";
+				std::cerr << USAGE << std::endl;
+				exit(1);
+			}
+		}
+		switch (c){
+			case 'w':
+				wflag = 1;
+				wmark_file = optarg;
+				break;
+			case 'u':
+				socket_path = optarg;
+				break;
+			case 'p':
+				port = value;
+				break;
+			case 'i':
+				if (value > 100)
+					std::cout << "Intensity set to default " << default_intensity << " cause given value was out of range (0,100)" << std::endl;
+				else
+					default_intensity = value / 100.0;
+				break;
+			case 'c':
+				n_chunks = value;
+				break;
+			case 'n':
+				n_workers = value > 0 ? value : 1;
+				break;
+			case 'k':
+				max_connections = value > 0 ? value : 1;
+				break;
+			case 'b':
+				batch_size = value;
+				break;
+			case 't':
+				batch_usecs = value;
+				break;
+			case 'q':
+				quality = value > 0 && value <= 100 ? value : 100;
+				break;
+			case 'a':
+				keep_alive_secs = value;
+				break;
+			case 'z':
+				max_pixels = std::max(1L, std::min(value, 1L << 20)) << 20;
+				break;
+			case '?':
+				std::cerr << USAGE << std::endl;
+				return 1;
+			default:
+				exit(1);
+		}
+	}
+
+	// Make sure the watermark and at least an endpoint have been set
+	if (wflag == -1 || (socket_path.empty() && port == 0)){
+		std::cerr << USAGE << std::endl;
+		return 1;
+	}
+
+	// Load the watermark
+	wmark = new cimg_library::CImg<float>;
+	try{
+		wmark -> load(&(wmark_file)[0u]);
+	}catch (const cimg_library::CImgIOException& e) {
+		std::cerr << "Error loading watermark " << wmark_file << ": " << e.what() << "\nExiting.." << std::endl;
+		exit(1);
+	}
+	std::cout << "Watermark size: (" << wmark -> width() <<", " << wmark -> height() << ")" << std::endl;
+	prepared = prepare_wmark(wmark);
+	std::cout << "Watermark tiles: " << prepared -> n_empty << " empty, " << prepared -> n_full << " full, " << prepared -> n_mixed << " mixed" << std::endl;
+
+	// Errors are reported to the clients, don't print the exceptions thrown by CImg and the codec
+	cimg_library::cimg::exception_mode(0);
+
+	if (n_chunks == 0)
+		n_chunks = n_workers;
+	if (batch_size == 0)
+		batch_size = n_workers;
+	pool = new mark_pool(prepared, n_workers, n_chunks, batch_size, batch_usecs);
+
+	std::vector<struct pollfd> fds;
+	if (pipe(stop_pipe) != 0){
+		std::cerr << "Error creating pipe: " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	fds.push_back({stop_pipe[0], POLLIN, 0});
+	if (!socket_path.empty()){
+		fds.push_back({listen_unix(socket_path), POLLIN, 0});
+		std::cout << "Listening on " << socket_path << std::endl;
+	}
+	if (port != 0){
+		fds.push_back({listen_tcp(port), POLLIN, 0});
+		std::cout << "Listening on localhost:" << port << std::endl;
+	}
+	signal(SIGINT, stop_serving);
+	signal(SIGTERM, stop_serving);
+	signal(SIGPIPE, SIG_IGN);
+
+	started = std::chrono::steady_clock::now();
+	while (true){
+		// Don't accept more connections than allowed, the others wait in the backlog
+		{
+			std::unique_lock<std::mutex> lock(conn_lock);
+			conn_cond.wait(lock, []{ return connections.size() < max_connections; });
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0){
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error waiting for connections: " << strerror(errno) << std::endl;
+			break;
+		}
+		if (fds[0].revents & POLLIN)
+			break;
+		for (unsigned int i = 1; i < fds.size(); i++)
+			if (fds[i].revents & POLLIN){
+				int fd = accept(fds[i].fd, nullptr, nullptr);
+				if (fd < 0)
+					continue;
+				int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				{
+					std::unique_lock<std::mutex> lock(conn_lock);
+					connections.insert(fd);
+				}
+				std::thread(serve_connection, fd).detach();
+			}
+	}
+
+	// Let the open connections finish their current request
+	std::cout << "Stopping.." << std::endl;
+	for (unsigned int i = 1; i < fds.size(); i++)
+		close(fds[i].fd);
+	if (!socket_path.empty())
+		unlink(&socket_path[0u]);
+	{
+		std::unique_lock<std::mutex> lock(conn_lock);
+		for (int fd : connections)
+			shutdown(fd, SHUT_RD);
+		conn_cond.wait(lock, []{ return connections.empty(); });
+	}
+	std::cout << metrics();
+	delete(pool);
+	delete(prepared);
+	delete(wmark);
+	return 0;
+}
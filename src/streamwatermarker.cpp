@@ -0,0 +1,253 @@
+/***
+	Streaming version of the program using standard c++ mechanisms only.
+	Reads a tar archive (or length-prefixed frames) from stdin and writes it to stdout with its .jpg entries
+	watermarked, without touching the disk. Entries are decoded and marked in parallel and written in input order,
+	the reader is held back when it gets more than a reorder window of entries ahead of the writer.
+***/
+#include <map>
+#include <condition_variable>
+#include "queue.h"
+#include "my_utils.h"
+#include "codec.h"
+#include "tar.h"
+#include "region.h"
+#include "fused.h"
+
+// Watermark
+cimg_library::CImg<float> * wmark;
+prepared_wmark * prepared;
+
+// Placement of the watermark, tiled over the whole image unless given
+placement place = {PLACE_TILE, 0, 0};
+
+// Data structure defining an entry of the stream and its position in it
+struct stream_task{
+	long seq;
+	tar_entry * entry;
+};
+
+queue<stream_task *> tasks_queue;
+
+// Entries marked but not written yet, with the bounded reorder window
+std::mutex window_lock;
+std::condition_variable window_cond;
+std::map<long, tar_entry *> done_entries;
+long next_to_write = 0;
+long window = 0;
+std::atomic<int> processed, failed;
+
+// Function to be executed by workers, decodes, marks and encodes the entries
+void marking_stage(float intensity, int quality){
+	while (true){
+		stream_task * t = tasks_queue.pop();
+		if (t == EOS)
+			return;
+		if (t -> entry -> type == '0' && strendswith(&(t -> entry -> name)[0u], ".jpg")){
+			try{
+				if (place.mode != PLACE_TILE){
+					// Only the blocks under the watermark are decoded, marked and encoded again
+					std::vector<unsigned char> marked;
+					mark_region_jpeg(t -> entry -> data.data(), t -> entry -> data.size(), wmark, intensity, place, &marked);
+					t -> entry -> data.swap(marked);
+				}
+				else{
+					// Decoded, marked and encoded one band of scanlines at a time
+					std::vector<unsigned char> marked;
+					mark_fused_jpeg(t -> entry -> data.data(), t -> entry -> data.size(), prepared, intensity, &marked, quality);
+					t -> entry -> data.swap(marked);
+				}
+				processed += 1;
+			}
+			catch (const cimg_library::CImgException& e) {
+				// Keep the entry as it is
+				std::cerr << "Error marking " << t -> entry -> name << ": " << e.what() << std::endl;
+				failed += 1;
+			}
+		}
+		{
+			std::unique_lock<std::mutex> lock(window_lock);
+			done_entries[t -> seq] = t -> entry;
+		}
+		window_cond.notify_all();
+		delete(t);
+	}
+}
+
+// Function to be executed by the writer, writes the entries in input order
+void writing_stage(bool frames, long * total){
+	bool ok = true;
+	while (true){
+		tar_entry * entry;
+		{
+			std::unique_lock<std::mutex> lock(window_lock);
+			window_cond.wait(lock, [&]{ return done_entries.count(next_to_write) > 0 || next_to_write == *total; });
+			if (next_to_write == *total)
+				break;
+			entry = done_entries[next_to_write];
+			done_entries.erase(next_to_write);
+		}
+		if (ok){
+			ok = frames ? frame_write(stdout, *entry) : tar_write(stdout, *entry);
+			if (!ok)
+				std::cerr << "Error writing " << entry -> name << ", discarding the rest of the stream" << std::endl;
+		}
+		delete(entry);
+		{
+			std::unique_lock<std::mutex> lock(window_lock);
+			next_to_write += 1;
+		}
+		window_cond.notify_all();
+	}
+	if (ok && !frames)
+		tar_finish(stdout);
+	std::fflush(stdout);
+}
+
+int main(int argc, char* argv[]){
+
+	std::string wmark_file;
+	int wflag = -1;
+	int c, n_workers = 1, quality = 100;
+	bool frames = false, fixed = false;
+	float intensity = 0.3;
+	char * end;
+	const char * USAGE = "Usage -w <watermark_file> -i <intensity> -n <parallelism degree> -r <reorder window> -q <quality> -l <placement> [-f] [-x] < in.tar > out.tar\n"
+	"-w watermark_file --- Path of the watermark to be used\n"
+	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-n parallelism degree --- Number of marking threads\n"
+	"-r reorder window --- Maximum number of entries in flight, defaults to 4 times the parallelism degree\n"
+	"-q quality --- JPEG quality of the marked entries, defaults to 100\n"
+	"-l placement --- Mark a single watermark in a corner (tl, tr, bl, br), in the centre (c) or at <x>,<y>, re-encoding only the JPEG blocks under it\n"
+	"-f --- Read and write length-prefixed frames instead of tar archives\n"
+	"-x --- Fixed point mode, 8 bit samples are blended with integer weights, within 1 LSB of the float blend\n";
+
+	// Parse command line arguments
+	while ((c = getopt (argc, argv, "w:i:n:r:q:l:fx")) != -1)
+		switch (c){
+			case 'w':
+				wflag = 1;
+				wmark_file = optarg;
+				break;
+			case 'n':
+				n_workers = strtol(optarg, &end, 10);
+				if (*end != '\0' || n_workers <= 0) {
+					std::cerr << "Invalid number of workers.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'r':
+				window = strtol(optarg, &end, 10);
+				if (*end != '\0' || window <= 0) {
+					std::cerr << "Invalid reorder window.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'q':
+				quality = strtol(optarg, &end, 10);
+				if (*end != '\0' || quality <= 0 || quality > 100) {
+					std::cerr << "Invalid quality.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'i':
+				intensity = strtol(optarg, &end, 10);
+				if (*end != '\0') {
+					std::cerr << "Invalid intensity.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				intensity = intensity/100;
+				if (intensity < 0 or intensity > 1){
+					intensity = 0.3;
+					std::cerr << "Intensity set to default " << intensity << " cause given value was out of range (0,100)" << std::endl;
+				}
+				break;
+			case 'l':
+				if (!parse_placement(optarg, &place)) {
+					std::cerr << "Invalid placement.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'f':
+				frames = true;
+				break;
+			case 'x':
+				fixed = true;
+				break;
+			case '?':
+				std::cerr << USAGE << std::endl;
+				return 1;
+			default:
+				exit(1);
+		}
+
+	if (wflag == -1){
+		std::cerr << USAGE << std::endl;
+		return 1;
+	}
+	if (window == 0)
+		window = 4 * n_workers;
+
+	// Load the watermark, stdout is reserved for the stream
+	wmark = new cimg_library::CImg<float>;
+	try{
+		wmark -> load(&(wmark_file)[0u]);
+	}catch (const cimg_library::CImgIOException& e) {
+		std::cerr << "Error loading watermark " << wmark_file << ": " << e.what() << "\nExiting.." << std::endl;
+		exit(1);
+	}
+	prepared = prepare_wmark(wmark);
+	if (fixed)
+		prepare_fixed(prepared, intensity);
+	cimg_library::cimg::exception_mode(0);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	long total = -1;	// unknown until the whole input has been read
+	std::vector<std::thread> workers;
+	for (int i = 0; i < n_workers; i++)
+		workers.push_back(std::thread(marking_stage, intensity, quality));
+	std::thread writer(writing_stage, frames, &total);
+
+	// Read the entries, waiting when the writer is a whole window behind
+	long seq = 0;
+	bool malformed = false;
+	while (true){
+		tar_entry * entry = new tar_entry;
+		if (!(frames ? frame_read(stdin, entry, &malformed) : tar_read(stdin, entry, &malformed))){
+			delete(entry);
+			break;
+		}
+		{
+			std::unique_lock<std::mutex> lock(window_lock);
+			window_cond.wait(lock, [&]{ return seq - next_to_write < window; });
+		}
+		stream_task * t = new stream_task;
+		t -> seq = seq++;
+		t -> entry = entry;
+		tasks_queue.push(t);
+	}
+	{
+		std::unique_lock<std::mutex> lock(window_lock);
+		total = seq;
+	}
+	window_cond.notify_all();
+
+	for (int i = 0; i < n_workers; i++)
+		tasks_queue.push(EOS);
+	join_em(&workers);
+	writer.join();
+
+	auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cerr << "Streamed " << total << " entries in " << msec << " msecs, marked " << processed << " images (" << failed << " failed)" << std::endl;
+	delete(prepared);
+	delete(wmark);
+	if (malformed){
+		std::cerr << "The input stream is malformed, only the entries before the error were written" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,272 @@
+#include "tar.h"
+#include <cstring>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <sys/stat.h>
+
+#define TAR_BLOCK 512
+#define READ_STEP (1 << 20)	// Data is read in steps, so a bogus size fails at the end of the stream without allocating it
+
+// Header of a ustar entry
+struct tar_header{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+// Function to parse a numeric field, -1 if negative or too large
+static long long parse_octal(const char * field, size_t len){
+	// Base-256 encoding (GNU) for large values, two's complement with bit 6 of the first byte as sign
+	if ((unsigned char) field[0] & 0x80){
+		if (field[0] & 0x40)
+			return -1;
+		long long value = field[0] & 0x3f;
+		for (size_t i = 1; i < len; i++){
+			if (value > (TAR_MAX_DATA >> 8))
+				return -1;
+			value = (value << 8) | (unsigned char) field[i];
+		}
+		return value;
+	}
+	long long value = 0;
+	for (size_t i = 0; i < len && field[i] != '\0'; i++)
+		if (field[i] >= '0' && field[i] <= '7')
+			value = value * 8 + (field[i] - '0');
+	return value;
+}
+
+static unsigned int checksum(const tar_header& header){
+	const unsigned char * bytes = (const unsigned char *) &header;
+	unsigned int sum = 0;
+	for (size_t i = 0; i < sizeof(header); i++)
+		sum += (i >= offsetof(tar_header, chksum) && i < offsetof(tar_header, chksum) + 8) ? ' ' : bytes[i];
+	return sum;
+}
+
+// Function to report a malformed stream
+static bool malformed(const char * what, bool * flag){
+	std::cerr << "Malformed input stream: " << what << std::endl;
+	if (flag)
+		*flag = true;
+	return false;
+}
+
+// Function to check a size read from the stream: not negative, at most max and, when the input is a regular
+// file, at most what is left of it
+static bool size_ok(std::FILE * in, long long size, long long max){
+	if (size < 0 || size > max)
+		return false;
+	struct stat st;
+	long pos = std::ftell(in);
+	return fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode) || pos < 0 || size <= st.st_size - pos;
+}
+
+// Function to read size bytes, growing the buffer as they arrive
+static bool read_exact(std::FILE * in, long long size, std::vector<unsigned char> * data){
+	data -> clear();
+	while ((long long) data -> size() < size){
+		size_t at = data -> size(), step = std::min((long long) READ_STEP, size - (long long) at);
+		data -> resize(at + step);
+		if (std::fread(data -> data() + at, 1, step, in) != step)
+			return false;
+	}
+	return true;
+}
+
+static bool read_data(std::FILE * in, long long size, std::vector<unsigned char> * data){
+	if (!read_exact(in, size, data))
+		return false;
+	char pad[TAR_BLOCK];
+	size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	return padding == 0 || std::fread(pad, 1, padding, in) == padding;
+}
+
+static bool write_padded(std::FILE * out, const void * data, size_t size){
+	static const char zeros[TAR_BLOCK] = {0};
+	size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	return std::fwrite(data, 1, size, out) == size && std::fwrite(zeros, 1, padding, out) == padding;
+}
+
+static bool write_header(std::FILE * out, const std::string& name, const std::string& link, char type, unsigned int mode, long long mtime, size_t size){
+	tar_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::strncpy(header.name, &name[0u], sizeof(header.name));
+	std::strncpy(header.linkname, &link[0u], sizeof(header.linkname));
+	std::snprintf(header.mode, sizeof(header.mode), "%07o", mode & 07777);
+	std::snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+	std::snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+	std::snprintf(header.size, sizeof(header.size), "%011llo", (unsigned long long) size);
+	std::snprintf(header.mtime, sizeof(header.mtime), "%011llo", (unsigned long long) mtime);
+	header.typeflag = type;
+	std::memcpy(header.magic, "ustar", 6);
+	std::memcpy(header.version, "00", 2);
+	std::snprintf(header.chksum, sizeof(header.chksum), "%06o", checksum(header));
+	header.chksum[7] = ' ';
+	return std::fwrite(&header, 1, sizeof(header), out) == sizeof(header);
+}
+
+// Function to read the next entry of a tar stream, returns false at the end of the archive or on error
+bool tar_read(std::FILE * in, tar_entry * entry, bool * bad){
+	std::string long_name, long_link;
+	while (true){
+		tar_header header;
+		size_t got = std::fread(&header, 1, sizeof(header), in);
+		if (got == 0 && long_name.empty() && long_link.empty())
+			return false;	// end of the stream without the end of archive marker
+		if (got != sizeof(header))
+			return malformed("truncated tar header", bad);
+		if (header.name[0] == '\0')
+			return false;	// end of archive marker
+		if (parse_octal(header.chksum, sizeof(header.chksum)) != checksum(header))
+			return malformed("invalid tar header checksum", bad);
+		long long size = parse_octal(header.size, sizeof(header.size));
+		bool meta = header.typeflag == 'L' || header.typeflag == 'K' || header.typeflag == 'x' || header.typeflag == 'g';
+		if (!size_ok(in, size, meta ? TAR_MAX_META : TAR_MAX_DATA))
+			return malformed("invalid tar entry size", bad);
+		std::vector<unsigned char> data;
+		if (!read_data(in, size, &data))
+			return malformed("truncated tar entry", bad);
+
+		// GNU long name, applies to the next entry
+		if (header.typeflag == 'L'){
+			long_name.assign(data.begin(), data.end());
+			long_name = long_name.c_str();
+			continue;
+		}
+		// GNU long link target, applies to the next entry
+		if (header.typeflag == 'K'){
+			long_link.assign(data.begin(), data.end());
+			long_link = long_link.c_str();
+			continue;
+		}
+		// Pax extended header, only the path and the link target are kept
+		if (header.typeflag == 'x'){
+			std::string records(data.begin(), data.end());
+			size_t pos = 0;
+			while (pos < records.size()){
+				// Each record is "<length> <key>=<value>\n", the length counting the whole record
+				size_t len = strtoul(&records[pos], nullptr, 10);
+				if (len == 0)
+					break;
+				if (len > records.size() - pos)
+					return malformed("pax record past the end of the header", bad);
+				std::string record = records.substr(pos, len);
+				size_t space = record.find(' '), eq = record.find('=');
+				if (space == std::string::npos || eq == std::string::npos || eq < space || record.back() != '\n')
+					return malformed("invalid pax record", bad);
+				std::string key = record.substr(space + 1, eq - space - 1), value = record.substr(eq + 1, len - eq - 2);
+				if (key == "path")
+					long_name = value;
+				if (key == "linkpath")
+					long_link = value;
+				pos += len;
+			}
+			continue;
+		}
+		if (header.typeflag == 'g')
+			continue;
+
+		if (!long_name.empty())
+			entry -> name = long_name;
+		else{
+			std::string name(header.name, strnlen(header.name, sizeof(header.name)));
+			std::string prefix(header.prefix, strnlen(header.prefix, sizeof(header.prefix)));
+			entry -> name = std::memcmp(header.magic, "ustar", 5) == 0 && !prefix.empty() ? prefix + "/" + name : name;
+		}
+		entry -> link = !long_link.empty() ? long_link : std::string(header.linkname, strnlen(header.linkname, sizeof(header.linkname)));
+		entry -> type = header.typeflag == '\0' ? '0' : header.typeflag;
+		entry -> mode = parse_octal(header.mode, sizeof(header.mode));
+		entry -> mtime = parse_octal(header.mtime, sizeof(header.mtime));
+		entry -> data.swap(data);
+		return true;
+	}
+}
+
+// Function to write an entry to a tar stream
+bool tar_write(std::FILE * out, const tar_entry& entry){
+	// Names and link targets that don't fit the header go in GNU long name entries
+	if (entry.link.size() >= 100){
+		if (!write_header(out, "././@LongLink", "", 'K', 0644, 0, entry.link.size() + 1) ||
+			!write_padded(out, entry.link.c_str(), entry.link.size() + 1))
+			return false;
+	}
+	if (entry.name.size() >= 100){
+		if (!write_header(out, "././@LongLink", "", 'L', 0644, 0, entry.name.size() + 1) ||
+			!write_padded(out, entry.name.c_str(), entry.name.size() + 1))
+			return false;
+	}
+	return write_header(out, entry.name, entry.link, entry.type, entry.mode, entry.mtime, entry.data.size()) &&
+		write_padded(out, entry.data.data(), entry.data.size());
+}
+
+// Function to write the end of archive marker of a tar stream
+bool tar_finish(std::FILE * out){
+	static const char zeros[2 * TAR_BLOCK] = {0};
+	return std::fwrite(zeros, 1, sizeof(zeros), out) == sizeof(zeros) && std::fflush(out) == 0;
+}
+
+static bool read_be(std::FILE * in, int bytes, unsigned long long * value){
+	unsigned char buffer[8];
+	if (std::fread(buffer, 1, bytes, in) != (size_t) bytes)
+		return false;
+	*value = 0;
+	for (int i = 0; i < bytes; i++)
+		*value = (*value << 8) | buffer[i];
+	return true;
+}
+
+static bool write_be(std::FILE * out, int bytes, unsigned long long value){
+	unsigned char buffer[8];
+	for (int i = bytes - 1; i >= 0; i--, value >>= 8)
+		buffer[i] = value & 0xff;
+	return std::fwrite(buffer, 1, bytes, out) == (size_t) bytes;
+}
+
+// Function to read the next length-prefixed frame, returns false at the end of the stream or on error
+bool frame_read(std::FILE * in, tar_entry * entry, bool * bad){
+	unsigned long long name_len, size;
+	int c = std::fgetc(in);
+	if (c == EOF)
+		return false;	// end of the stream
+	std::ungetc(c, in);
+	if (!read_be(in, 4, &name_len))
+		return malformed("truncated frame header", bad);
+	if (!size_ok(in, name_len, TAR_MAX_META))
+		return malformed("invalid frame name length", bad);
+	std::vector<unsigned char> name;
+	if (!read_exact(in, name_len, &name) || !read_be(in, 8, &size))
+		return malformed("truncated frame header", bad);
+	if (!size_ok(in, size, TAR_MAX_DATA))
+		return malformed("invalid frame size", bad);
+	if (!read_exact(in, size, &entry -> data))
+		return malformed("truncated frame", bad);
+	entry -> name.assign(name.begin(), name.end());
+	entry -> type = '0';
+	entry -> link.clear();
+	entry -> mode = 0644;
+	entry -> mtime = std::time(nullptr);
+	return true;
+}
+
+// Function to write a length-prefixed frame
+bool frame_write(std::FILE * out, const tar_entry& entry){
+	return write_be(out, 4, entry.name.size()) && std::fwrite(entry.name.data(), 1, entry.name.size(), out) == entry.name.size() &&
+		write_be(out, 8, entry.data.size()) && std::fwrite(entry.data.data(), 1, entry.data.size(), out) == entry.data.size();
+}
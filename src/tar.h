@@ -0,0 +1,46 @@
+#ifndef __TAR_H__
+#define __TAR_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/***
+	Sequential reader and writer of tar streams (ustar, with GNU and pax long names on input) and of
+	length-prefixed frames, used to stream images through stdin/stdout.
+	A frame is a 4 bytes big endian name length, the name, an 8 bytes big endian data length and the data.
+	Sizes read from the stream are checked before anything is allocated: negative sizes, sizes over the caps
+	below and (for regular files) sizes over what is left of the input make the stream malformed.
+***/
+
+#define TAR_MAX_META (1LL << 20)	// Longest name, link target or pax header
+#define TAR_MAX_DATA (1LL << 36)	// Largest entry (64 GB)
+
+// Data structure defining an entry of a stream
+struct tar_entry{
+	std::string name;
+	char type;		// tar type flag, '0' for regular files
+	unsigned int mode;
+	long long mtime;
+	std::string link;	// target of links
+	std::vector<unsigned char> data;
+};
+
+// Function to read the next entry of a tar stream, returns false at the end of the archive or on error,
+// setting bad (if given) when the stream is malformed
+bool tar_read(std::FILE * in, tar_entry * entry, bool * bad = nullptr);
+
+// Function to write an entry to a tar stream
+bool tar_write(std::FILE * out, const tar_entry& entry);
+
+// Function to write the end of archive marker of a tar stream
+bool tar_finish(std::FILE * out);
+
+// Function to read the next length-prefixed frame, returns false at the end of the stream or on error,
+// setting bad (if given) when the stream is malformed
+bool frame_read(std::FILE * in, tar_entry * entry, bool * bad = nullptr);
+
+// Function to write a length-prefixed frame
+bool frame_write(std::FILE * out, const tar_entry& entry);
+
+#endif
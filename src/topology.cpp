@@ -0,0 +1,204 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include "topology.h"
+
+// Function to read the first line of a file, returns false if it can't be read
+static bool read_line(const std::string& path, std::string * line){
+	std::ifstream file(path);
+	return file && std::getline(file, *line);
+}
+
+// Function to read an integer from a file, def if it can't be read
+static int read_int(const std::string& path, int def){
+	std::string line;
+	if (!read_line(path, &line) || line.empty())
+		return def;
+	return atoi(line.c_str());
+}
+
+// Get a CPU by number, nullptr if it is not available
+const cpu_info * topology::find(int cpu) const{
+	for (const cpu_info& info : cpus)
+		if (info.cpu == cpu)
+			return &info;
+	return nullptr;
+}
+
+// Function to parse a placement policy: none, spread or smt, returns false if it is not valid
+bool parse_pin_policy(const char * name, pin_policy * policy){
+	std::string s(name);
+	if (s == "none")
+		*policy = PIN_NONE;
+	else if (s == "spread")
+		*policy = PIN_SPREAD;
+	else if (s == "smt")
+		*policy = PIN_SMT;
+	else
+		return false;
+	return true;
+}
+
+// Function to parse a sysfs CPU list (e.g. "0-3,8-11")
+std::vector<int> parse_cpu_list(const std::string& list){
+	std::vector<int> cpus;
+	std::stringstream ranges(list);
+	std::string range;
+	while (std::getline(ranges, range, ',')){
+		char * end;
+		long first = strtol(range.c_str(), &end, 10), last = first;
+		if (end == range.c_str())
+			continue;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+// Function to read the topology of the CPUs the process is allowed to run on
+topology read_topology(){
+	topology topo;
+	topo.n_nodes = 1;
+
+	// The allowed CPUs honour taskset and cpusets, the online ones are the fallback
+	std::vector<int> allowed;
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 18, "Cpus_allowed_list:") == 0)
+			allowed = parse_cpu_list(line.substr(line.find_first_not_of(" \t", 18)));
+	if (allowed.empty() && read_line("/sys/devices/system/cpu/online", &line))
+		allowed = parse_cpu_list(line);
+
+	// Nodes are numbered in order of their sysfs number, without NUMA every CPU is on node 0
+	std::vector<int> node_of;
+	if (read_line("/sys/devices/system/node/online", &line)){
+		std::vector<int> nodes = parse_cpu_list(line);
+		for (unsigned int n = 0; n < nodes.size(); n++){
+			std::string list;
+			if (!read_line("/sys/devices/system/node/node" + std::to_string(nodes[n]) + "/cpulist", &list))
+				continue;
+			for (int cpu : parse_cpu_list(list)){
+				if ((int) node_of.size() <= cpu)
+					node_of.resize(cpu + 1, 0);
+				node_of[cpu] = n;
+			}
+		}
+	}
+
+	for (int cpu : allowed){
+		std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		cpu_info info;
+		info.cpu = cpu;
+		info.core = read_int(dir + "core_id", cpu);
+		info.package = read_int(dir + "physical_package_id", 0);
+		info.node = cpu < (int) node_of.size() ? node_of[cpu] : 0;
+		if (read_line(dir + "thread_siblings_list", &line))
+			info.siblings = parse_cpu_list(line);
+		// Siblings the process can't run on are of no use
+		info.siblings.erase(std::remove_if(info.siblings.begin(), info.siblings.end(), [&](int s){
+			return std::find(allowed.begin(), allowed.end(), s) == allowed.end();
+		}), info.siblings.end());
+		if (info.siblings.empty())
+			info.siblings.push_back(cpu);
+		std::sort(info.siblings.begin(), info.siblings.end());
+		topo.cpus.push_back(info);
+	}
+
+	// Only the nodes holding allowed CPUs are counted, renumbered from 0
+	std::vector<int> used;
+	for (const cpu_info& info : topo.cpus)
+		if (std::find(used.begin(), used.end(), info.node) == used.end())
+			used.push_back(info.node);
+	std::sort(used.begin(), used.end());
+	for (cpu_info& info : topo.cpus)
+		info.node = std::find(used.begin(), used.end(), info.node) - used.begin();
+	topo.n_nodes = std::max(1, (int) used.size());
+	return topo;
+}
+
+// Function to place the workers, every worker is unpinned with PIN_NONE
+affinity_plan plan_affinity(const topology& topo, pin_policy policy, int n_compute, int n_io){
+	affinity_plan plan;
+	plan.n_nodes = 1;
+	if (policy == PIN_NONE || topo.cpus.empty()){
+		plan.compute.assign(n_compute, cpu_slot{-1, 0});
+		plan.io.assign(n_io, cpu_slot{-1, 0});
+		return plan;
+	}
+	plan.n_nodes = topo.n_nodes;
+
+	// CPUs of each node: the first thread of every core, then the other threads of the cores
+	std::vector<std::vector<int>> local(topo.n_nodes);
+	std::vector<int> cores(topo.n_nodes, 0);
+	for (const cpu_info& info : topo.cpus)
+		if (info.siblings[0] == info.cpu){
+			local[info.node].push_back(info.cpu);
+			cores[info.node] += 1;
+		}
+	for (const cpu_info& info : topo.cpus)
+		if (info.siblings[0] != info.cpu)
+			local[info.node].push_back(info.cpu);
+
+	// Compute workers go round robin over the nodes, one per core, the smt policy keeps the siblings for I/O
+	std::vector<cpu_slot> order;
+	for (unsigned int k = 0; order.size() < topo.cpus.size(); k++){
+		unsigned int before = order.size();
+		for (int n = 0; n < topo.n_nodes; n++)
+			if (k < local[n].size() && (policy != PIN_SMT || (int) k < cores[n]))
+				order.push_back(cpu_slot{local[n][k], n});
+		if (order.size() == before)
+			break;
+	}
+	std::vector<int> taken(topo.n_nodes, 0);
+	for (int i = 0; i < n_compute; i++){
+		plan.compute.push_back(order[i % order.size()]);
+		taken[plan.compute.back().node] += 1;
+	}
+
+	// I/O workers stay on the node of the compute worker they go with
+	std::vector<int> io_taken(topo.n_nodes, 0);
+	for (int i = 0; i < n_io && n_compute > 0; i++){
+		cpu_slot with = plan.compute[i % n_compute];
+		if (policy == PIN_SMT){
+			// The other threads of the core in turn, the core itself without SMT
+			std::vector<int> others = topo.find(with.cpu) -> siblings;
+			others.erase(std::find(others.begin(), others.end(), with.cpu));
+			plan.io.push_back(cpu_slot{others.empty() ? with.cpu : others[(i / n_compute) % others.size()], with.node});
+		}
+		else{
+			// The first CPU of the node not taken by compute workers, wrapping around
+			const std::vector<int>& cpus = local[with.node];
+			plan.io.push_back(cpu_slot{cpus[(taken[with.node] + io_taken[with.node]++) % cpus.size()], with.node});
+		}
+	}
+	return plan;
+}
+
+// Function to describe a placement (e.g. "compute 0 2 | io 1 3 | 1 NUMA nodes")
+std::string describe_plan(const affinity_plan& plan){
+	std::stringstream s;
+	s << "compute";
+	for (const cpu_slot& slot : plan.compute)
+		s << " " << slot.cpu;
+	s << " | io";
+	for (const cpu_slot& slot : plan.io)
+		s << " " << slot.cpu;
+	s << " | " << plan.n_nodes << " NUMA nodes";
+	return s.str();
+}
+
+// Function to pin the calling thread to a CPU, nothing to do for -1, returns false if it failed
+bool pin_self(int cpu){
+	if (cpu < 0)
+		return true;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+}
@@ -0,0 +1,69 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <string>
+#include <vector>
+
+/***
+	CPU topology of the host read from sysfs (cores, SMT siblings, NUMA nodes) and /proc (CPUs the process is
+	allowed to run on), and placement of the workers of the pipelines on it.
+	Compute workers are spread one per physical core, round robin over the NUMA nodes. I/O workers (loading and
+	saving) stay on the node of the compute worker they feed, either on cores of their own (spread) or on the SMT
+	siblings of the compute workers (smt), so that decoding and encoding fill the pipeline bubbles of marking.
+	Memory follows the threads: Linux places a page on the node of the thread touching it first, so an image
+	decoded by a pinned loader is allocated on the node of the loader.
+***/
+
+// Placement policies of the workers
+enum pin_policy {PIN_NONE, PIN_SPREAD, PIN_SMT};
+
+// Data structure defining a logical CPU (node is the index in topology::n_nodes, not the sysfs number)
+struct cpu_info{
+	int cpu;
+	int core;
+	int package;
+	int node;
+	std::vector<int> siblings;	// SMT siblings sharing the physical core, this CPU included, sorted
+};
+
+// Data structure defining the CPUs the process is allowed to run on
+struct topology{
+	std::vector<cpu_info> cpus;
+	int n_nodes;
+
+	// Get a CPU by number, nullptr if it is not available
+	const cpu_info * find(int cpu) const;
+};
+
+// Data structure defining where a worker runs, cpu is -1 for an unpinned worker (node 0)
+struct cpu_slot{
+	int cpu;
+	int node;
+};
+
+// Data structure defining the placement of the compute and I/O workers, io[i] is on the node of compute[i % compute.size()]
+struct affinity_plan{
+	std::vector<cpu_slot> compute;
+	std::vector<cpu_slot> io;
+	int n_nodes;
+};
+
+// Function to parse a placement policy: none, spread or smt, returns false if it is not valid
+bool parse_pin_policy(const char * name, pin_policy * policy);
+
+// Function to parse a sysfs CPU list (e.g. "0-3,8-11")
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// Function to read the topology of the CPUs the process is allowed to run on
+topology read_topology();
+
+// Function to place the workers, every worker is unpinned with PIN_NONE
+affinity_plan plan_affinity(const topology& topo, pin_policy policy, int n_compute, int n_io);
+
+// Function to describe a placement (e.g. "compute 0 2 | io 1 3 | 1 NUMA nodes")
+std::string describe_plan(const affinity_plan& plan);
+
+// Function to pin the calling thread to a CPU, nothing to do for -1, returns false if it failed
+bool pin_self(int cpu);
+
+#endif
@@ -0,0 +1,112 @@
+#include "watcher.h"
+#include "my_utils.h"
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <climits>
+
+dir_watcher::dir_watcher(int debounce_ms) : m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), m_stop_pipe{-1, -1}, m_debounce(debounce_ms){
+	if (m_fd < 0){
+		std::cerr << "Error initializing inotify: " << strerror(errno) << std::endl;
+		return;
+	}
+	if (pipe(m_stop_pipe) != 0){
+		std::cerr << "Error creating the stop pipe: " << strerror(errno) << std::endl;
+		m_stop_pipe[0] = m_stop_pipe[1] = -1;
+	}
+}
+
+dir_watcher::~dir_watcher(){
+	if (m_fd >= 0)
+		close(m_fd);
+	if (m_stop_pipe[0] >= 0)
+		close(m_stop_pipe[0]);
+	if (m_stop_pipe[1] >= 0)
+		close(m_stop_pipe[1]);
+}
+
+// Function to check that inotify and the stop pipe were set up
+bool dir_watcher::ok() const{
+	return m_fd >= 0 && m_stop_pipe[0] >= 0 && m_stop_pipe[1] >= 0;
+}
+
+// Start watching a directory (non recursively), returns false on failure
+bool dir_watcher::add(const std::string& dir){
+	int wd = inotify_add_watch(m_fd, &dir[0u], IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0){
+		std::cerr << "Error watching " << dir << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	m_dirs[wd] = strendswith(&dir[0u], "/") ? dir : dir + "/";
+	return true;
+}
+
+// Wait for the next settled file, returns false once the watcher has been stopped
+bool dir_watcher::next(std::string * path, std::chrono::steady_clock::time_point * landed){
+	while (true){
+		// Hand out the settled file that landed first
+		auto now = std::chrono::steady_clock::now();
+		auto settled = m_pending.end();
+		auto wake_up = now + std::chrono::hours(1);
+		for (auto it = m_pending.begin(); it != m_pending.end(); ++it){
+			auto ready_at = it -> second.last + m_debounce;
+			if (ready_at <= now){
+				if (settled == m_pending.end() || it -> second.landed < settled -> second.landed)
+					settled = it;
+			}
+			else if (ready_at < wake_up)
+				wake_up = ready_at;
+		}
+		if (settled != m_pending.end()){
+			*path = settled -> first;
+			*landed = settled -> second.landed;
+			m_pending.erase(settled);
+			return true;
+		}
+
+		// Wait for new events or for the next file to settle
+		struct pollfd fds[2];
+		fds[0].fd = m_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = m_stop_pipe[0];
+		fds[1].events = POLLIN;
+		int timeout = m_pending.empty() ? -1 :
+			std::chrono::duration_cast<std::chrono::milliseconds>(wake_up - now).count() + 1;
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR){
+			std::cerr << "Error waiting for inotify events: " << strerror(errno) << std::endl;
+			return false;
+		}
+		if (fds[1].revents & POLLIN)
+			return false;
+		if ((fds[0].revents & POLLIN) && !read_events())
+			return false;
+	}
+}
+
+// Stop the watcher, safe to be called from a signal handler
+void dir_watcher::stop(){
+	char c = 0;
+	if (m_stop_pipe[1] < 0 || write(m_stop_pipe[1], &c, 1) < 0)
+		return;
+}
+
+bool dir_watcher::read_events(){
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (true){
+		ssize_t len = read(m_fd, buffer, sizeof(buffer));
+		if (len < 0)
+			return errno == EAGAIN || errno == EINTR;
+		auto now = std::chrono::steady_clock::now();
+		for (char * p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p) -> len){
+			struct inotify_event * event = (struct inotify_event *) p;
+			if (event -> len == 0 || (event -> mask & IN_ISDIR) || !strendswith(event -> name, ".jpg"))
+				continue;
+			std::string path = m_dirs[event -> wd] + event -> name;
+			auto it = m_pending.find(path);
+			if (it == m_pending.end())
+				m_pending[path] = pending_file{now, now};
+			else
+				it -> second.last = now;
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef __WATCHER_H__
+#define __WATCHER_H__
+
+#include <string>
+#include <map>
+#include <chrono>
+
+/***
+	Watches directories with inotify and hands out the .jpg files that land in them.
+	A file is handed out once it has been closed after writing (or moved in) and no further event
+	arrived for it during the debounce interval, so files written in several passes are picked up once.
+***/
+
+class dir_watcher{
+public:
+	dir_watcher(int debounce_ms);
+	~dir_watcher();
+
+	// Check that the watcher was set up, it can't be used otherwise
+	bool ok() const;
+
+	// Start watching a directory (non recursively), returns false on failure
+	bool add(const std::string& dir);
+
+	// Wait for the next settled file, returns false once the watcher has been stopped
+	bool next(std::string * path, std::chrono::steady_clock::time_point * landed);
+
+	// Stop the watcher, safe to be called from a signal handler
+	void stop();
+
+private:
+	int m_fd;
+	int m_stop_pipe[2];
+	std::chrono::milliseconds m_debounce;
+	std::map<int, std::string> m_dirs;	// watch descriptor -> directory
+	struct pending_file{
+		std::chrono::steady_clock::time_point landed;	// first event
+		std::chrono::steady_clock::time_point last;		// last event
+	};
+	std::map<std::string, pending_file> m_pending;
+
+	bool read_events();
+};
+
+#endif
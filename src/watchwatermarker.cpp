@@ -0,0 +1,209 @@
+/***
+	Long running version of the program using standard c++ mechanisms only.
+	The source directories are watched with inotify and the images are marked as soon as they land,
+	by a load-mark-save pipeline that is kept warm for the whole run. Stop it with SIGINT or SIGTERM.
+***/
+#include <dirent.h>
+#include <csignal>
+#include "pipeline.h"
+#include "watcher.h"
+
+dir_watcher * watcher = nullptr;
+
+// Stop watching on SIGINT/SIGTERM, the images already submitted are still processed
+void stop_watching(int){
+	if (watcher)
+		watcher -> stop();
+}
+
+int main(int argc, char* argv[]){
+
+	std::vector<std::string> src_paths;
+	std::string wmark_file;
+	int wflag = -1, mflag = -1, dflag = -1, eflag = -1;
+	int c, n_workers = 1, n_chunks = 0, debounce = 200, period = 0;
+	pin_policy pinning = PIN_NONE;
+	float intensity = 0.3;
+	char * end;
+	const char * USAGE = "Usage -s <src_path> [-s <src_path> ...] -w <watermark_file> -i <intensity> -c <chunks> -n <parallelism degree> -t <debounce> -a <affinity> -r <period> [-e] [-m] [-d]\n"
+	"-s src_path --- Directory to be watched for images to be watermarked, can be given more than once\n"
+	"-w watermark_file --- Path of the watermark to be used\n"
+	"-c chunks --- Number of chunks to divide each image in, defaults to parallelism degree\n"
+	"-n parallelism degree --- Parallelism degree to be used for each stage\n"
+	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-t debounce --- Msecs without events after which a written file is considered complete, defaults to 200\n"
+	"-a affinity --- Pin the threads: none (default), spread (one per core, round robin over the NUMA nodes, loaders and savers on the node of their marker) or smt (loaders and savers on the SMT siblings of the markers)\n"
+	"-r period --- Rebalance the 3 x parallelism degree workers between the stages every period msecs, following the queues and the busy time of the stages\n"
+	"-e --- Also mark the images already in the directories when starting\n"
+	"-m --- Incremental mode, skip the images already marked with the same watermark and intensity\n"
+	"-d --- Dedupe mode, byte-identical images are marked once and their output is linked from a cache\n";
+
+	// Parse command line arguments
+	while ((c = getopt (argc, argv, "s:w:n:i:c:t:a:r:emd")) != -1)
+		switch (c){
+			case 's':
+				src_paths.push_back(strendswith(optarg, "/") ? std::string(optarg) : std::string(optarg) + "/");
+				mkdir(&(src_paths.back()+"watermarked")[0u], 0700);
+				break;
+			case 'w':
+				wflag = 1;
+				wmark_file = optarg;
+				break;
+			case 'n':
+				n_workers = strtol(optarg, &end, 10);
+				if (*end != '\0' || n_workers <= 0) {
+					std::cerr << "Invalid number of workers.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'c':
+				n_chunks = strtol(optarg, &end, 10);
+				if (*end != '\0' || n_chunks <= 0) {
+					std::cerr << "Invalid number of chunks.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 't':
+				debounce = strtol(optarg, &end, 10);
+				if (*end != '\0' || debounce < 0) {
+					std::cerr << "Invalid debounce.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'i':
+				intensity = strtol(optarg, &end, 10);
+				if (*end != '\0') {
+					std::cerr << "Invalid intensity.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				intensity = intensity/100;
+				if (intensity < 0 or intensity > 1){
+					intensity = 0.3;
+					std::cout << "Intensity set to default " << intensity << " cause given value was out of range (0,100)" << std::endl;
+				}
+				break;
+			case 'r':
+				period = strtol(optarg, &end, 10);
+				if (*end != '\0' || period <= 0) {
+					std::cerr << "Invalid rebalancing period.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'a':
+				if (!parse_pin_policy(optarg, &pinning)) {
+					std::cerr << "Invalid affinity.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'e':
+				eflag = 1;
+				break;
+			case 'm':
+				mflag = 1;
+				break;
+			case 'd':
+				dflag = 1;
+				break;
+			case '?':
+				std::cerr << USAGE << std::endl;
+				return 1;
+			default:
+				exit(1);
+		}
+
+	// Make sure all the required paths have been set
+	if (src_paths.empty() || wflag == -1){
+		std::cerr << USAGE << std::endl;
+		return 1;
+	}
+
+	// Load the watermark
+	cimg_library::CImg<float> * wmark = new cimg_library::CImg<float>;
+	try{
+		wmark -> load(&(wmark_file)[0u]);
+	}catch (const cimg_library::CImgIOException& e) {
+		std::cerr << "Error loading watermark " << wmark_file << ": " << e.what() << "\nExiting.." << std::endl;
+		exit(1);
+	}
+	std::cout << "Watermark size: (" << wmark -> width() <<", " << wmark -> height() << ")" << std::endl;
+	prepared_wmark * prepared = prepare_wmark(wmark);
+	std::cout << "Watermark tiles: " << prepared -> n_empty << " empty, " << prepared -> n_full << " full, " << prepared -> n_mixed << " mixed" << std::endl;
+
+	// If number of chunks has not been specified then set it to the parallelism degree
+	if(n_chunks == 0)
+		n_chunks = n_workers;
+
+	// Manifest and cache live in the first source directory, they are keyed by full paths and content
+	manifest * done_manifest = nullptr;
+	output_cache * dedupe_cache = nullptr;
+	if (mflag == 1)
+		done_manifest = open_manifest(src_paths[0], wmark_file, intensity);
+	if (dflag == 1)
+		dedupe_cache = open_cache(src_paths[0], wmark_file, intensity, done_manifest);
+
+	// Start watching before scanning, so that no image falls in between
+	watcher = new dir_watcher(debounce);
+	if (!watcher -> ok()){
+		std::cerr << "Exiting.." << std::endl;
+		exit(1);
+	}
+	for (std::string& src_path : src_paths)
+		if (!watcher -> add(src_path)){
+			std::cerr << "Exiting.." << std::endl;
+			exit(1);
+		}
+	signal(SIGINT, stop_watching);
+	signal(SIGTERM, stop_watching);
+
+	mark_pipeline pipeline(prepared, intensity, n_workers, n_workers, n_workers, n_chunks);
+	pipeline.set_manifest(done_manifest);
+	pipeline.set_cache(dedupe_cache);
+	pipeline.set_rebalance(period);
+	if (pinning != PIN_NONE){
+		affinity_plan plan = plan_affinity(read_topology(), pinning, n_workers, 2 * n_workers);
+		std::cout << "Pinned threads: " << describe_plan(plan) << std::endl;
+		pipeline.set_affinity(plan);
+	}
+	pipeline.start();
+
+	if (eflag == 1)
+		for (std::string& src_path : src_paths){
+			DIR * dirp = opendir(&src_path[0u]);
+			if (!dirp){
+				std::cerr << "Failed to open directory "<< src_path << std::endl;
+				continue;
+			}
+			struct dirent * directory;
+			while ((directory = readdir(dirp)) != NULL)
+				if (strendswith(directory->d_name, ".jpg"))
+					pipeline.submit(src_path+directory->d_name, src_path+"watermarked/"+directory->d_name, std::chrono::steady_clock::now());
+			closedir(dirp);
+		}
+
+	std::cout << "Watching " << src_paths.size() << " directories" << std::endl;
+	std::string path;
+	ingest_time landed;
+	while (watcher -> next(&path, &landed)){
+		size_t slash = path.find_last_of('/');
+		pipeline.submit(path, path.substr(0, slash+1)+"watermarked/"+path.substr(slash+1), landed);
+	}
+
+	std::cout << "Stopping.." << std::endl;
+	pipeline.stop();
+	pipeline.report();
+	if (dedupe_cache){
+		dedupe_cache -> report();
+		delete(dedupe_cache);
+	}
+	delete(done_manifest);
+	delete(watcher);
+	delete(prepared);
+	delete(wmark);
+	return 0;
+}
@@ -6,6 +6,13 @@
 #include <climits>
 #include "queue.h"
 #include "my_utils.h"
+#include "manifest.h"
+#include "cache.h"
+#include "region.h"
+#include "fused.h"
+#include "rendition.h"
+#include "topology.h"
+#include "guided.h"
 
 std::atomic<int> processed;
 
@@ -19,61 +26,174 @@ struct load_task {
 // Define the saving tasks (i.e. pointer to image and path to save it in)
 struct save_task{
 	std::string save_path;
+	std::string load_path;
+	uint64_t cache_key;
 	cimg_library::CImg<float> * img;
 };
 
 
 // Watermark
 cimg_library::CImg<float> * wmark;
+prepared_wmark * prepared;
+
+// Manifest of the already processed images (only in incremental mode)
+manifest * done_manifest = nullptr;
+
+// Cache of the outputs of byte-identical images (only in dedupe mode)
+output_cache * dedupe_cache = nullptr;
+
+// Placement of the watermark, tiled over the whole image unless given
+placement place = {PLACE_TILE, 0, 0};
+
+// Fused mode, images are decoded, marked and encoded one band of scanlines at a time
+bool fused = false;
+
+// Fixed point blend of the 8 bit samples (fused and banded modes)
+bool fixed = false;
+
+// Renditions published from each decoded image (only in rendition mode)
+std::vector<rendition> renditions;
+std::atomic<int> rendered;
+
+// Placement of the workers, the queues after the loading stage are one per NUMA node so that an image is
+// marked and saved on the node it has been decoded (and allocated) on
+pin_policy pinning = PIN_NONE;
+affinity_plan plan;
 
-queue<struct task *> tasks_queue;// Queue for marking tasks
+// Guided scheduling of the rows of the loaded images, one per NUMA node (only in guided mode)
+bool guided = false;
+std::vector<guided_rows *> guided_nodes;
+
+// Chunks are batched into work items of at least batch_pixels pixels, each loader fills its own batch
+long batch_pixels = 0;
+thread_local task_batch * open_batch = nullptr;
+
+// Save tasks popped at once by the savers
+#define SAVE_POP_MANY 16
+
+queue<struct task_batch *> * tasks_queue;// Queues for marking tasks
+queue<struct render_task *> * render_queue; // Queues for rendering tasks
 queue<struct load_task *> load_queue; // Queue for loading tasks
-queue<struct save_task *> save_queue; // Queue for saving tasks
+queue<struct save_task *> * save_queue; // Queues for saving tasks
+
 
+// Push the batch of the loader into the tasks_queue of the node
+void flush_batch(int node){
+	if (open_batch)
+		tasks_queue[node].push(open_batch);
+	open_batch = nullptr;
+}
 
-// Load an image, split into chunks and push into the tasks_queue
-void load_and_chunk(std::string path, int n_chunks, std::string save_path){
+// Load an image, split into chunks and push into the tasks_queue of the node
+void load_and_chunk(std::string path, int n_chunks, std::string save_path, float intensity, int node){
+
+	// Identical images are marked only once
+	uint64_t key = 0;
+	if (dedupe_cache && dedupe_cache -> fetch(path, save_path, &key) != CACHE_MISS)
+		return;
+
+	// With a placement only the blocks under the watermark are decoded, in fused mode the image is never
+	// materialised: either way the whole image is done here
+	if (place.mode != PLACE_TILE || fused){
+		try{
+			if (place.mode != PLACE_TILE)
+				mark_region_file(path, save_path, wmark, intensity, place);
+			else
+				mark_fused_file(path, save_path, prepared, intensity);
+			processed += 1;
+			if (done_manifest)
+				done_manifest -> record(path, save_path);
+			if (dedupe_cache)
+				dedupe_cache -> store(key, save_path);
+		}catch (const cimg_library::CImgIOException& e) {
+			std::cerr << "Error marking image " << path << ": " << e.what() << std::endl;
+			if (dedupe_cache)
+				dedupe_cache -> abort(key);
+		}
+		return;
+	}
+
+	// In rendition mode the image, decoded at the scale the largest rendition needs, is fanned out to one
+	// rendering task per rendition
+	if (!renditions.empty()){
+		try{
+			shared_source * source = decode_source(path, renditions);
+			std::string name = save_path.substr(save_path.rfind('/') + 1);
+			for (const rendition& r : renditions){
+				render_task * rt = new render_task;
+				rt -> source = source;
+				rt -> target = &r;
+				rt -> save_path = save_path.substr(0, save_path.rfind('/') + 1) + r.name + "/" + name;
+				render_queue[node].push(rt);
+			}
+		}catch (const cimg_library::CImgIOException& e) {
+			std::cerr << "Error reading image " << path << ": " << e.what() << std::endl;
+		}
+		return;
+	}
 
 	// Open the img
 	cimg_library::CImg<float> * img = new cimg_library::CImg<float>;
 	try{
 		img -> load(&(path)[0u]);
 
-		// Split the image into chunks
-		std::vector<img_chunk*> chunks = chunker(img, n_chunks);
 		struct save_task * st = new save_task;
 		st  -> img = img;
 		st -> save_path = save_path;
-		save_queue.push(st);
+		st -> load_path = path;
+		st -> cache_key = key;
+		save_queue[node].push(st);
+
+		// In guided mode the markers take the rows of the image as they go
+		if (guided){
+			guided_nodes[node] -> add(img);
+			return;
+		}
 
-		// Push the chunks into a queue
+		// Split the image into chunks, small images go whole when batching
+		std::vector<img_chunk*> chunks = chunker(img, batch_chunks(img, n_chunks, batch_pixels));
+
+		// Add the chunks to the batch, pushed into a queue once large enough (every chunk without batching)
 		for (unsigned int i = 0; i < chunks.size(); i++){
 			task *t = new task;
 			t -> img = img;
 			t -> chunk = chunks.at(i);
 			t -> save_path = save_path;
-			tasks_queue.push(t);
-
+			if (!open_batch){
+				open_batch = new task_batch;
+				open_batch -> pixels = 0;
+			}
+			open_batch -> tasks.push_back(t);
+			open_batch -> pixels += (long) img -> width() * img -> height() / chunks.size();
+			if (open_batch -> pixels >= batch_pixels)
+				flush_batch(node);
 		}
 	}catch (const cimg_library::CImgIOException& e) {
 	    std::cerr << "Error reading image " << path << ": " << e.what() << std::endl;
 		delete(img);
+		if (dedupe_cache)
+			dedupe_cache -> abort(key);
 	}
 }
 
 // Function to be executed by workers, that parallelizes the loading of the images
-void loading_stage(int ti){
+void loading_stage(int ti, float intensity){
 	int tn = 0;
     int usecmin = INT_MAX;
     int usecmax = 0;
     long usectot = 0; 
 
+	// The images are decoded, hence allocated, on the node of the loader
+	if (!pin_self(plan.io[ti].cpu))
+		std::cerr << "Failed to pin loader " << ti << " to CPU " << plan.io[ti].cpu << std::endl;
+
 	bool loading = true;
 	while (loading){
 		auto lt = load_queue.pop();
 
 		if (lt==EOS){
 			loading = false;
+			flush_batch(plan.io[ti].node);
 			#ifdef DEBUG
 			std::cout << "Thread loader " << ti << " computed " << tn << " tasks "
 			 << " (min max avg (msecs)= " << (usecmin==INT_MAX ? 0:usecmin)/1000 << " " << usecmax/1000
@@ -83,7 +203,7 @@ void loading_stage(int ti){
 		}
 		else{
 			auto start   = std::chrono::high_resolution_clock::now();
-			load_and_chunk(lt -> load_path, lt -> n_chunks, lt -> save_path);
+			load_and_chunk(lt -> load_path, lt -> n_chunks, lt -> save_path, intensity, plan.io[ti].node);
 			delete(lt);
 			auto elapsed = std::chrono::high_resolution_clock::now() - start;
 			auto usec    = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
@@ -104,27 +224,39 @@ void saving_stage(int ti){
     int usecmax = 0;
     long usectot = 0; 
 
+	if (!pin_self(plan.io[ti].cpu))
+		std::cerr << "Failed to pin saver " << ti << " to CPU " << plan.io[ti].cpu << std::endl;
+
 	bool loading = true;
+	std::vector<save_task *> popped;
 	while (loading){
-		auto st = save_queue.pop();
-
-		if (st==EOS){
-			loading = false;
-			#ifdef DEBUG
-			std::cout << "Thread saver " << ti << " computed " << tn << " tasks "
-			 << " (min max avg (msecs)= " << (usecmin==INT_MAX ? 0:usecmin)/1000 << " " << usecmax/1000
-			 << " " << usectot/(tn>0 ? tn:1)/1000 << ") "
-			 << std::endl;
-			#endif
-		}
-		else{
+		popped.clear();
+		save_queue[plan.io[ti].node].pop_many(&popped, SAVE_POP_MANY);
+
+		for (auto st : popped){
+			if (st==EOS){
+				loading = false;
+				#ifdef DEBUG
+				std::cout << "Thread saver " << ti << " computed " << tn << " tasks "
+				 << " (min max avg (msecs)= " << (usecmin==INT_MAX ? 0:usecmin)/1000 << " " << usecmax/1000
+				 << " " << usectot/(tn>0 ? tn:1)/1000 << ") "
+				 << std::endl;
+				#endif
+				break;
+			}
 			auto start   = std::chrono::high_resolution_clock::now();
 			try{
 				st -> img -> save(&(st -> save_path)[0u]);
 				processed += 1;
+				if (done_manifest)
+					done_manifest -> record(st -> load_path, st -> save_path);
+				if (dedupe_cache)
+					dedupe_cache -> store(st -> cache_key, st -> save_path);
 			}
 			catch (const std::exception& e) {
             	std::cerr << "Error saving image " << st -> save_path << ": " << e.what() << std::endl;
+				if (dedupe_cache)
+					dedupe_cache -> abort(st -> cache_key);
         	}
 			auto elapsed = std::chrono::high_resolution_clock::now() - start;
 			auto usec    = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
@@ -140,16 +272,19 @@ void saving_stage(int ti){
 	}
 }
 
-// Function to be executed by workers, pops the chunks of images from the queue and processes them
+// Function to be executed by workers, pops the batches of chunks from the queue and processes them
 void marking_stage(int ti, float intensity){
 	int tn = 0;
     int usecmin = INT_MAX;
     int usecmax = 0;
     long usectot = 0; 
 
+	if (!pin_self(plan.compute[ti].cpu))
+		std::cerr << "Failed to pin marker " << ti << " to CPU " << plan.compute[ti].cpu << std::endl;
+
 	while (true){
-		auto task = tasks_queue.pop();
-		if (task==EOS){
+		auto batch = tasks_queue[plan.compute[ti].node].pop();
+		if (batch==EOS){
 			#ifdef DEBUG
 			std::cout << "Thread marker " << ti << " computed " << tn << " tasks "
 			 << " (min max avg (msecs)= " << (usecmin==INT_MAX ? 0:usecmin)/1000 << " " << usecmax/1000
@@ -160,13 +295,17 @@ void marking_stage(int ti, float intensity){
 		}
 		else{
 			auto start   = std::chrono::high_resolution_clock::now();
-			// Process the chunk
-			mark_chunk(task -> img, task -> chunk, wmark, intensity);	
+			// Process the chunks
+			for (task * t : batch -> tasks)
+				mark_chunk(t -> img, t -> chunk, prepared, intensity);
 			/* Don't take into account the time spent saving images  */
 			auto elapsed = std::chrono::high_resolution_clock::now() - start;
 			auto usec    = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-			delete(task -> chunk);
-			delete(task);
+			for (task * t : batch -> tasks){
+				delete(t -> chunk);
+				delete(t);
+			}
+			delete(batch);
 
 			if(usec < usecmin)
 			  usecmin = usec;
@@ -179,27 +318,123 @@ void marking_stage(int ti, float intensity){
 	}
 }
 
+// Function to be executed by workers, marks the bands of rows handed out by the guided scheduler of the node
+void guided_marking_stage(int ti, float intensity){
+	int tn = 0;
+    int usecmin = INT_MAX;
+    int usecmax = 0;
+    long usectot = 0; 
+
+	if (!pin_self(plan.compute[ti].cpu))
+		std::cerr << "Failed to pin marker " << ti << " to CPU " << plan.compute[ti].cpu << std::endl;
+
+	// Index of the marker among the ones of its node
+	int node = plan.compute[ti].node, local = 0;
+	for (int i = 0; i < ti; i++)
+		local += plan.compute[i].node == node;
+
+	cimg_library::CImg<float> * img;
+	img_chunk band;
+	while (guided_nodes[node] -> next(local, &img, &band.s_row, &band.e_row)){
+		auto start   = std::chrono::high_resolution_clock::now();
+		band.s_col = 0;
+		band.e_col = img -> width() - 1;
+		mark_chunk(img, &band, prepared, intensity);
+		auto elapsed = std::chrono::high_resolution_clock::now() - start;
+		auto usec    = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+		if(usec < usecmin)
+		  usecmin = usec;
+		if(usec > usecmax)
+		  usecmax = usec;
+		usectot += usec;
+		tn = tn + 1;
+	}
+	#ifdef DEBUG
+	std::cout << "Thread marker " << ti << " computed " << tn << " bands "
+	 << " (min max avg (msecs)= " << (usecmin==INT_MAX ? 0:usecmin)/1000 << " " << usecmax/1000
+	 << " " << usectot/(tn>0 ? tn:1)/1000 << ") "
+	 << std::endl;
+	#endif
+}
+
+// Function to be executed by workers, pops the rendering tasks and resizes, marks and encodes the renditions
+void rendering_stage(int ti){
+	int tn = 0;
+    int usecmin = INT_MAX;
+    int usecmax = 0;
+    long usectot = 0; 
+
+	if (!pin_self(plan.compute[ti].cpu))
+		std::cerr << "Failed to pin renderer " << ti << " to CPU " << plan.compute[ti].cpu << std::endl;
+
+	while (true){
+		auto rt = render_queue[plan.compute[ti].node].pop();
+		if (rt==EOS){
+			#ifdef DEBUG
+			std::cout << "Thread renderer " << ti << " computed " << tn << " tasks "
+			 << " (min max avg (msecs)= " << (usecmin==INT_MAX ? 0:usecmin)/1000 << " " << usecmax/1000
+			 << " " << usectot/(tn>0 ? tn:1)/1000 << ") "
+			 << std::endl;
+			#endif
+			return;
+		}
+		auto start   = std::chrono::high_resolution_clock::now();
+		try{
+			render(rt -> source, *rt -> target, rt -> save_path);
+			rendered += 1;
+		}catch (const cimg_library::CImgException& e) {
+			std::cerr << "Error rendering image " << rt -> save_path << ": " << e.what() << std::endl;
+		}
+		// The last rendition of an image frees the source
+		if (rt -> source -> pending.fetch_sub(1) == 1){
+			processed += 1;
+			delete(rt -> source -> img);
+			delete(rt -> source);
+		}
+		delete(rt);
+		auto elapsed = std::chrono::high_resolution_clock::now() - start;
+		auto usec    = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+		if(usec < usecmin)
+		  usecmin = usec;
+		if(usec > usecmax)
+		  usecmax = usec;
+		usectot += usec;
+		tn = tn + 1;
+	}
+}
 
 int main(int argc, char* argv[]){
 		
 	processed = 0;
+	rendered = 0;
 	std::string src_path, wmark_file;
+	std::vector<std::string> rendition_specs;
 	DIR *dirp;
     struct dirent *directory;
-	int sflag = -1, wflag = -1;
-	int c, n_workers = 1, n_chunks = 0, total_chunks = 0;
+	int sflag = -1, wflag = -1, mflag = -1, dflag = -1, fflag = -1;
+	int c, n_workers = 1, n_chunks = 0, total_chunks = 0, skipped = 0, band_budget = 0;
 	float intensity = 0.3;
 	char * end;
-	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -i <intensity> -c <chunks> -n <parallelism degree>\n"
+	const char * USAGE = "Usage -s <src_path> -w <watermark_file> -i <intensity> -c <chunks> -n <parallelism degree> -l <placement> -b <band budget> -R <rendition> -a <affinity> -k <batch> [-g] [-f] [-x] [-m] [-d]\n"
 	"-s src_path --- Directory containing the images to be watermarked\n"
 	"-w watermark_file --- Path of the watermark to be used\n"
 	"-c chunks --- Number of chunks to divide each image in, defaults to parallelism degree\n"
 	"-n parallelism degree --- Parallelism degree to be used\n"
-	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n";
+	"-i intensity --- Intensity of the watermark image, from 0 (completely transparent) to 100 (completely opaque)\n"
+	"-l placement --- Mark a single watermark in a corner (tl, tr, bl, br), in the centre (c) or at <x>,<y>, re-encoding only the JPEG blocks under it\n"
+	"-k batch --- Batch the chunks into work items of at least batch thousands of pixels, images smaller than a batch are not split\n"
+	"-g --- Guided scheduling, instead of -c chunks per image the markers take ranges of rows shrinking as the rows run out, and split the ranges in progress when idle\n"
+	"-f --- Fused mode, JPEG images are decoded, marked and encoded one band of scanlines at a time\n"
+	"-b band budget --- Bounded memory mode for images larger than RAM, MBs of pixel bands in flight per image, bands are marked by all the workers, not with -f, -g or -k\n"
+	"-R rendition --- Publish a rendition of every image from the same decode, <name>[:i=<intensity>][,s=<width>x<height>][,q=<quality>][,w=<watermark_file>] into watermarked/<name>/, can be given more than once\n"
+	"-a affinity --- Pin the workers: none (default), spread (one marker per core round robin over the NUMA nodes, images marked and saved on the node that decoded them) or smt (as spread, loaders and savers on the SMT siblings of the markers)\n"
+	"-x --- Fixed point mode, the fused (implied) and banded modes blend 8 bit samples with integer weights, within 1 LSB of the float blend\n"
+	"-m --- Incremental mode, skip the images already marked with the same watermark and intensity\n"
+	"-d --- Dedupe mode, byte-identical images are marked once and their output is linked from a cache\n";
 	std::vector<std::thread> workers;
 
 	// Parse command line arguments
-	while ((c = getopt (argc, argv, "s:w:n:i:c:")) != -1)
+	while ((c = getopt (argc, argv, "s:w:n:i:c:l:b:R:a:k:gfxmd")) != -1)
 		switch (c){
 			case 's':
 				sflag = 1;
@@ -244,6 +479,57 @@ int main(int argc, char* argv[]){
 					std::cout << "Intensity set to default " << intensity << " cause given value was out of range (0,100)" << std::endl;
 				}
 				break;
+			case 'l':
+				if (!parse_placement(optarg, &place)) {
+					std::cerr << "Invalid placement.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'b':
+				band_budget = strtol(optarg, &end, 10);
+				if (*end != '\0' || band_budget <= 0) {
+					std::cerr << "Invalid band budget.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'R':
+				rendition_specs.push_back(optarg);
+				break;
+			case 'a':
+				if (!parse_pin_policy(optarg, &pinning)) {
+					std::cerr << "Invalid affinity.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				break;
+			case 'k':
+				batch_pixels = strtol(optarg, &end, 10);
+				if (*end != '\0' || batch_pixels <= 0) {
+					std::cerr << "Invalid batch size.\n";
+					std::cerr << USAGE << std::endl;
+					exit(1);
+				}
+				batch_pixels *= 1000;
+				break;
+			case 'g':
+				guided = true;
+				break;
+			case 'f':
+				fflag = 1;
+				fused = true;
+				break;
+			case 'x':
+				fused = true;
+				fixed = true;
+				break;
+			case 'm':
+				mflag = 1;
+				break;
+			case 'd':
+				dflag = 1;
+				break;
 			case '?':
 				if (optopt == 's' || optopt =='w')
 					std::cerr << USAGE << std::endl;
@@ -262,6 +548,36 @@ int main(int argc, char* argv[]){
 		return 1;
 	}
 
+	// Renditions take their defaults from -i and -w, whatever the order of the flags
+	for (const std::string& spec : rendition_specs){
+		rendition r;
+		if (!parse_rendition(&spec[0u], intensity, wmark_file, &r)){
+			std::cerr << "Invalid rendition " << spec << ".\n";
+			std::cerr << USAGE << std::endl;
+			return 1;
+		}
+		renditions.push_back(r);
+	}
+	if (!renditions.empty() && (place.mode != PLACE_TILE || fused || band_budget > 0 || mflag == 1 || dflag == 1)){
+		std::cerr << "Renditions can't be combined with -l, -f, -x, -b, -m or -d.\n";
+		std::cerr << USAGE << std::endl;
+		return 1;
+	}
+	// The banded mode decodes, marks and encodes each image by bands itself, there are no chunks to schedule
+	if (band_budget > 0 && (fflag == 1 || guided || batch_pixels > 0)){
+		std::cerr << "The banded mode can't be combined with -f, -g or -k.\n";
+		std::cerr << USAGE << std::endl;
+		return 1;
+	}
+	try{
+		load_renditions(renditions);
+	}catch (const cimg_library::CImgIOException& e) {
+		std::cerr << "Error loading the watermark of a rendition: " << e.what() << "\nExiting.." << std::endl;
+		exit(1);
+	}
+	for (const rendition& r : renditions)
+		mkdir(&(src_path+"watermarked/"+r.name)[0u], 0700);
+
 	// Load the watermark	
 	wmark = new cimg_library::CImg<float>;
 	try{
@@ -271,32 +587,105 @@ int main(int argc, char* argv[]){
 		exit(1);
 	}
 	std::cout << "Watermark size: (" << wmark -> width() <<", " << wmark -> height() << ")" << std::endl;
+	prepared = prepare_wmark(wmark);
+	if (fixed)
+		prepare_fixed(prepared, intensity);
+	std::cout << "Watermark tiles: " << prepared -> n_empty << " empty, " << prepared -> n_full << " full, " << prepared -> n_mixed << " mixed" << std::endl;
+
+	// In incremental mode load the manifest of the images already processed, the engines are told apart
+	blend_engine blend = band_budget > 0 ? (fixed ? BLEND_BANDED_FIXED : BLEND_BANDED) : fixed ? BLEND_FIXED : fused ? BLEND_FUSED : BLEND_CIMG;
+	if (mflag == 1)
+		done_manifest = open_manifest(src_path, wmark_file, intensity, variant_key(place, blend));
+
+	// In dedupe mode outputs are linked from the content-addressed cache
+	if (dflag == 1)
+		dedupe_cache = open_cache(src_path, wmark_file, intensity, done_manifest, variant_key(place, blend));
 	
 	// If number of chunks has not been specified then set it to the parallelism degree
 	if(n_chunks == 0)
 		n_chunks = n_workers;
 	
-	std::cout << "Each image will be split in " << n_chunks << " chunks" << std::endl;
+	if (guided)
+		std::cout << "Rows of the images will be handed out by guided scheduling" << std::endl;
+	else
+		std::cout << "Each image will be split in " << n_chunks << " chunks" << std::endl;
+	if (batch_pixels > 0 && !guided)
+		std::cout << "Chunks will be batched into work items of at least " << batch_pixels << " pixels" << std::endl;
+
+	// Every stage has n_workers workers, loader and saver i are on the node of marker i
+	plan = plan_affinity(read_topology(), pinning, n_workers, n_workers);
+	if (pinning != PIN_NONE)
+		std::cout << "Pinned workers: " << describe_plan(plan) << std::endl;
+	tasks_queue = new queue<struct task_batch *>[plan.n_nodes];
+	render_queue = new queue<struct render_task *>[plan.n_nodes];
+	save_queue = new queue<struct save_task *>[plan.n_nodes];
+	for (int n = 0; n < plan.n_nodes && guided; n++){
+		int markers = 0;
+		for (const cpu_slot& slot : plan.compute)
+			markers += slot.node == n;
+		guided_nodes.push_back(new guided_rows(markers));
+	}
+
 	// Open the directory containing the images to be watermarked
     dirp = opendir(&src_path[0u]);
 	int n_imgs = 0;
+	std::vector<load_task *> banded;
 
     if (dirp){
         while ((directory = readdir(dirp)) != NULL){
 			if (strendswith(directory->d_name, ".jpg")){
 				std::string tmp(directory->d_name);
+				if (done_manifest && done_manifest -> up_to_date(src_path+tmp, src_path+"/watermarked/"+directory->d_name)){
+					skipped += 1;
+					continue;
+				}
 				
 				// Open the img and prepare the loading tasks
 				load_task * lt = new load_task;
 				lt -> load_path = src_path+tmp;
 				lt -> save_path = src_path+"/watermarked/"+directory->d_name;
 				lt -> n_chunks = n_chunks;
-				load_queue.push(lt);
+				if (band_budget > 0)
+					banded.push_back(lt);
+				else
+					load_queue.push(lt);
 
 				total_chunks = total_chunks + n_chunks;
 				n_imgs += 1;
 			}
         }
+		/* BANDED STAGE -- one image at a time, the workers mark the bands of the image */
+		if (band_budget > 0){
+			auto start = std::chrono::high_resolution_clock::now();
+			for (load_task * lt : banded){
+				// Identical images are marked only once
+				uint64_t key = 0;
+				if (dedupe_cache && dedupe_cache -> fetch(lt -> load_path, lt -> save_path, &key) != CACHE_MISS){
+					delete(lt);
+					continue;
+				}
+				// With a placement only the blocks under the watermark are decoded, whatever the size of the image
+				try{
+					if (place.mode != PLACE_TILE)
+						mark_region_file(lt -> load_path, lt -> save_path, wmark, intensity, place);
+					else
+						mark_banded_file(lt -> load_path, lt -> save_path, prepared, intensity, n_workers, (size_t) band_budget << 20);
+					processed += 1;
+					if (done_manifest)
+						done_manifest -> record(lt -> load_path, lt -> save_path);
+					if (dedupe_cache)
+						dedupe_cache -> store(key, lt -> save_path);
+				}catch (const cimg_library::CImgIOException& e) {
+					std::cerr << "Error marking image " << lt -> load_path << ": " << e.what() << std::endl;
+					if (dedupe_cache)
+						dedupe_cache -> abort(key);
+				}
+				delete(lt);
+			}
+			auto elapsed = std::chrono::high_resolution_clock::now() - start;
+			std::cout << "Banded stage done in " << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << std::endl;
+		}
+
 		auto start = std::chrono::high_resolution_clock::now();
 		/* LOADING STAGE -- not in a proper pipeline just doing it a tad bit faster for convenience */
 		// EOS to signal that no more tasks are available			
@@ -307,7 +696,7 @@ int main(int argc, char* argv[]){
 
 		// Initialize the workers
 		for (int i=0;i<n_workers;i++)
-			workers.push_back(std::thread(loading_stage, i));
+			workers.push_back(std::thread(loading_stage, i, intensity));
         
 		for (std::thread& t: workers)
 			t.join();
@@ -320,13 +709,13 @@ int main(int argc, char* argv[]){
 		start = std::chrono::high_resolution_clock::now();
 		/* MARKING STAGE*/
 		// EOS to signal that no more tasks are available			
-		for (int m = 0; m < n_workers; m++){
-			tasks_queue.push(EOS);
+		for (int m = 0; m < n_workers && !guided; m++){
+			tasks_queue[plan.compute[m].node].push(EOS);
 		}
 
 		// Initialize the workers
 		for (int i=0;i<n_workers;i++)
-			workers.push_back(std::thread(marking_stage, i, intensity));
+			workers.push_back(guided ? std::thread(guided_marking_stage, i, intensity) : std::thread(marking_stage, i, intensity));
 
 		for (std::thread& t: workers)
 			t.join();
@@ -334,14 +723,33 @@ int main(int argc, char* argv[]){
 		elapsed = std::chrono::high_resolution_clock::now() - start;
 		msec    = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
 		std::cout << "Processing stage done in " << msec << std::endl;
+		for (guided_rows * g : guided_nodes)
+			std::cout << "Guided scheduling: " << g -> claims() << " ranges claimed, " << g -> splits() << " split" << std::endl;
 
 		workers.clear();
 
+		/* RENDERING STAGE -- the renditions of the decoded images, each one resized, marked and encoded */
+		if (!renditions.empty()){
+			start = std::chrono::high_resolution_clock::now();
+			for (int m = 0; m < n_workers; m++){
+				render_queue[plan.compute[m].node].push(EOS);
+			}
+			for (int i=0;i<n_workers;i++)
+				workers.push_back(std::thread(rendering_stage, i));
+			for (std::thread& t: workers)
+				t.join();
+			elapsed = std::chrono::high_resolution_clock::now() - start;
+			msec    = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+			std::cout << "Rendering stage done in " << msec << std::endl;
+			std::cout << "Rendered a total of " << rendered << " renditions" << std::endl;
+			workers.clear();
+		}
+
 		start = std::chrono::high_resolution_clock::now();
 		/* SAVING STAGE -- not in a proper pipeline just doing it a tad bit faster for convenience */
 		// EOS to signal that no more tasks are available			
 		for (int m = 0; m < n_workers; m++){
-			save_queue.push(EOS);
+			save_queue[plan.io[m].node].push(EOS);
 		}
 
 		// Initialize the workers
@@ -356,7 +764,22 @@ int main(int argc, char* argv[]){
 		std::cout << "Saving stage done in " << msec << std::endl;
 
 		std::cout << "Processed a total of " << processed << " images" << std::endl;
+		if (done_manifest){
+			std::cout << "Skipped " << skipped << " up to date images" << std::endl;
+			delete(done_manifest);
+		}
+		if (dedupe_cache){
+			dedupe_cache -> report();
+			delete(dedupe_cache);
+		}
 		closedir(dirp);
+		free_renditions(renditions);
+		delete[](tasks_queue);
+		delete[](render_queue);
+		delete[](save_queue);
+		for (guided_rows * g : guided_nodes)
+			delete(g);
+		delete(prepared);
 		delete(wmark);
 		delete(directory);
     }
@@ -0,0 +1,332 @@
+#include <type_traits>
+#include "wmark.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Function to prepare a watermark, the image is not copied and has to outlive the prepared watermark
+prepared_wmark * prepare_wmark(cimg_library::CImg<float> * wmark){
+	static std::atomic<uint64_t> generations(0);
+	prepared_wmark * pw = new prepared_wmark;
+	pw -> generation = ++generations;
+	int width = wmark -> width(), height = wmark -> height();
+	pw -> img = wmark;
+	pw -> tiles_x = (width + WM_TILE - 1) / WM_TILE;
+	pw -> tiles_y = (height + WM_TILE - 1) / WM_TILE;
+	pw -> n_empty = pw -> n_full = pw -> n_mixed = 0;
+	pw -> fixed = false;
+
+	// Without 3 channels there is no threshold and every pixel is marked, with 4 the transparent ones are not
+	pw -> mask.assign(width * height, 1);
+	if (wmark -> spectrum() == 3)
+		for (int row = 0; row < height; row++)
+			for (int col = 0; col < width; col++)
+				pw -> mask[row * width + col] = (*wmark)(col,row,0,0) + (*wmark)(col,row,0,1) + (*wmark)(col,row,0,2) < 500;
+	if (wmark -> spectrum() == 4){
+		pw -> alpha.resize(width * height);
+		for (int row = 0; row < height; row++)
+			for (int col = 0; col < width; col++){
+				pw -> alpha[row * width + col] = std::min(std::max((*wmark)(col,row,0,3), 0.0f), 255.0f) / 255;
+				pw -> mask[row * width + col] = pw -> alpha[row * width + col] > 0;
+			}
+	}
+
+	// The conversion to YCbCr is done once here, for blending straight on the planes of JPEG images
+	if (wmark -> spectrum() >= 3){
+		pw -> ycc.resize(3 * width * height);
+		float * y = pw -> ycc.data(), * cb = y + width * height, * cr = cb + width * height;
+		for (int row = 0; row < height; row++)
+			for (int col = 0; col < width; col++){
+				float r = (*wmark)(col,row,0,0), g = (*wmark)(col,row,0,1), b = (*wmark)(col,row,0,2);
+				int i = row * width + col;
+				y[i] = 0.299f * r + 0.587f * g + 0.114f * b;
+				cb[i] = -0.168736f * r - 0.331264f * g + 0.5f * b + 128;
+				cr[i] = 0.5f * r - 0.418688f * g - 0.081312f * b + 128;
+			}
+	}
+
+	pw -> tiles.resize(pw -> tiles_x * pw -> tiles_y);
+	for (int ty = 0; ty < pw -> tiles_y; ty++)
+		for (int tx = 0; tx < pw -> tiles_x; tx++){
+			int marked = 0, pixels = 0;
+			for (int row = ty * WM_TILE; row < std::min((ty + 1) * WM_TILE, height); row++)
+				for (int col = tx * WM_TILE; col < std::min((tx + 1) * WM_TILE, width); col++, pixels++)
+					marked += pw -> mask[row * width + col];
+			unsigned char state = marked == 0 ? TILE_EMPTY : (marked == pixels ? TILE_FULL : TILE_MIXED);
+			pw -> tiles[ty * pw -> tiles_x + tx] = state;
+			if (state == TILE_EMPTY)
+				pw -> n_empty += 1;
+			else if (state == TILE_FULL)
+				pw -> n_full += 1;
+			else
+				pw -> n_mixed += 1;
+		}
+	return pw;
+}
+
+// Function to precompute the fixed point blend, mark_row uses it from then on when called at this intensity
+void prepare_fixed(prepared_wmark * wmark, float intensity){
+	cimg_library::CImg<float> * wm = wmark -> img;
+	int pixels = wm -> width() * wm -> height();
+	uint16_t keep = (uint16_t) std::min(65535.0f, (1 - intensity) * 65536 + 0.5f);
+	wmark -> fixed = true;
+	wmark -> fixed_intensity = intensity;
+	// One more LSB of Q8 on top of the product makes up for the truncation of the multiply-high
+	wmark -> fixed_keep_gray.assign(pixels, keep);
+	wmark -> fixed_term_gray.resize(pixels);
+	for (int i = 0; i < pixels; i++)
+		wmark -> fixed_term_gray[i] = (uint16_t) (wm -> data()[i] * intensity * 256 + 1);
+	wmark -> fixed_keep_rgb.clear();
+	wmark -> fixed_term_rgb.clear();
+	if (wm -> spectrum() >= 3){
+		wmark -> fixed_keep_rgb.resize(3 * pixels);
+		wmark -> fixed_term_rgb.resize(3 * pixels);
+		for (int i = 0; i < pixels; i++){
+			// Effective intensity of the pixel, scaled by its alpha if any
+			float weight = wmark -> alpha.empty() ? intensity : intensity * wmark -> alpha[i];
+			uint16_t pixel_keep = (uint16_t) std::min(65535.0f, (1 - weight) * 65536 + 0.5f);
+			for (int c = 0; c < 3; c++){
+				wmark -> fixed_keep_rgb[3 * i + c] = wmark -> mask[i] ? pixel_keep : 65535;
+				wmark -> fixed_term_rgb[3 * i + c] = wmark -> mask[i] ? (uint16_t) (wm -> data()[c * pixels + i] * weight * 256 + 1) : 1;
+			}
+		}
+	}
+}
+
+// Function to blend n contiguous 8 bit samples with the fixed point weights
+static inline void blend_fixed(unsigned char * p, const uint16_t * keep, const uint16_t * term, int n){
+	int i = 0;
+#ifdef __AVX2__
+	for (; i + 16 <= n; i += 16){
+		__m256i x = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (p + i))), 8);
+		x = _mm256_mulhi_epu16(x, _mm256_loadu_si256((const __m256i *) (keep + i)));
+		x = _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_loadu_si256((const __m256i *) (term + i))), 8);
+		x = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, x), 0xD8);
+		_mm_storeu_si128((__m128i *) (p + i), _mm256_castsi256_si128(x));
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16){
+		__m128i x = _mm_loadu_si128((const __m128i *) (p + i));
+		// Unpacking below zero bytes gives the samples already shifted by 8
+		__m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, x), _mm_loadu_si128((const __m128i *) (keep + i)));
+		__m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, x), _mm_loadu_si128((const __m128i *) (keep + i + 8)));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_loadu_si128((const __m128i *) (term + i))), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_loadu_si128((const __m128i *) (term + i + 8))), 8);
+		_mm_storeu_si128((__m128i *) (p + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; i++)
+		p[i] = (unsigned char) (((((uint32_t) p[i] << 8) * keep[i] >> 16) + term[i]) >> 8);
+}
+
+// Function to mark a row of 8 bit interleaved pixels with the fixed point blend (1 or 3 channels)
+template <int channels>
+static void mark_row_fixed(unsigned char * pixels, int width, int row, const prepared_wmark * wmark, float){
+	cimg_library::CImg<float> * wm = wmark -> img;
+	int wm_width = wm -> width();
+	int wrow = row % wm -> height();
+	const bool has_3_chan = channels == 3;
+	const uint16_t * keep = has_3_chan ? &wmark -> fixed_keep_rgb[wrow * wm_width * 3] : &wmark -> fixed_keep_gray[wrow * wm_width];
+	const uint16_t * term = has_3_chan ? &wmark -> fixed_term_rgb[wrow * wm_width * 3] : &wmark -> fixed_term_gray[wrow * wm_width];
+	const unsigned char * tiles = &wmark -> tiles[wrow / WM_TILE * wmark -> tiles_x];
+	int col = 0;
+	while (col < width){
+		int wcol = col % wm_width;
+		// Runs of tiles that are not empty are blended in one go, up to the end of the watermark row
+		int len = std::min(wm_width - wcol, width - col);
+		if (has_3_chan){
+			len = std::min(WM_TILE - wcol % WM_TILE, len);
+			if (tiles[wcol / WM_TILE] == TILE_EMPTY){
+				col += len;
+				continue;
+			}
+			while (col + len < width && wcol + len < wm_width && tiles[(wcol + len) / WM_TILE] != TILE_EMPTY)
+				len += std::min(WM_TILE, std::min(wm_width - wcol - len, width - col - len));
+		}
+		blend_fixed(pixels + col * channels, keep + wcol * channels, term + wcol * channels, len * channels);
+		col += len;
+	}
+}
+
+// Function to check the fixed point blend against mark_pixel for every pixel, watermark and intensity from
+// 0 to 100, on 1 and 3 channels rows, returns the largest deviation in LSB
+int verify_fixed(){
+	int max_dev = 0;
+	// Watermark pixel x is (x, 255 - x, 0): every value shows up in the first two channels and passes the threshold.
+	// The second half of the 3 channels watermark repeats them with every other pixel white, for the mixed tiles.
+	// The RGBA watermark has the same colours and alpha y on row y.
+	cimg_library::CImg<float> gray(256, 1, 1, 1), rgb(512, 1, 1, 3), rgba(256, 256, 1, 4);
+	cimg_forX(rgb, x){
+		bool white = x >= 256 && x % 2 == 1;
+		rgb(x, 0, 0, 0) = white ? 255 : x % 256;
+		rgb(x, 0, 0, 1) = white ? 255 : 255 - x % 256;
+		rgb(x, 0, 0, 2) = white ? 255 : 0;
+	}
+	cimg_forX(gray, x)
+		gray(x, 0, 0, 0) = x;
+	cimg_forXY(rgba, x, y){
+		rgba(x, y, 0, 0) = x;
+		rgba(x, y, 0, 1) = 255 - x;
+		rgba(x, y, 0, 2) = 0;
+		rgba(x, y, 0, 3) = y;
+	}
+	cimg_library::CImg<float> * wms[3] = {&gray, &rgb, &rgba};
+	for (int w = 0; w < 3; w++){
+		int channels = std::min(wms[w] -> spectrum(), 3);
+		// Rows longer than the watermark to go through the wrap around and the scalar tail as well
+		int width = wms[w] -> width() + 37;
+		std::vector<unsigned char> pixels(width * channels);
+		prepared_wmark * pw = prepare_wmark(wms[w]);
+		int wm_width = wms[w] -> width();
+		for (int level = 0; level <= 100; level += (w == 2 ? 10 : 1)){
+			float intensity = level;
+			intensity = intensity / 100;
+			prepare_fixed(pw, intensity);
+			for (int row = 0; row < wms[w] -> height(); row++)
+				for (int in = 0; in < 256; in++){
+					std::fill(pixels.begin(), pixels.end(), in);
+					mark_row(pixels.data(), width, channels, row, pw, intensity);
+					for (int col = 0; col < width; col++){
+						// Same weight and mask as the float kernels
+						int i = row * wm_width + col % wm_width;
+						float weight = pw -> alpha.empty() ? intensity : intensity * pw -> alpha[i];
+						for (int c = 0; c < channels; c++){
+							int expected = pw -> mask[i] ? mark_pixel(in, (*wms[w])(col % wm_width, row, 0, c), weight) : in;
+							max_dev = std::max(max_dev, std::abs(pixels[col * channels + c] - expected));
+						}
+					}
+				}
+		}
+		delete(pw);
+	}
+	return max_dev;
+}
+
+// Function to mark a run of len pixels of a row, all in the same watermark tile. Pixels are pix_step apart and
+// their channels chan_step apart, watermark channels wm_plane apart. Only pixels set in the mask are marked when
+// tested, and only the first channel without a mask policy.
+template <typename T, int channels, mask_policy policy, bool tested>
+static inline void mark_run(T * px, long chan_step, const float * w, long wm_plane, const unsigned char * mask,
+	const float * alpha, int len, float intensity){
+	// CImg images are planar, rows handed over by the codecs interleaved
+	const int pix_step = std::is_same<T, float>::value ? 1 : channels;
+	for (int i = 0; i < len; i++, px += pix_step){
+		if (tested && !mask[i])
+			continue;
+		float weight = intensity;
+		if (policy == MASK_ALPHA)
+			weight = intensity * alpha[i];
+		px[0] = mark_pixel(px[0], w[i], weight);
+		if (policy != MASK_NONE){
+			px[chan_step] = mark_pixel(px[chan_step], w[wm_plane + i], weight);
+			px[2 * chan_step] = mark_pixel(px[2 * chan_step], w[2 * wm_plane + i], weight);
+		}
+	}
+}
+
+// Function to mark the pixels from col to end - 1 of an image row, walking the row one tile of the watermark at a time
+template <typename T, int channels, mask_policy policy>
+static void mark_span(T * pixels, long chan_step, int col, int end, int row, const prepared_wmark * wmark, float intensity){
+	cimg_library::CImg<float> * wm = wmark -> img;
+	const int pix_step = std::is_same<T, float>::value ? 1 : channels;
+	int wm_width = wm -> width();
+	int wrow = row % wm -> height();
+	long wm_plane = (long) wm_width * wm -> height();
+	const float * w = wm -> data(0, wrow, 0, 0);
+	const unsigned char * mask = &wmark -> mask[wrow * wm_width];
+	const float * alpha = policy == MASK_ALPHA ? &wmark -> alpha[wrow * wm_width] : nullptr;
+	const unsigned char * tiles = &wmark -> tiles[wrow / WM_TILE * wmark -> tiles_x];
+	while (col < end){
+		int wcol = col % wm_width;
+		int len = std::min(std::min(WM_TILE - wcol % WM_TILE, wm_width - wcol), end - col);
+		int state = policy == MASK_NONE ? TILE_FULL : tiles[wcol / WM_TILE];
+		if (state == TILE_FULL)
+			mark_run<T, channels, policy, false>(pixels + col * pix_step, chan_step, w + wcol, wm_plane, nullptr,
+				alpha ? alpha + wcol : nullptr, len, intensity);
+		else if (state == TILE_MIXED)
+			mark_run<T, channels, policy, true>(pixels + col * pix_step, chan_step, w + wcol, wm_plane, mask + wcol,
+				alpha ? alpha + wcol : nullptr, len, intensity);
+		col += len;
+	}
+}
+
+// Function to mark a chunk of a planar image
+template <int channels, mask_policy policy>
+static void mark_chunk_kernel(cimg_library::CImg<float> * img, img_chunk * chunk, const prepared_wmark * wmark, float intensity){
+	long plane = (long) img -> width() * img -> height();
+	for (int row = chunk -> s_row; row <= chunk -> e_row; row++){
+		int col = (row == chunk -> s_row ? chunk -> s_col : 0);
+		int end = (row == chunk -> e_row ? chunk -> e_col : img -> width() - 1) + 1;
+		mark_span<float, channels, policy>(img -> data(0, row, 0, 0), plane, col, end, row, wmark, intensity);
+	}
+}
+
+// Function to mark a row of interleaved 8 bit pixels
+template <int channels, mask_policy policy>
+static void mark_row_kernel(unsigned char * pixels, int width, int row, const prepared_wmark * wmark, float intensity){
+	mark_span<unsigned char, channels, policy>(pixels, 1, 0, width, row, wmark, intensity);
+}
+
+// Function to get the mask policy for images with the given number of channels: the colour channels are
+// masked by the threshold of a 3 channels watermark or by the alpha of a 4 channels one, otherwise the first
+// channel only is marked everywhere
+mask_policy pick_policy(int channels, const prepared_wmark * wmark){
+	int spectrum = wmark -> img -> spectrum();
+	if (channels >= 3 && spectrum == 3)
+		return MASK_THRESHOLD;
+	if (channels >= 3 && spectrum == 4)
+		return MASK_ALPHA;
+	return MASK_NONE;
+}
+
+// Function to get the index of a number of channels in the kernel tables, -1 if there is no kernel for it
+static int channels_index(int channels){
+	return channels == 1 ? 0 : (channels == 3 ? 1 : (channels == 4 ? 2 : -1));
+}
+
+// Function to pick the kernel marking chunks of images with the given number of channels
+chunk_kernel pick_chunk_kernel(int channels, const prepared_wmark * wmark){
+	static const chunk_kernel table[3][3] = {
+		{mark_chunk_kernel<1, MASK_NONE>, mark_chunk_kernel<1, MASK_NONE>, mark_chunk_kernel<1, MASK_NONE>},
+		{mark_chunk_kernel<3, MASK_THRESHOLD>, mark_chunk_kernel<3, MASK_ALPHA>, mark_chunk_kernel<3, MASK_NONE>},
+		{mark_chunk_kernel<4, MASK_THRESHOLD>, mark_chunk_kernel<4, MASK_ALPHA>, mark_chunk_kernel<4, MASK_NONE>}};
+	// Planes are apart, other numbers of channels get their first plane marked like grayscale
+	int index = channels_index(channels);
+	return table[index < 0 ? 0 : index][pick_policy(channels, wmark)];
+}
+
+// Function to pick the kernel marking rows of 8 bit pixels with the given number of channels, nullptr if none
+row_kernel pick_row_kernel(int channels, const prepared_wmark * wmark, float intensity){
+	static const row_kernel table[3][3] = {
+		{mark_row_kernel<1, MASK_NONE>, mark_row_kernel<1, MASK_NONE>, mark_row_kernel<1, MASK_NONE>},
+		{mark_row_kernel<3, MASK_THRESHOLD>, mark_row_kernel<3, MASK_ALPHA>, mark_row_kernel<3, MASK_NONE>},
+		{mark_row_kernel<4, MASK_THRESHOLD>, mark_row_kernel<4, MASK_ALPHA>, mark_row_kernel<4, MASK_NONE>}};
+	int index = channels_index(channels);
+	if (index < 0)
+		return nullptr;
+	mask_policy policy = pick_policy(channels, wmark);
+	if (wmark -> fixed && intensity == wmark -> fixed_intensity){
+		if (channels == 1)
+			return mark_row_fixed<1>;
+		if (channels == 3 && policy != MASK_NONE)
+			return mark_row_fixed<3>;
+	}
+	return table[index][policy];
+}
+
+// Function to mark a chunk of image with a prepared watermark, same result as mark_chunk with the plain one
+void mark_chunk(cimg_library::CImg<float> * img, img_chunk * chunk, const prepared_wmark * wmark, float intensity){
+	pick_chunk_kernel(img -> spectrum(), wmark)(img, chunk, wmark, intensity);
+}
+
+// Function to mark a row of 8 bit interleaved pixels (1, 3 or 4 channels), row is the index of the row in the image
+void mark_row(unsigned char * pixels, int width, int channels, int row, const prepared_wmark * wmark, float intensity){
+	row_kernel kernel = pick_row_kernel(channels, wmark, intensity);
+	if (kernel)
+		kernel(pixels, width, row, wmark, intensity);
+}
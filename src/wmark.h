@@ -0,0 +1,93 @@
+#ifndef __WMARK_H__
+#define __WMARK_H__
+
+#include <vector>
+#include <cstdint>
+#include "CImg.h"
+#include "my_utils.h"
+
+/***
+	Watermark prepared once for marking: with the < 500 threshold of mark_chunk large parts of typical
+	watermarks (white backgrounds) never change a pixel, so the per-pixel mask is computed upfront and
+	summarized in a coarse occupancy map of WM_TILE x WM_TILE tiles. The marking kernel skips empty tiles,
+	marks full tiles without testing the mask and tests it only on mixed tiles.
+***/
+
+#define WM_TILE 16
+
+enum tile_state { TILE_EMPTY, TILE_FULL, TILE_MIXED };
+
+// Data structure defining a watermark prepared for marking
+struct prepared_wmark{
+	cimg_library::CImg<float> * img;
+	int tiles_x;
+	int tiles_y;
+	std::vector<unsigned char> mask;	// 1 where the watermark pixel passes the threshold, one byte per pixel
+	std::vector<unsigned char> tiles;	// tile_state of each tile, row major
+	std::vector<float> ycc;	// Y, Cb and Cr planes of the watermark (JFIF conversion), only with 3 or 4 channels
+	std::vector<float> alpha;	// Alpha of each pixel from 0 to 1, only with 4 channels
+	int n_empty, n_full, n_mixed;
+	uint64_t generation;	// Unique to each prepared watermark, for the caches keyed on it (addresses get reused)
+	// Fixed point blend of mark_row, only once prepare_fixed is called and only at that intensity
+	bool fixed;
+	float fixed_intensity;
+	std::vector<uint16_t> fixed_keep_gray;	// 1 - intensity in Q16 per pixel, first channel only
+	std::vector<uint16_t> fixed_term_gray;	// Watermark times intensity in Q8 per pixel, first channel only
+	std::vector<uint16_t> fixed_keep_rgb;	// As above with channels interleaved and alpha baked in, only with 3 or 4 channels
+	std::vector<uint16_t> fixed_term_rgb;
+};
+
+// Function to prepare a watermark, the image is not copied and has to outlive the prepared watermark
+prepared_wmark * prepare_wmark(cimg_library::CImg<float> * wmark);
+
+/***
+	Fixed point blend for 8 bit samples: out = (((in << 8) * keep >> 16) + term) >> 8, where keep is 1 - intensity
+	in Q16 and term the watermark premultiplied by the intensity in Q8. The sum never exceeds 16 bits, so with
+	SSE2 a multiply-high marks 8 samples per instruction (16 with AVX2). The result stays within 1 LSB of mark_pixel
+	(checked exhaustively by verify_fixed). Weights are per sample: with an alpha channel the effective intensity
+	intensity * alpha is baked into keep and term, and pixels masked out get keep 65535 and term 1, which leaves
+	every sample as it is. Alpha, thresholded and mixed tiles all go through the same branchless loop.
+***/
+
+// Function to precompute the fixed point blend, mark_row uses it from then on when called at this intensity
+void prepare_fixed(prepared_wmark * wmark, float intensity);
+
+// Function to check the fixed point blend against the float kernels for every pixel, watermark and intensity
+// from 0 to 100 on 1 and 3 channels rows, and for every alpha at intensities multiple of 10, returns the
+// largest deviation in LSB
+int verify_fixed();
+
+/***
+	Marking kernels are templates instantiated per pixel type (planar float CImg images, interleaved 8 bit rows
+	of the codecs), number of channels of the image (1, 3, 4) and mask policy, so that the pixel loops have
+	neither channel nor mask tests. The instance is looked up in a table once per chunk or per image.
+	Mask policies, from the image channels and the watermark spectrum:
+	- MASK_THRESHOLD: 3 channels watermark on an RGB(A) image, the colour channels of the pixels under the
+	  < 500 threshold are marked (the alpha of RGBA images is left as it is)
+	- MASK_ALPHA: 4 channels (RGBA, e.g. PNG) watermark on an RGB(A) image, pixels with non zero alpha are
+	  marked with the intensity scaled by alpha / 255
+	- MASK_NONE: anything else, the first channel is marked everywhere (as mark_chunk does)
+***/
+
+enum mask_policy { MASK_THRESHOLD, MASK_ALPHA, MASK_NONE };
+
+typedef void (*chunk_kernel)(cimg_library::CImg<float> * img, img_chunk * chunk, const prepared_wmark * wmark, float intensity);
+typedef void (*row_kernel)(unsigned char * pixels, int width, int row, const prepared_wmark * wmark, float intensity);
+
+// Function to get the mask policy for images with the given number of channels
+mask_policy pick_policy(int channels, const prepared_wmark * wmark);
+
+// Function to pick the kernel marking chunks of images with the given number of channels
+chunk_kernel pick_chunk_kernel(int channels, const prepared_wmark * wmark);
+
+// Function to pick the kernel marking rows of 8 bit pixels with the given number of channels (1, 3 or 4, nullptr
+// otherwise), the fixed point one if prepared at this intensity
+row_kernel pick_row_kernel(int channels, const prepared_wmark * wmark, float intensity);
+
+// Function to mark a chunk of image with a prepared watermark, same result as mark_chunk with the plain one
+void mark_chunk(cimg_library::CImg<float> * img, img_chunk * chunk, const prepared_wmark * wmark, float intensity);
+
+// Function to mark a row of 8 bit interleaved pixels (1, 3 or 4 channels), row is the index of the row in the image
+void mark_row(unsigned char * pixels, int width, int channels, int row, const prepared_wmark * wmark, float intensity);
+
+#endif
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Regression test: a run without -d that rewrites the outputs must not alter the dedupe cache.
+# Identical images are marked with -d at intensity 30, then without -d at intensity 80, then with -d at
+# intensity 30 again: the outputs of the last run must be the ones of the first.
+BIN=${BIN:-out}
+WMARK=imgs/dataset5/1.jpg
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+for i in 1 2 3 4; do cp imgs/dataset5/2.jpg $DIR/$i.jpg; done
+
+fail(){ echo "FAIL: $1"; exit 1; }
+
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 30 -d > /dev/null || fail "first dedupe run"
+md5sum $DIR/watermarked/*.jpg | awk '{print $1}' > $DIR/i30.md5
+for f in $DIR/watermarked/*.jpg $DIR/watermarked/.cache/*.jpg; do
+	[ "$(stat -c %h $f)" = 1 ] || fail "$f shares its inode"
+done
+objects=$(md5sum $DIR/watermarked/.cache/*.jpg)
+
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 80 > /dev/null || fail "plain run"
+[ "$(md5sum $DIR/watermarked/.cache/*.jpg)" = "$objects" ] || fail "the plain run changed the cache"
+
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 30 -d > /dev/null || fail "second dedupe run"
+md5sum $DIR/watermarked/*.jpg | awk '{print $1}' | cmp -s - $DIR/i30.md5 || fail "the second dedupe run left other outputs"
+echo "PASS: dedupe_overwrite"
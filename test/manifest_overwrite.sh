@@ -0,0 +1,22 @@
+#!/bin/bash
+# Regression test: an output rewritten by a run without -m must not be skipped by the next -m run.
+# Images are marked with -m at intensity 30, then without -m at intensity 90, then with -m at intensity 30
+# again: the last run must process every image and leave the outputs of the first.
+BIN=${BIN:-out}
+WMARK=imgs/dataset5/1.jpg
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+for i in 2 3 4; do cp imgs/dataset5/$i.jpg $DIR/$i.jpg; done
+
+fail(){ echo "FAIL: $1"; exit 1; }
+
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 30 -m > /dev/null || fail "first incremental run"
+md5sum $DIR/watermarked/*.jpg | awk '{print $1}' > $DIR/i30.md5
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 30 -m | grep -q "Skipped 3 up to date" || fail "unchanged outputs not skipped"
+
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 90 > /dev/null || fail "plain run"
+rm $DIR/watermarked/4.jpg
+
+$BIN/watermarker -s $DIR/ -w $WMARK -n 2 -i 30 -m | grep -q "Skipped 0 up to date" || fail "rewritten or removed outputs skipped"
+md5sum $DIR/watermarked/*.jpg | awk '{print $1}' | cmp -s - $DIR/i30.md5 || fail "the outputs of the plain run were left"
+echo "PASS: manifest_overwrite"
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Regression test: with fewer connections than -n, batches never fill up, and a lone request must still be
+# marked within the batch window instead of waiting for a full batch. The server must then stop on SIGTERM.
+BIN=${BIN:-out}
+WMARK=imgs/dataset5/1.jpg
+DIR=$(mktemp -d)
+SERVER=
+trap '[ -n "$SERVER" ] && kill -9 $SERVER 2> /dev/null; rm -rf $DIR' EXIT
+
+fail(){ echo "FAIL: $1"; exit 1; }
+
+$BIN/servewatermarker -w $WMARK -u $DIR/sock -i 30 -n 4 > $DIR/server.log 2>&1 &
+SERVER=$!
+for i in $(seq 1 100); do
+	[ -S $DIR/sock ] && break
+	sleep 0.1
+done
+[ -S $DIR/sock ] || fail "the server didn't start"
+
+timeout 30 $BIN/loadgen -f imgs/dataset5/2.jpg -u $DIR/sock -c 1 -r 1 > /dev/null || fail "a lone request wasn't answered"
+timeout 30 $BIN/loadgen -f imgs/dataset5/2.jpg -u $DIR/sock -c 2 -r 5 > /dev/null || fail "2 connections on 4 markers weren't answered"
+timeout 30 $BIN/loadgen -f imgs/dataset5/2.jpg -u $DIR/sock -c 3 -r 5 -x > /dev/null || fail "3 connections on 4 markers weren't answered"
+
+kill -TERM $SERVER
+for i in $(seq 1 100); do
+	kill -0 $SERVER 2> /dev/null || break
+	sleep 0.1
+done
+kill -0 $SERVER 2> /dev/null && fail "the server didn't stop on SIGTERM"
+wait $SERVER || fail "the server exited with an error"
+SERVER=
+echo "PASS: serve_batch"
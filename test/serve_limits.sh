@@ -0,0 +1,45 @@
+#!/bin/bash
+# Regression test: an image whose header declares more pixels than -z is answered 413 without being decoded
+# (a few bytes can declare 65500x65500 pixels, libjpeg fills the missing data), a body that is not a JPEG 400,
+# and the server keeps serving the images within the limit.
+BIN=${BIN:-out}
+WMARK=imgs/dataset5/1.jpg
+DIR=$(mktemp -d)
+SERVER=
+trap '[ -n "$SERVER" ] && kill -9 $SERVER 2> /dev/null; rm -rf $DIR' EXIT
+
+fail(){ echo "FAIL: $1"; exit 1; }
+
+# The dataset image with its size rewritten in the SOF marker and the entropy coded data cut short
+python3 - $DIR <<'EOF'
+import struct, sys
+d = sys.argv[1]
+data = open('imgs/dataset5/1.jpg', 'rb').read()
+sof = data.find(b'\xff\xc0')
+sos = data.find(b'\xff\xda')
+for name, width, height in (('huge', 65500, 65500), ('large', 2000, 1000)):
+	patched = data[:sof + 5] + struct.pack('>HH', height, width) + data[sof + 9:sos + 64] + b'\xff\xd9'
+	open(d + '/' + name + '.jpg', 'wb').write(patched)
+open(d + '/text.jpg', 'wb').write(b'not a jpeg')
+EOF
+[ $? = 0 ] || fail "test inputs"
+
+$BIN/servewatermarker -w $WMARK -u $DIR/sock -i 30 -n 2 -z 1 > $DIR/server.log 2>&1 &
+SERVER=$!
+for i in $(seq 1 100); do
+	[ -S $DIR/sock ] && break
+	sleep 0.1
+done
+[ -S $DIR/sock ] || fail "the server didn't start"
+
+post(){ curl -s -o $DIR/out -w '%{http_code}' --max-time 30 --unix-socket $DIR/sock --data-binary @$1 -H 'Content-Type: image/jpeg' http://localhost/mark; }
+[ "$(post $DIR/huge.jpg)" = 413 ] || fail "65500x65500 header not answered 413"
+[ "$(post $DIR/large.jpg)" = 413 ] || fail "2 megapixels header not answered 413 with -z 1"
+[ "$(post $DIR/text.jpg)" = 400 ] || fail "non JPEG body not answered 400"
+[ "$(post imgs/dataset5/2.jpg)" = 200 ] || fail "image within the limit not marked"
+[ "$(head -c 2 $DIR/out | od -An -tx1 | tr -d ' ')" = ffd8 ] || fail "the response is not a JPEG"
+
+kill -TERM $SERVER
+wait $SERVER || fail "the server exited with an error"
+SERVER=
+echo "PASS: serve_limits"
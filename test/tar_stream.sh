@@ -0,0 +1,89 @@
+#!/bin/bash
+# Tar and frame parsing: ustar, GNU long names and pax archives must round trip through streamwatermarker,
+# malformed streams (bad checksum, negative or oversized sizes, truncated entries and frames) must be
+# reported with exit status 1 instead of aborting.
+BIN=${BIN:-out}
+WMARK=imgs/dataset5/1.jpg
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+fail(){ echo "FAIL: $1"; exit 1; }
+
+LONG=$(printf 'd%.0s' $(seq 1 60))/$(printf 'e%.0s' $(seq 1 60))
+mkdir -p $DIR/src/short $DIR/src/$LONG
+cp imgs/dataset5/2.jpg $DIR/src/short/a.jpg
+cp imgs/dataset5/3.jpg $DIR/src/$LONG/$(printf 'f%.0s' $(seq 1 90)).jpg
+echo "not an image" > $DIR/src/short/notes.txt
+
+# Well formed archives: every entry comes out, with its name and link target
+for format in ustar gnu pax; do
+	# ustar splits the long path in prefix and name, it can't hold the long link target
+	rm -f $DIR/src/short/link
+	[ $format = ustar ] || ln -s ../$LONG $DIR/src/short/link
+	(cd $DIR/src && tar --format=$format -cf $DIR/in.tar short $LONG) || fail "$format archive"
+	$BIN/streamwatermarker -w $WMARK -i 30 -n 2 < $DIR/in.tar > $DIR/out.tar 2> /dev/null || fail "$format stream"
+	cmp -s <(tar -tf $DIR/in.tar) <(tar -tf $DIR/out.tar) || fail "$format entries differ"
+	rm -rf $DIR/x && mkdir $DIR/x && tar -xf $DIR/out.tar -C $DIR/x || fail "$format output"
+	cmp -s $DIR/src/short/notes.txt $DIR/x/short/notes.txt || fail "$format changed a plain entry"
+	cmp -s $DIR/src/short/a.jpg $DIR/x/short/a.jpg && fail "$format left an image unmarked"
+	[ $format = ustar ] || [ "$(readlink $DIR/x/short/link)" = "../$LONG" ] || fail "$format link target"
+done
+
+# Malformed archives, built from a valid header with the size and checksum fields rewritten
+python3 - $DIR <<'EOF'
+import struct, sys
+d = sys.argv[1]
+def header(name, size_field, typeflag=b'0', fix=True):
+	h = bytearray(512)
+	h[0:len(name)] = name
+	h[100:108] = b'0000644\0'
+	h[124:136] = size_field
+	h[136:148] = b'00000000000\0'
+	h[156:157] = typeflag
+	h[257:263] = b'ustar\0'
+	h[263:265] = b'00'
+	h[148:156] = b' ' * 8
+	if fix:
+		h[148:156] = b'%06o\0 ' % sum(h)
+	return bytes(h)
+end = b'\0' * 1024
+open(d + '/checksum.tar', 'wb').write(header(b'a.txt', b'00000000004\0', fix=False)[:148] + b'0000001\0' + header(b'a.txt', b'00000000004\0')[156:] + b'abcd'.ljust(512, b'\0') + end)
+open(d + '/negative.tar', 'wb').write(header(b'a.txt', b'\xff' * 12) + end)
+open(d + '/huge.tar', 'wb').write(header(b'a.txt', b'\x80' + b'\0' * 5 + b'\x7f' + b'\xff' * 5) + end)
+open(d + '/truncated.tar', 'wb').write(header(b'a.txt', b'00000010000\0') + b'x' * 1000)
+open(d + '/longname.tar', 'wb').write(header(b'././@LongLink', b'77777777777\0', b'L') + b'x' * 512)
+pax = b'30 path=' + b'p' * 30 + b'\n'
+open(d + '/pax.tar', 'wb').write(header(b'pax', b'%011o\0' % len(pax), b'x') + pax.ljust(512, b'\0') + header(b'a.txt', b'00000000000\0') + end)
+open(d + '/frame_name.bin', 'wb').write(struct.pack('>I', 0xffffffff) + b'x' * 16)
+open(d + '/frame_size.bin', 'wb').write(struct.pack('>I', 5) + b'a.txt' + struct.pack('>Q', 1 << 62) + b'x' * 16)
+open(d + '/frame_negative.bin', 'wb').write(struct.pack('>I', 5) + b'a.txt' + struct.pack('>Q', (1 << 64) - 1))
+open(d + '/frame_truncated.bin', 'wb').write(struct.pack('>I', 5) + b'a.txt' + struct.pack('>Q', 100) + b'x' * 10)
+open(d + '/frame_header.bin', 'wb').write(struct.pack('>I', 5) + b'a.t')
+EOF
+[ $? = 0 ] || fail "malformed inputs"
+
+malformed(){
+	local input=$1 flags=$2
+	# Both from a regular file, where the sizes are also checked against what is left, and from a pipe
+	$BIN/streamwatermarker -w $WMARK -i 30 -n 2 $flags < $DIR/$input > /dev/null 2> $DIR/err
+	[ $? = 1 ] && grep -q "Malformed input stream" $DIR/err || fail "$input from a file"
+	cat $DIR/$input | $BIN/streamwatermarker -w $WMARK -i 30 -n 2 $flags > /dev/null 2> $DIR/err
+	[ $? = 1 ] && grep -q "Malformed input stream" $DIR/err || fail "$input from a pipe"
+}
+for input in checksum.tar negative.tar huge.tar truncated.tar longname.tar pax.tar; do
+	malformed $input
+done
+for input in frame_name.bin frame_size.bin frame_negative.bin frame_truncated.bin frame_header.bin; do
+	malformed $input -f
+done
+
+# Well formed frames, and an empty stream, still end normally
+python3 -c "
+import struct, sys
+data = open('imgs/dataset5/2.jpg', 'rb').read()
+sys.stdout.buffer.write(struct.pack('>I', 5) + b'a.jpg' + struct.pack('>Q', len(data)) + data)" > $DIR/frames.bin
+$BIN/streamwatermarker -w $WMARK -i 30 -n 2 -f < $DIR/frames.bin > $DIR/out.bin 2> /dev/null || fail "frame stream"
+[ -s $DIR/out.bin ] || fail "frame output"
+$BIN/streamwatermarker -w $WMARK -i 30 -n 2 -f < /dev/null > /dev/null 2>&1 || fail "empty frame stream"
+$BIN/streamwatermarker -w $WMARK -i 30 -n 2 < /dev/null > /dev/null 2>&1 || fail "empty tar stream"
+echo "PASS: tar_stream"
@@ -0,0 +1,19 @@
+#!/bin/bash
+# The YCbCr mode must stay within YCC_MEAN_TOLERANCE (fused.h) of the RGB path, as checked by seqwatermarker -v,
+# on 4:2:0 (dataset), 4:2:2 and 4:4:4 subsampled and grayscale JPEGs, each image on its own and at several
+# intensities.
+BIN=${BIN:-out}
+WMARK=imgs/dataset5/1.jpg
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+fail(){ echo "FAIL: $1"; exit 1; }
+
+for img in imgs/dataset5/1.jpg test/imgs/422.jpg test/imgs/444.jpg test/imgs/gray.jpg; do
+	rm -rf $DIR/src && mkdir $DIR/src && cp $img $DIR/src/
+	for intensity in 10 30 60 100; do
+		$BIN/seqwatermarker -s $DIR/src/ -w $WMARK -i $intensity -v > $DIR/log 2>&1 || fail "$img at intensity $intensity: $(grep Mean $DIR/log)"
+		grep -q "Processed a total of 1 images" $DIR/log || fail "$img at intensity $intensity wasn't marked"
+	done
+done
+echo "PASS: ycc_tolerance"